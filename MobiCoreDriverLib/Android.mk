@@ -24,8 +24,10 @@ LOCAL_SRC_FILES += \
     ClientLib/Device.cpp \
     ClientLib/ClientLib.cpp \
     ClientLib/Session.cpp \
+    ClientLib/NotificationChannel.cpp \
     Common/CMutex.cpp \
     Common/Connection.cpp \
+    Common/NotificationRing.cpp \
     ClientLib/GP/tee_client_api.cpp
 
 LOCAL_C_INCLUDES +=\
@@ -57,13 +59,15 @@ LOCAL_CFLAGS += -include buildTag.h
 LOCAL_CFLAGS += -DLOG_TAG=\"McDaemon\"
 LOCAL_CFLAGS += -DTBASE_API_LEVEL=3
 LOCAL_C_INCLUDES += $(GLOBAL_INCLUDES)
-LOCAL_SHARED_LIBRARIES += $(GLOBAL_LIBRARIES) libMcClient libMcRegistry
+LOCAL_SHARED_LIBRARIES += $(GLOBAL_LIBRARIES) libMcClient libMcRegistry libz
 
 include $(LOCAL_PATH)/Daemon/Android.mk
 
 # Common Source files required for building the daemon
 LOCAL_SRC_FILES += Common/CMutex.cpp \
+    Common/CRWLock.cpp \
     Common/Connection.cpp \
+    Common/NotificationRing.cpp \
     Common/NetlinkConnection.cpp \
     Common/CSemaphore.cpp \
     Common/CThread.cpp
@@ -118,3 +122,49 @@ include $(LOCAL_PATH)/Registry/Android.mk
 include $(COMP_PATH_Logwrapper)/Android.mk
 
 include $(BUILD_SHARED_LIBRARY)
+
+# Registry store benchmark
+# =============================================================================
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := mcRegistryBench
+LOCAL_MODULE_TAGS := optional
+LOCAL_C_INCLUDES += $(GLOBAL_INCLUDES)
+LOCAL_SHARED_LIBRARIES += $(GLOBAL_LIBRARIES) libMcRegistry
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/Registry/Public \
+     $(LOCAL_PATH)/ClientLib/public
+
+LOCAL_SRC_FILES += Registry/Bench/RegistryStoreBench.cpp
+
+include $(BUILD_EXECUTABLE)
+
+# FSD backend benchmark
+# =============================================================================
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := mcFsdBench
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS += -DLOG_TAG=\"McFsdBench\"
+LOCAL_C_INCLUDES += $(GLOBAL_INCLUDES)
+LOCAL_SHARED_LIBRARIES += $(GLOBAL_LIBRARIES) libz
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/Common \
+     $(LOCAL_PATH)/Daemon/FSD/public \
+     $(LOCAL_PATH)/Registry/Public \
+     $(LOCAL_PATH)/Registry \
+     $(LOCAL_PATH)/ClientLib/public \
+     $(LOCAL_PATH)/ClientLib/public/GP
+
+LOCAL_SRC_FILES += Daemon/FSD/Bench/FSDBackendBench.cpp \
+     Daemon/FSD/FSDBackend.cpp \
+     Daemon/FSD/FSDFdCache.cpp \
+     Daemon/FSD/FSDPackBackend.cpp \
+     Common/CMutex.cpp \
+     Common/CSemaphore.cpp \
+     Common/CThread.cpp
+
+# Import logwrapper
+include $(COMP_PATH_Logwrapper)/Android.mk
+
+include $(BUILD_EXECUTABLE)
@@ -39,6 +39,10 @@
 #include <stdbool.h>
 #include <list>
 #include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
 #include "assert.h"
 #endif
 
@@ -60,12 +64,6 @@
 
 MC_CHECK_VERSION(DAEMON, 0, 2);
 
-/** Notification data structure. */
-typedef struct {
-    uint32_t sessionId; /**< Session ID. */
-    int32_t payload; /**< Additional notification information. */
-} notification_t;
-
 using namespace std;
 
 static list<Device *> devices;
@@ -74,8 +72,24 @@ static list<Device *> devices;
 uint32_t getDaemonVersion(Connection *devCon, uint32_t *version);
 
 static CMutex devMutex;
+
+/** Keep-alive: with MC_DEVICE_KEEPALIVE_MS set in the environment, the last
+ * mcCloseDevice() of a device leaves its daemon connection open for that
+ * many milliseconds. Reopening the device meanwhile costs no system call.
+ * A lingering device has an openCount of 0, and a keep-alive thread closes
+ * it once its time is up. A child process forgets the lingering devices it
+ * inherits. */
+#define ENV_MC_DEVICE_KEEPALIVE_MS "MC_DEVICE_KEEPALIVE_MS"
+
+static uint32_t keepAliveMs = 0;
+static pthread_once_t keepAliveOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t keepAliveMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t keepAliveCond = PTHREAD_COND_INITIALIZER;
+static bool keepAliveStarted = false;
+static uint64_t keepAliveDeadline = 0; /**< Earliest close due, 0 if none */
+
 //------------------------------------------------------------------------------
-Device *resolveDeviceId(uint32_t deviceId)
+static Device *findDevice(uint32_t deviceId)
 {
     for (list<Device *>::iterator iterator = devices.begin();
             iterator != devices.end();
@@ -89,6 +103,18 @@ Device *resolveDeviceId(uint32_t deviceId)
     return NULL;
 }
 
+//------------------------------------------------------------------------------
+Device *resolveDeviceId(uint32_t deviceId)
+{
+    Device *device = findDevice(deviceId);
+
+    // A lingering device is closed as far as the application can tell
+    if (device != NULL && device->openCount == 0) {
+        return NULL;
+    }
+    return device;
+}
+
 
 //------------------------------------------------------------------------------
 void addDevice(Device *device)
@@ -186,6 +212,349 @@ bool removeDevice(uint32_t deviceId)
         break; \
     } \
 }
+
+//------------------------------------------------------------------------------
+static uint64_t nowMs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+//------------------------------------------------------------------------------
+/** Hold the locks of the keep-alive across fork(), in their usual order. */
+static void keepAlivePrepareFork(void)
+{
+    devMutex.lock();
+    pthread_mutex_lock(&keepAliveMutex);
+}
+
+//------------------------------------------------------------------------------
+static void keepAliveParentFork(void)
+{
+    pthread_mutex_unlock(&keepAliveMutex);
+    devMutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+/** The child has no keep-alive thread, and the connections of the lingering
+ * devices belong to the parent: close the child's copies without telling the
+ * daemon. */
+static void keepAliveChildFork(void)
+{
+    for (list<Device *>::iterator iterator = devices.begin();
+            iterator != devices.end();) {
+        Device  *device = (*iterator);
+
+        if (device->openCount == 0) {
+            iterator = devices.erase(iterator);
+            delete device;
+        } else {
+            ++iterator;
+        }
+    }
+    keepAliveStarted = false;
+    keepAliveDeadline = 0;
+    pthread_cond_init(&keepAliveCond, NULL);
+    pthread_mutex_unlock(&keepAliveMutex);
+    devMutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+static void readKeepAlive(void)
+{
+    const char *value = getenv(ENV_MC_DEVICE_KEEPALIVE_MS);
+
+    if (value != NULL) {
+        keepAliveMs = strtoul(value, NULL, 0);
+        LOG_I("Device connections kept alive for %u ms", keepAliveMs);
+    }
+    if (keepAliveMs != 0 &&
+            pthread_atfork(keepAlivePrepareFork, keepAliveParentFork, keepAliveChildFork) != 0) {
+        LOG_W("Cannot handle fork(), device connections are not kept alive");
+        keepAliveMs = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Close the lingering devices whose time is up, called with devMutex held.
+ * @return when the next lingering device is due, 0 if there is none. */
+static uint64_t closeLingeringDevices(void)
+{
+    uint64_t now = nowMs();
+    uint64_t next = 0;
+    list<uint32_t> expired;
+
+    for (list<Device *>::iterator iterator = devices.begin();
+            iterator != devices.end();
+            ++iterator) {
+        Device  *device = (*iterator);
+
+        if (device->openCount != 0) {
+            continue;
+        }
+        if (device->lingerUntil <= now) {
+            expired.push_back(device->deviceId);
+        } else if (next == 0 || device->lingerUntil < next) {
+            next = device->lingerUntil;
+        }
+    }
+
+    for (list<uint32_t>::iterator iterator = expired.begin();
+            iterator != expired.end();
+            ++iterator) {
+        Device *device = findDevice(*iterator);
+        Connection *devCon = device->connection;
+        mcResult_t mcResult = MC_DRV_OK;
+
+        do {
+            SEND_TO_DAEMON(devCon, MC_DRV_CMD_CLOSE_DEVICE);
+
+            RECV_FROM_DAEMON(devCon, &mcResult);
+        } while (false);
+
+        if (mcResult != MC_DRV_OK) {
+            LOG_W(" %s(): Request at Daemon failed, respId=%d ", __FUNCTION__, mcResult);
+        }
+        // The daemon drops the device along with the connection anyway
+        removeDevice(*iterator);
+    }
+    return next;
+}
+
+//------------------------------------------------------------------------------
+static void *keepAliveThread(void *)
+{
+    pthread_mutex_lock(&keepAliveMutex);
+    for (;;) {
+        while (keepAliveDeadline == 0) {
+            pthread_cond_wait(&keepAliveCond, &keepAliveMutex);
+        }
+        uint64_t deadline = keepAliveDeadline;
+        if (nowMs() < deadline) {
+            struct timespec ts;
+            ts.tv_sec = deadline / 1000;
+            ts.tv_nsec = (deadline % 1000) * 1000000;
+            pthread_cond_timedwait(&keepAliveCond, &keepAliveMutex, &ts);
+            continue;
+        }
+        keepAliveDeadline = 0;
+        pthread_mutex_unlock(&keepAliveMutex);
+
+        // devMutex is taken before keepAliveMutex, never the other way round
+        devMutex.lock();
+        uint64_t next = closeLingeringDevices();
+        devMutex.unlock();
+
+        pthread_mutex_lock(&keepAliveMutex);
+        if (next != 0 && (keepAliveDeadline == 0 || next < keepAliveDeadline)) {
+            keepAliveDeadline = next;
+        }
+    }
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+/** Let a device linger instead of closing it, called with devMutex held.
+ * @return false if the device must be closed right away. */
+static bool lingerDevice(Device *device)
+{
+    bool started;
+
+    pthread_once(&keepAliveOnce, readKeepAlive);
+    if (keepAliveMs == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&keepAliveMutex);
+    if (!keepAliveStarted) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, keepAliveThread, NULL) == 0) {
+            pthread_detach(thread);
+            keepAliveStarted = true;
+        } else {
+            LOG_ERRNO("pthread_create");
+        }
+    }
+    started = keepAliveStarted;
+    if (started) {
+        device->lingerUntil = nowMs() + keepAliveMs;
+        if (keepAliveDeadline == 0 || device->lingerUntil < keepAliveDeadline) {
+            keepAliveDeadline = device->lingerUntil;
+            pthread_cond_signal(&keepAliveCond);
+        }
+    }
+    pthread_mutex_unlock(&keepAliveMutex);
+    if (!started) {
+        return false;
+    }
+
+    // Memory of the closed device must not outlive it
+    device->freeAllWsm();
+    device->openCount = 0;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/** Read the answer to MC_DRV_CMD_NQ_CONNECT_RING and map the ring passed along.
+ * @param ring set to the ring, NULL if the daemon uses the connection itself. */
+static mcResult_t receiveRing(Connection *connection, NotificationRing **ring)
+{
+    mcDrvRspNqConnectRing_t rsp;
+    int fds[2];
+    uint32_t fdCount = 2;
+    mcResult_t mcResult = MC_DRV_OK;
+
+    *ring = NULL;
+    ssize_t rlen = connection->readDataFds(&rsp, sizeof(rsp), fds, &fdCount);
+    if (rlen <= 0) {
+        LOG_E("reading from Daemon failed");
+        mcResult = MC_DRV_ERR_SOCKET_READ;
+    } else if (rlen != sizeof(rsp) && rlen != sizeof(mcDrvResponseHeader_t)) {
+        LOG_E("wrong buffer length %i received from Daemon", (int)rlen);
+        mcResult = MC_DRV_ERR_SOCKET_LENGTH;
+    } else {
+        mcResult = rsp.header.responseId;
+    }
+
+    if ((mcResult == MC_DRV_OK) && (rsp.ringLen != 0)) {
+        if (fdCount != 2) {
+            LOG_E("notification ring without descriptors");
+            mcResult = MC_DRV_ERR_NQ_FAILED;
+        } else {
+            // The ring owns the descriptors from here on
+            fdCount = 0;
+            *ring = new NotificationRing();
+            if (!(*ring)->attach(fds[0], fds[1], rsp.ringLen)) {
+                delete *ring;
+                *ring = NULL;
+                mcResult = MC_DRV_ERR_NQ_FAILED;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < fdCount; i++) {
+        close(fds[i]);
+    }
+    return mcResult;
+}
+
+//------------------------------------------------------------------------------
+/** Attach a new session to the notification connection shared by the sessions
+ * of its device, setting it up with the first session. Called with devMutex held. */
+static mcResult_t attachSharedChannel(
+    Device                        *device,
+    mcSessionHandle_t             *session,
+    mcDrvRspOpenSessionPayload_t  *payload)
+{
+    mcResult_t mcResult = MC_DRV_OK;
+
+    if (device->nqChannel != NULL) {
+        // Notifications may come in as soon as the daemon answers
+        device->nqChannel->addSession(session->sessionId);
+        do {
+            SEND_TO_DAEMON(device->connection, MC_DRV_CMD_NQ_ATTACH,
+                           session->sessionId);
+
+            RECV_FROM_DAEMON(device->connection, &mcResult);
+        } while (false);
+        if (mcResult != MC_DRV_OK) {
+            device->nqChannel->removeSession(session->sessionId);
+        }
+        return mcResult;
+    }
+
+    Connection *channelConnection = new Connection();
+    if (!channelConnection->connect(SOCK_PATH)) {
+        LOG_E("Could not connect to %s", SOCK_PATH);
+        delete channelConnection;
+        return MC_DRV_ERR_SOCKET_CONNECT;
+    }
+
+    NotificationRing *ring = NULL;
+    do {
+        if (device->ringNq) {
+            SEND_TO_DAEMON(channelConnection, MC_DRV_CMD_NQ_CONNECT_RING,
+                           session->deviceId,
+                           session->sessionId,
+                           payload->deviceSessionId,
+                           payload->sessionMagic);
+
+            mcResult = receiveRing(channelConnection, &ring);
+            break;
+        }
+
+        SEND_TO_DAEMON(channelConnection, MC_DRV_CMD_NQ_CONNECT_SHARED,
+                       session->deviceId,
+                       session->sessionId,
+                       payload->deviceSessionId,
+                       payload->sessionMagic);
+
+        RECV_FROM_DAEMON(channelConnection, &mcResult);
+    } while (false);
+    if (mcResult != MC_DRV_OK) {
+        delete channelConnection;
+        return mcResult;
+    }
+
+    // Nobody reads the connection before the session is known to it
+    device->nqChannel = new NotificationChannel(channelConnection, ring);
+    device->nqChannel->addSession(session->sessionId);
+    return MC_DRV_OK;
+}
+
+//------------------------------------------------------------------------------
+/** Set up the notification channel of a new session. Called with devMutex held.
+ * @param sessionConnection set to the session's own connection, NULL if it
+ * shares the one of the device. */
+static mcResult_t connectNotifications(
+    Device                        *device,
+    mcSessionHandle_t             *session,
+    mcDrvRspOpenSessionPayload_t  *payload,
+    Connection                    **sessionConnection)
+{
+    mcResult_t mcResult = MC_DRV_OK;
+
+    *sessionConnection = NULL;
+    if (device->sharedNq) {
+        mcResult = attachSharedChannel(device, session, payload);
+        if (mcResult == MC_DRV_OK) {
+            return MC_DRV_OK;
+        }
+        LOG_W("Shared notification connection failed, respId=%d, using an own one", mcResult);
+        mcResult = MC_DRV_OK;
+    }
+
+    Connection *connection = new Connection();
+    if (!connection->connect(SOCK_PATH)) {
+        LOG_E("Could not connect to %s", SOCK_PATH);
+        delete connection;
+        return MC_DRV_ERR_SOCKET_CONNECT;
+    }
+
+    do {
+        SEND_TO_DAEMON(connection, MC_DRV_CMD_NQ_CONNECT,
+                       session->deviceId,
+                       session->sessionId,
+                       payload->deviceSessionId,
+                       payload->sessionMagic);
+
+        RECV_FROM_DAEMON(connection, &mcResult);
+
+        if (mcResult != MC_DRV_OK) {
+            LOG_E("CMD_NQ_CONNECT failed, respId=%d", mcResult);
+            break;
+        }
+
+    } while (0);
+    if (mcResult != MC_DRV_OK) {
+        delete connection;
+        return mcResult;
+    }
+
+    *sessionConnection = connection;
+    return MC_DRV_OK;
+}
 #endif /* WIN32 */
 
 //------------------------------------------------------------------------------
@@ -200,9 +569,13 @@ __MC_CLIENT_LIB_API mcResult_t mcOpenDevice(uint32_t deviceId)
     LOG_I("===%s(%i)===", __FUNCTION__, deviceId);
 
     do {
-        Device *device = resolveDeviceId(deviceId);
+        Device *device = findDevice(deviceId);
         if (device != NULL) {
-            LOG_E("Device %d already opened", deviceId);
+            if (device->openCount == 0) {
+                LOG_I(" Reusing the lingering connection of device %d", deviceId);
+            } else {
+                LOG_E("Device %d already opened", deviceId);
+            }
             mcResult = MC_DRV_OK;
             device->openCount++;
             break;
@@ -248,6 +621,10 @@ __MC_CLIENT_LIB_API mcResult_t mcOpenDevice(uint32_t deviceId)
         // there is no payload to read
 
         device = new Device(deviceId, devCon);
+        // One notification connection for all sessions since daemon 0.4,
+        // delivering through shared memory since 0.5
+        device->sharedNq = (version >= MC_MAKE_VERSION(0, 4));
+        device->ringNq = (version >= MC_MAKE_VERSION(0, 5));
         mcResult = device->open("/dev/" MC_USER_DEVNODE);
         if (mcResult != MC_DRV_OK) {
             delete device;
@@ -313,6 +690,10 @@ __MC_CLIENT_LIB_API mcResult_t mcCloseDevice(
             break;
         }
 
+        if (lingerDevice(device)) {
+            break;
+        }
+
         SEND_TO_DAEMON(devCon, MC_DRV_CMD_CLOSE_DEVICE);
 
         RECV_FROM_DAEMON(devCon, &mcResult);
@@ -464,33 +845,9 @@ __MC_CLIENT_LIB_API mcResult_t mcOpenSession(
         LOG_I(" Service is started. Setting up channel for notifications.");
 
         // Set up second channel for notifications
-        Connection *sessionConnection = new Connection();
-        if (!sessionConnection->connect(SOCK_PATH)) {
-            LOG_E("Could not connect to %s", SOCK_PATH);
-            delete sessionConnection;
-            // Here we know we couldn't connect to the Daemon.
-            // Maybe we should use existing connection to close Trustlet.
-            mcResult = MC_DRV_ERR_SOCKET_CONNECT;
-            break;
-        }
-
-        do {
-            SEND_TO_DAEMON(sessionConnection, MC_DRV_CMD_NQ_CONNECT,
-                           session->deviceId,
-                           session->sessionId,
-                           rspOpenSessionPayload.deviceSessionId,
-                           rspOpenSessionPayload.sessionMagic);
-
-            RECV_FROM_DAEMON(sessionConnection, &mcResult);
-
-            if (mcResult != MC_DRV_OK) {
-                LOG_E("CMD_NQ_CONNECT failed, respId=%d", mcResult);
-                break;
-            }
-
-        } while (0);
+        Connection *sessionConnection = NULL;
+        mcResult = connectNotifications(device, session, &rspOpenSessionPayload, &sessionConnection);
         if (mcResult != MC_DRV_OK) {
-            delete sessionConnection;
             // Here we know we couldn't communicate well with the Daemon.
             // Maybe we should use existing connection to close Trustlet.
             break; // unlock mutex and return
@@ -656,34 +1013,9 @@ __MC_CLIENT_LIB_API mcResult_t mcOpenTrustlet(
         LOG_I(" Service is started. Setting up channel for notifications.");
 
         // Set up second channel for notifications
-        Connection *sessionConnection = new Connection();
-        if (!sessionConnection->connect(SOCK_PATH)) {
-            LOG_E("Could not connect to %s", SOCK_PATH);
-            delete sessionConnection;
-            // Here we know we couldn't connect to the Daemon.
-            // Maybe we should use existing connection to close Trustlet.
-            mcResult = MC_DRV_ERR_SOCKET_CONNECT;
-            break;
-        }
-
-        do {
-            SEND_TO_DAEMON(sessionConnection, MC_DRV_CMD_NQ_CONNECT,
-                           session->deviceId,
-                           session->sessionId,
-                           rspOpenSessionPayload.deviceSessionId,
-                           rspOpenSessionPayload.sessionMagic);
-
-            RECV_FROM_DAEMON(sessionConnection, &mcResult);
-
-            if (mcResult != MC_DRV_OK) {
-                LOG_E("CMD_NQ_CONNECT failed, respId=%d", mcResult);
-                break;
-            }
-
-        } while (0);
-
+        Connection *sessionConnection = NULL;
+        mcResult = connectNotifications(device, session, &rspOpenSessionPayload, &sessionConnection);
         if (mcResult != MC_DRV_OK) {
-            delete sessionConnection;
             // Here we know we couldn't communicate well with the Daemon.
             // Maybe we should use existing connection to close Trustlet.
             break; // unlock mutex and return
@@ -860,33 +1192,9 @@ __MC_CLIENT_LIB_API mcResult_t mcOpenGPTA(
         LOG_I(" Service is started. Setting up channel for notifications.");
 
         // Set up second channel for notifications
-        Connection *sessionConnection = new Connection();
-        if (!sessionConnection->connect(SOCK_PATH)) {
-            LOG_E("Could not connect to %s", SOCK_PATH);
-            delete sessionConnection;
-            // Here we know we couldn't connect to the Daemon.
-            // Maybe we should use existing connection to close Trustlet.
-            mcResult = MC_DRV_ERR_SOCKET_CONNECT;
-            break;
-        }
-
-        do {
-            SEND_TO_DAEMON(sessionConnection, MC_DRV_CMD_NQ_CONNECT,
-                           session->deviceId,
-                           session->sessionId,
-                           rspOpenSessionPayload.deviceSessionId,
-                           rspOpenSessionPayload.sessionMagic);
-
-            RECV_FROM_DAEMON(sessionConnection, &mcResult);
-
-            if (mcResult != MC_DRV_OK) {
-                LOG_E("CMD_NQ_CONNECT failed, respId=%d", mcResult);
-                break;
-            }
-
-        } while (0);
+        Connection *sessionConnection = NULL;
+        mcResult = connectNotifications(device, session, &rspOpenSessionPayload, &sessionConnection);
         if (mcResult != MC_DRV_OK) {
-            delete sessionConnection;
             // Here we know we couldn't communicate well with the Daemon.
             // Maybe we should use existing connection to close Trustlet.
             break; // unlock mutex and return
@@ -1041,15 +1349,13 @@ __MC_CLIENT_LIB_API mcResult_t mcWaitNotification(
         Session  *nqSession = device->resolveSessionId(session->sessionId);
         CHECK_SESSION(nqSession, session->sessionId);
 
-        Connection *nqconnection = nqSession->notificationConnection;
         uint32_t count = 0;
 
         // Read notification queue till it's empty
         for (;;) {
             notification_t notification;
-            ssize_t numRead = nqconnection->readData(
+            ssize_t numRead = nqSession->readNotification(
                                   &notification,
-                                  sizeof(notification_t),
                                   timeout);
             // Check for interrupted system call and loop, but only if timeout is infinite
             if ((numRead == -1) && (errno == EINTR)) {
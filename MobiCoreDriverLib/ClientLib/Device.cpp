@@ -49,6 +49,10 @@ Device::Device(uint32_t deviceId, Connection *connection)
     this->deviceId = deviceId;
     this->connection = connection;
     this->openCount = 0;
+    this->lingerUntil = 0;
+    this->sharedNq = false;
+    this->ringNq = false;
+    this->nqChannel = NULL;
 
     pMcKMod = new CMcKMod();
 }
@@ -66,17 +70,8 @@ Device::~Device(void)
         sessionIterator = sessionList.erase(sessionIterator);
     }
 
-    // Free all allocated WSM descriptors
-    wsmIterator_t  wsmIterator = wsmL2List.begin();
-    while (wsmIterator != wsmL2List.end()) {
-        CWsm_ptr pWsm = *wsmIterator;
-
-        // ignore return code
-        pMcKMod->free(pWsm->handle, pWsm->virtAddr, pWsm->len);
-
-        delete (*wsmIterator);
-        wsmIterator = wsmL2List.erase(wsmIterator);
-    }
+    freeAllWsm();
+    delete nqChannel;
     delete connection;
     delete pMcKMod;
 }
@@ -96,6 +91,23 @@ void Device::close(void)
 }
 
 
+//------------------------------------------------------------------------------
+void Device::freeAllWsm(void)
+{
+    // Free all allocated WSM descriptors
+    wsmIterator_t  wsmIterator = wsmL2List.begin();
+    while (wsmIterator != wsmL2List.end()) {
+        CWsm_ptr pWsm = *wsmIterator;
+
+        // ignore return code
+        pMcKMod->free(pWsm->handle, pWsm->virtAddr, pWsm->len);
+
+        delete (*wsmIterator);
+        wsmIterator = wsmL2List.erase(wsmIterator);
+    }
+}
+
+
 //------------------------------------------------------------------------------
 bool Device::hasSessions(void)
 {
@@ -106,7 +118,8 @@ bool Device::hasSessions(void)
 //------------------------------------------------------------------------------
 Session *Device::createNewSession(uint32_t sessionId, Connection  *connection)
 {
-    Session *session = new Session(sessionId, pMcKMod, connection);
+    Session *session = new Session(sessionId, pMcKMod, connection,
+                                   (connection == NULL) ? nqChannel : NULL);
     sessionList.push_back(session);
     return session;
 }
@@ -120,6 +133,9 @@ bool Device::removeSession(uint32_t sessionId)
     sessionIterator_t interator = sessionList.begin();
     while (interator != sessionList.end()) {
         if ((*interator)->sessionId == sessionId) {
+            if ((*interator)->nqChannel != NULL) {
+                (*interator)->nqChannel->removeSession(sessionId);
+            }
             delete (*interator);
             interator = sessionList.erase(interator);
             ret = true;
@@ -56,7 +56,11 @@ public:
     uint32_t     deviceId; /**< Device identifier */
     Connection   *connection; /**< The device connection */
     CMcKMod_ptr  pMcKMod;
-    uint32_t     openCount;
+    uint32_t     openCount; /**< 0 while the device lingers after its last close */
+    uint64_t     lingerUntil; /**< Time the lingering device is closed at, in ms */
+    bool         sharedNq; /**< The daemon can forward all sessions' notifications on one connection */
+    bool         ringNq; /**< The daemon can deliver them through a shared memory ring */
+    NotificationChannel *nqChannel; /**< That connection, NULL until the first session uses it */
 
     Device(
         uint32_t    deviceId,
@@ -83,6 +87,13 @@ public:
         void
     );
 
+    /**
+     * Free all WSM still allocated on the device.
+     */
+    void freeAllWsm(
+        void
+    );
+
     /**
      * Check if the device has open sessions.
      * @return true if the device has one or more open sessions.
@@ -94,7 +105,7 @@ public:
     /**
      * Add a session to the device.
      * @param sessionId session ID
-     * @param connection session connection
+     * @param connection session connection, NULL if the session uses nqChannel
      * @return Session object created
      */
     Session *createNewSession(
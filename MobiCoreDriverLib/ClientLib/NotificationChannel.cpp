@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/time.h>
+
+#include "NotificationChannel.h"
+
+#include "log.h"
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+/** Absolute CLOCK_REALTIME time timeout ms from now, for pthread_cond_timedwait(). */
+static void deadlineFromNow(struct timespec *deadline, int32_t timeout)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    uint64_t ms = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000 + timeout;
+    deadline->tv_sec = ms / 1000;
+    deadline->tv_nsec = (ms % 1000) * 1000000;
+}
+
+//------------------------------------------------------------------------------
+/** Timeout left until deadline, in the format of Connection::readData(). */
+static int32_t timeoutLeft(const struct timespec *deadline, int32_t timeout)
+{
+    struct timeval now;
+
+    if (timeout <= 0) {
+        return timeout;
+    }
+    gettimeofday(&now, NULL);
+    int64_t left = ((int64_t)deadline->tv_sec - now.tv_sec) * 1000
+                   + (deadline->tv_nsec / 1000000) - (now.tv_usec / 1000);
+    return (left > 0) ? (int32_t)left : 0;
+}
+
+//------------------------------------------------------------------------------
+NotificationChannel::NotificationChannel(Connection *connection, NotificationRing *ring)
+{
+    this->connection = connection;
+    this->ring = ring;
+    this->reading = false;
+    this->dead = false;
+    this->partialLen = 0;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+
+//------------------------------------------------------------------------------
+NotificationChannel::~NotificationChannel(void)
+{
+    delete ring;
+    delete connection;
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+//------------------------------------------------------------------------------
+void NotificationChannel::addSession(uint32_t sessionId)
+{
+    pthread_mutex_lock(&mutex);
+    pending[sessionId].clear();
+    pthread_mutex_unlock(&mutex);
+}
+
+
+//------------------------------------------------------------------------------
+void NotificationChannel::removeSession(uint32_t sessionId)
+{
+    pthread_mutex_lock(&mutex);
+    pending.erase(sessionId);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+//------------------------------------------------------------------------------
+void NotificationChannel::queueLocked(const notification_t *notification)
+{
+    map<uint32_t, deque<notification_t> >::iterator it = pending.find(notification->sessionId);
+    if (it == pending.end()) {
+        LOG_W("Dropping notification for unknown session %03x", notification->sessionId);
+        return;
+    }
+
+    deque<notification_t> &queue = it->second;
+    if (queue.size() >= NQ_CHANNEL_QUEUE_SIZE) {
+        // Like the daemon, plain wake-ups go before exit codes
+        deque<notification_t>::iterator victim = queue.begin();
+        for (deque<notification_t>::iterator i = queue.begin(); i != queue.end(); i++) {
+            if (i->payload == 0) {
+                victim = i;
+                break;
+            }
+        }
+        LOG_W("Queue of session %03x full, dropping notification with payload %d",
+              notification->sessionId, victim->payload);
+        queue.erase(victim);
+    }
+    queue.push_back(*notification);
+}
+
+
+//------------------------------------------------------------------------------
+bool NotificationChannel::takeFromRing(void)
+{
+    notification_t notification;
+
+    if (!ring->pop(&notification)) {
+        return false;
+    }
+    memcpy(partial, &notification, sizeof(notification));
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+ssize_t NotificationChannel::receive(int32_t timeout)
+{
+    struct timespec deadline;
+
+    if (ring == NULL) {
+        return connection->readData(partial + partialLen,
+                                    sizeof(notification_t) - partialLen,
+                                    timeout);
+    }
+
+    // Wake-ups without a notification for us do not restart the timeout
+    if (timeout > 0) {
+        deadlineFromNow(&deadline, timeout);
+    }
+    for (;;) {
+        // Whatever is in the ring comes without a system call
+        if (takeFromRing()) {
+            return sizeof(notification_t);
+        }
+        if (!ring->prepareSleep()) {
+            continue;
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = ring->getDoorbell();
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = connection->socketDescriptor;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        int ret = poll(fds, 2, timeoutLeft(&deadline, timeout));
+        int err = errno;
+        ring->finishSleep();
+
+        if (ret < 0) {
+            errno = err;
+            return -1;
+        }
+        if (ret == 0) {
+            return takeFromRing() ? (ssize_t)sizeof(notification_t) : -2;
+        }
+        if (fds[1].revents != 0) {
+            // The daemon never writes here after the set up, so it is gone,
+            // but what it left in the ring still counts
+            uint8_t byte;
+            ssize_t len = connection->readData(&byte, sizeof(byte), 0);
+            if (len == 0) {
+                return takeFromRing() ? (ssize_t)sizeof(notification_t) : 0;
+            }
+            if (len == -1) {
+                return -1;
+            }
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+ssize_t NotificationChannel::wait(
+    uint32_t        sessionId,
+    notification_t  *notification,
+    int32_t         timeout
+)
+{
+    struct timespec deadline;
+    ssize_t ret;
+    int err = 0;
+
+    if (timeout > 0) {
+        deadlineFromNow(&deadline, timeout);
+    }
+
+    pthread_mutex_lock(&mutex);
+    for (;;) {
+        map<uint32_t, deque<notification_t> >::iterator it = pending.find(sessionId);
+        if ((it != pending.end()) && !it->second.empty()) {
+            *notification = it->second.front();
+            it->second.pop_front();
+            ret = sizeof(notification_t);
+            break;
+        }
+        if (dead) {
+            ret = 0;
+            break;
+        }
+
+        if (reading) {
+            // The reading thread hands over what is ours
+            if (timeout == 0) {
+                ret = -2;
+                break;
+            }
+            if (timeout < 0) {
+                pthread_cond_wait(&cond, &mutex);
+            } else if (pthread_cond_timedwait(&cond, &mutex, &deadline) == ETIMEDOUT) {
+                ret = -2;
+                break;
+            }
+            continue;
+        }
+
+        // Nobody reads, so do it ourselves
+        reading = true;
+        pthread_mutex_unlock(&mutex);
+        ssize_t len = receive(timeoutLeft(&deadline, timeout));
+        err = errno;
+        pthread_mutex_lock(&mutex);
+        reading = false;
+        pthread_cond_broadcast(&cond);
+
+        if (len == 0) {
+            dead = true;
+            continue;
+        }
+        if (len < 0) {
+            ret = len;
+            break;
+        }
+        partialLen += len;
+        if (partialLen < sizeof(notification_t)) {
+            continue;
+        }
+        partialLen = 0;
+
+        notification_t received;
+        memcpy(&received, partial, sizeof(received));
+        if (received.sessionId == sessionId) {
+            *notification = received;
+            ret = sizeof(notification_t);
+            break;
+        }
+        queueLocked(&received);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (ret == -1) {
+        errno = err;
+    }
+    return ret;
+}
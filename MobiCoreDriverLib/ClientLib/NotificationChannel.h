@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * Notification connection shared by all sessions of a device.
+ *
+ * The daemon tags every notification with its session ID. Whichever thread
+ * waits first reads the connection, or drains the shared memory ring if the
+ * daemon set one up, and queues notifications of other sessions for their
+ * waiters.
+ */
+#ifndef NOTIFICATIONCHANNEL_H_
+#define NOTIFICATIONCHANNEL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <map>
+#include <deque>
+
+#include "Connection.h"
+#include "NotificationRing.h"
+#include "Mci/mcinq.h"
+
+#define NQ_CHANNEL_QUEUE_SIZE   64  /**< Notifications kept for a session which does not wait */
+
+
+class NotificationChannel
+{
+private:
+    Connection *connection;
+    NotificationRing *ring; // Delivers the notifications if set, the connection only tells when the daemon is gone
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // Signalled when the reader leaves or queues something
+    bool reading; // A thread reads the connection
+    bool dead; // The daemon closed the connection
+    uint8_t partial[sizeof(notification_t)]; // Entry read only partly so far
+    uint32_t partialLen;
+    std::map<uint32_t, std::deque<notification_t> > pending; // Per session
+
+    void queueLocked(const notification_t *notification);
+
+    /**
+     * Move the oldest ring entry to partial.
+     */
+    bool takeFromRing(void);
+
+    /**
+     * Read from the ring, or the rest of the partial entry from the
+     * connection. Only called by the reading thread.
+     */
+    ssize_t receive(int32_t timeout);
+
+public:
+    NotificationChannel(Connection *connection, NotificationRing *ring);
+
+    virtual ~NotificationChannel(void);
+
+    /**
+     * Start keeping notifications for a session.
+     */
+    void addSession(uint32_t sessionId);
+
+    /**
+     * Forget a session and the notifications still kept for it.
+     */
+    void removeSession(uint32_t sessionId);
+
+    /**
+     * Wait for the next notification of a session.
+     * Follows the conventions of Connection::readData().
+     *
+     * @param timeout Timeout in ms, negative for infinite.
+     * @return sizeof(notification_t) on success, 0 if the connection is dead,
+     *         -1 on error, -2 on timeout.
+     */
+    ssize_t wait(uint32_t sessionId, notification_t *notification, int32_t timeout);
+};
+
+#endif /* NOTIFICATIONCHANNEL_H_ */
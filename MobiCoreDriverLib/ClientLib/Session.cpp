@@ -41,13 +41,15 @@
 
 //------------------------------------------------------------------------------
 Session::Session(
-    uint32_t    sessionId,
-    CMcKMod     *mcKMod,
-    Connection  *connection)
+    uint32_t            sessionId,
+    CMcKMod             *mcKMod,
+    Connection          *connection,
+    NotificationChannel *channel)
 {
     this->sessionId = sessionId;
     this->mcKMod = mcKMod;
     this->notificationConnection = connection;
+    this->nqChannel = channel;
 
     sessionInfo.lastErr = SESSION_ERR_NO;
     sessionInfo.state = SESSION_STATE_INITIAL;
@@ -78,13 +80,26 @@ Session::~Session(void)
         delete(pBlkBufDescr);
     }
 
-    // Finally delete notification connection
+    // Finally delete notification connection, a shared one belongs to the device
     delete notificationConnection;
 
     unlock();
 }
 
 
+//------------------------------------------------------------------------------
+ssize_t Session::readNotification(
+    notification_t  *notification,
+    int32_t         timeout
+)
+{
+    if (nqChannel != NULL) {
+        return nqChannel->wait(sessionId, notification, timeout);
+    }
+    return notificationConnection->readData(notification, sizeof(notification_t), timeout);
+}
+
+
 //------------------------------------------------------------------------------
 void Session::setErrorInfo(
     int32_t err
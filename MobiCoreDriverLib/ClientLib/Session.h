@@ -36,6 +36,7 @@
 
 #include "mc_linux.h"
 #include "Connection.h"
+#include "NotificationChannel.h"
 #include "CMcKMod.h"
 #include "CMutex.h"
 
@@ -96,9 +97,10 @@ private:
     sessionInformation_t sessionInfo; /**< Informations about session */
 public:
     uint32_t sessionId;
-    Connection *notificationConnection;
+    Connection *notificationConnection; /**< Own notification connection, NULL if nqChannel is used */
+    NotificationChannel *nqChannel; /**< Notification connection shared with the other sessions of the device */
 
-    Session(uint32_t sessionId, CMcKMod *mcKMod, Connection *connection);
+    Session(uint32_t sessionId, CMcKMod *mcKMod, Connection *connection, NotificationChannel *channel);
 
     virtual ~Session(void);
 
@@ -146,6 +148,15 @@ public:
      */
     uint32_t getBufHandle(uint32_t sVirtAddr, uint32_t sVirtualLen);
 
+    /**
+     * Wait for the next notification of the session.
+     * Follows the conventions of Connection::readData().
+     *
+     * @param notification The notification received.
+     * @param timeout Timeout in ms, negative for infinite.
+     */
+    ssize_t readNotification(notification_t *notification, int32_t timeout);
+
     /**
      * Set additional error information of the last error that occured.
      *
@@ -177,7 +177,8 @@ ssize_t Connection::writeData(void *buffer, uint32_t len)
 {
     assert(socketDescriptor != -1);
 
-    ssize_t ret = send(socketDescriptor, buffer, len, 0);
+    // Peer may be gone, e.g. a pooled daemon connection: report, don't raise SIGPIPE
+    ssize_t ret = send(socketDescriptor, buffer, len, MSG_NOSIGNAL);
     if ((uint32_t)ret != len) {
         LOG_ERRNO("could not send all data, because send");
         LOG_E("ret = %d", (uint32_t)ret);
@@ -188,6 +189,109 @@ ssize_t Connection::writeData(void *buffer, uint32_t len)
 }
 
 
+//------------------------------------------------------------------------------
+ssize_t Connection::writeDataVector(const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+
+    assert(socketDescriptor != -1);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    ssize_t ret = sendmsg(socketDescriptor, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        LOG_ERRNO("sendmsg");
+        return -1;
+    }
+
+    return ret;
+}
+
+
+//------------------------------------------------------------------------------
+ssize_t Connection::writeDataFds(void *buffer, uint32_t len, const int *fds, uint32_t fdCount)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(CONNECTION_MAX_FDS * sizeof(int))];
+
+    assert(socketDescriptor != -1);
+    assert((fdCount > 0) && (fdCount <= CONNECTION_MAX_FDS));
+
+    iov.iov_base = buffer;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(fdCount * sizeof(int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, fdCount * sizeof(int));
+
+    ssize_t ret = sendmsg(socketDescriptor, &msg, MSG_NOSIGNAL);
+    if ((uint32_t)ret != len) {
+        LOG_ERRNO("could not send all data, because sendmsg");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+
+//------------------------------------------------------------------------------
+ssize_t Connection::readDataFds(void *buffer, uint32_t len, int *fds, uint32_t *fdCount)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(CONNECTION_MAX_FDS * sizeof(int))];
+    uint32_t room = *fdCount;
+
+    assert(socketDescriptor != -1);
+
+    *fdCount = 0;
+    iov.iov_base = buffer;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t ret = recvmsg(socketDescriptor, &msg, MSG_CMSG_CLOEXEC);
+    if (ret < 0) {
+        LOG_ERRNO("recvmsg");
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)) {
+            continue;
+        }
+        uint32_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *passed = (int *)CMSG_DATA(cmsg);
+        for (uint32_t i = 0; i < count; i++) {
+            // Never leak what the caller has no room for
+            if (*fdCount < room) {
+                fds[(*fdCount)++] = passed[i];
+            } else {
+                close(passed[i]);
+            }
+        }
+    }
+
+    return ret;
+}
+
+
 //------------------------------------------------------------------------------
 int Connection::waitData(int32_t timeout)
 {
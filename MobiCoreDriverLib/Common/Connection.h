@@ -41,8 +41,10 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
+#define CONNECTION_MAX_FDS  4 /**< File descriptors passed along with one message at most */
 
 class Connection
 {
@@ -97,6 +99,41 @@ public:
      */
     virtual ssize_t writeData(void *buffer, uint32_t len);
 
+    /**
+     * Write a vector of buffers to the connection without blocking.
+     *
+     * @param iov       Buffers to send.
+     * @param iovcnt    Number of buffers.
+     * @return Number of bytes written, may be less than requested.
+     * @return 0 if the connection cannot take any data now.
+     * @return -1 on error.
+     */
+    virtual ssize_t writeDataVector(const struct iovec *iov, int iovcnt);
+
+    /**
+     * Write bytes to the connection and pass file descriptors along.
+     *
+     * @param buffer    Pointer to source buffer.
+     * @param len       Number of bytes to write.
+     * @param fds       Descriptors to pass, they stay open here.
+     * @param fdCount   Number of descriptors, at most CONNECTION_MAX_FDS.
+     * @return Number of bytes written.
+     * @return -1 if written bytes not equal to len.
+     */
+    virtual ssize_t writeDataFds(void *buffer, uint32_t len, const int *fds, uint32_t fdCount);
+
+    /**
+     * Read bytes from the connection together with passed file descriptors.
+     *
+     * @param buffer    Pointer to destination buffer.
+     * @param len       Number of bytes to read.
+     * @param fds       Receives the descriptors, the caller has to close them.
+     * @param fdCount   Room in fds, set to the number of descriptors received.
+     * @return Number of bytes read, 0 if the peer closed the connection.
+     * @return -1 on error.
+     */
+    virtual ssize_t readDataFds(void *buffer, uint32_t len, int *fds, uint32_t *fdCount);
+
     /**
      * Wait for data to be available.
      *
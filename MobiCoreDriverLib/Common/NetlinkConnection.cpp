@@ -287,3 +287,22 @@ ssize_t NetlinkConnection::writeData(
     return ret;
 }
 
+
+//------------------------------------------------------------------------------
+ssize_t NetlinkConnection::writeDataVector(
+    const struct iovec  *iov,
+    int                 iovcnt
+)
+{
+    ssize_t total = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (writeData(iov[i].iov_base, iov[i].iov_len) < 0) {
+            break;
+        }
+        total += iov[i].iov_len;
+    }
+
+    return (total == 0 && iovcnt != 0) ? -1 : total;
+}
+
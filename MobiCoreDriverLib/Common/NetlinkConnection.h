@@ -195,6 +195,20 @@ public:
         uint32_t  len
     );
 
+    /**
+     * Write a vector of buffers to the connection.
+     * Netlink is message based, each buffer is sent as one message.
+     *
+     * @param iov       Buffers to send.
+     * @param iovcnt    Number of buffers.
+     * @return Number of bytes written.
+     * @return -1 if nothing could be sent.
+     */
+    virtual ssize_t writeDataVector(
+        const struct iovec  *iov,
+        int                 iovcnt
+    );
+
     /**
      * Set the internal data connection.
      * This method is called by the
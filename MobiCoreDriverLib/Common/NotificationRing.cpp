@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2013 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#include "NotificationRing.h"
+
+#include "log.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC         0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING   0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS         1033
+#define F_SEAL_SEAL         0x0001
+#define F_SEAL_SHRINK       0x0002
+#define F_SEAL_GROW         0x0004
+#endif
+
+//------------------------------------------------------------------------------
+static int createMemFd(const char *name)
+{
+#ifdef __NR_memfd_create
+    return syscall(__NR_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    (void)name;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+NotificationRing::NotificationRing(void)
+{
+    header = NULL;
+    ring = NULL;
+    mask = 0;
+    head = 0;
+    len = 0;
+    memFd = -1;
+    doorbell = -1;
+}
+
+
+//------------------------------------------------------------------------------
+NotificationRing::~NotificationRing(void)
+{
+    if (header != NULL) {
+        munmap(header, len);
+    }
+    closeMemFd();
+    if (doorbell != -1) {
+        close(doorbell);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+bool NotificationRing::create(uint32_t entries)
+{
+    len = sizeof(nqRingHeader_t) + entries * sizeof(notification_t);
+
+    memFd = createMemFd("mcnq");
+    if (memFd == -1) {
+        LOG_ERRNO("memfd_create");
+        return false;
+    }
+    if (ftruncate(memFd, len) != 0) {
+        LOG_ERRNO("ftruncate");
+        return false;
+    }
+    // A client shrinking the file would fault the daemon on its next push
+    if (fcntl(memFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        LOG_ERRNO("seal memfd");
+        return false;
+    }
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    if (mem == MAP_FAILED) {
+        LOG_ERRNO("mmap");
+        return false;
+    }
+    header = (nqRingHeader_t *)mem;
+    ring = (notification_t *)(header + 1);
+    header->entries = entries;
+    mask = entries - 1;
+
+    doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (doorbell == -1) {
+        LOG_ERRNO("eventfd");
+        return false;
+    }
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+bool NotificationRing::attach(int memFd, int doorbell, uint32_t len)
+{
+    this->memFd = memFd;
+    this->doorbell = doorbell;
+    this->len = len;
+
+    if (len < sizeof(nqRingHeader_t)) {
+        LOG_E("ring of %u bytes too small", len);
+        return false;
+    }
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    if (mem == MAP_FAILED) {
+        LOG_ERRNO("mmap");
+        return false;
+    }
+    header = (nqRingHeader_t *)mem;
+    ring = (notification_t *)(header + 1);
+
+    uint32_t entries = header->entries;
+    if ((entries == 0) || ((entries & (entries - 1)) != 0)
+            || (entries > (len - sizeof(nqRingHeader_t)) / sizeof(notification_t))) {
+        LOG_E("invalid ring of %u entries", entries);
+        return false;
+    }
+    mask = entries - 1;
+    closeMemFd();
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+void NotificationRing::closeMemFd(void)
+{
+    if (memFd != -1) {
+        close(memFd);
+        memFd = -1;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+bool NotificationRing::push(const notification_t *notification)
+{
+    // Never trust the consumer's position further than the ring reaches
+    if (head - header->tail > mask) {
+        return false;
+    }
+
+    ring[head & mask] = *notification;
+    __sync_synchronize();
+    header->head = ++head;
+    // Pairs with the barrier in prepareSleep(): either the consumer sees the
+    // entry or we see it sleeping
+    __sync_synchronize();
+    if (header->sleeping) {
+        uint64_t one = 1;
+        if (write(doorbell, &one, sizeof(one)) != sizeof(one) && (errno != EAGAIN)) {
+            LOG_ERRNO("write doorbell");
+        }
+    }
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+bool NotificationRing::pop(notification_t *notification)
+{
+    uint32_t tail = header->tail;
+
+    if (tail == header->head) {
+        return false;
+    }
+    __sync_synchronize();
+    *notification = ring[tail & mask];
+    __sync_synchronize();
+    header->tail = tail + 1;
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+bool NotificationRing::prepareSleep(void)
+{
+    header->sleeping = 1;
+    __sync_synchronize();
+    if (header->tail != header->head) {
+        header->sleeping = 0;
+        return false;
+    }
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+void NotificationRing::finishSleep(void)
+{
+    uint64_t count;
+
+    header->sleeping = 0;
+    // Non-blocking, there may be nothing to reset
+    (void)read(doorbell, &count, sizeof(count));
+}
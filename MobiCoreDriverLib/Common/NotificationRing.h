@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2013 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * Notification ring shared by the daemon and a client.
+ *
+ * The daemon is the only producer and the client the only consumer. The
+ * memory comes from a memfd, the daemon only rings the eventfd doorbell
+ * when the client announced that it goes to sleep.
+ */
+#ifndef NOTIFICATIONRING_H_
+#define NOTIFICATIONRING_H_
+
+#include <stdint.h>
+
+#include "Mci/mcinq.h"
+
+#define NQ_RING_ENTRIES     256 /**< Entries of a ring, a power of two */
+
+/** Start of the shared memory, the entries follow. */
+typedef struct {
+    volatile uint32_t head;     /**< Entries written so far, by the daemon */
+    volatile uint32_t tail;     /**< Entries read so far, by the client */
+    volatile uint32_t sleeping; /**< The client waits for the doorbell */
+    uint32_t          entries;  /**< Number of entries */
+} nqRingHeader_t;
+
+
+class NotificationRing
+{
+private:
+    nqRingHeader_t *header;
+    notification_t *ring;
+    uint32_t mask; // Own copy, the other side cannot change it
+    uint32_t head; // Own copy of the producer position
+    uint32_t len; // Bytes mapped
+    int memFd;
+    int doorbell;
+
+public:
+    NotificationRing(void);
+
+    virtual ~NotificationRing(void);
+
+    /**
+     * Create a new ring, the producer side.
+     *
+     * @return false if the platform has no memfd or eventfd.
+     */
+    bool create(uint32_t entries);
+
+    /**
+     * Map a ring created by the peer, the consumer side.
+     * Takes over both descriptors, also on failure.
+     */
+    bool attach(int memFd, int doorbell, uint32_t len);
+
+    int getMemFd(void) {
+        return memFd;
+    }
+
+    int getDoorbell(void) {
+        return doorbell;
+    }
+
+    uint32_t getLength(void) {
+        return len;
+    }
+
+    /**
+     * Close the memfd once it was passed on, the mapping stays.
+     */
+    void closeMemFd(void);
+
+    /**
+     * Append a notification, ringing the doorbell only if the consumer sleeps.
+     *
+     * @return false if the ring is full.
+     */
+    bool push(const notification_t *notification);
+
+    /**
+     * Take the oldest notification without blocking.
+     *
+     * @return false if the ring is empty.
+     */
+    bool pop(notification_t *notification);
+
+    /**
+     * Tell the producer that the consumer is about to wait for the doorbell.
+     *
+     * @return false if a notification came in meanwhile, do not sleep then.
+     */
+    bool prepareSleep(void);
+
+    /**
+     * Back from waiting for the doorbell, reset it.
+     */
+    void finishSleep(void);
+};
+
+#endif /* NOTIFICATIONRING_H_ */
@@ -20,6 +20,9 @@ LOCAL_C_INCLUDES += $(LOCAL_PATH)/$(DEVICE_PATH) \
 LOCAL_SRC_FILES += $(DEVICE_PATH)/DeviceIrqHandler.cpp \
 	$(DEVICE_PATH)/DeviceScheduler.cpp \
 	$(DEVICE_PATH)/TAExitHandler.cpp \
+	$(DEVICE_PATH)/DoorbellHandler.cpp \
+	$(DEVICE_PATH)/OutboxHandler.cpp \
 	$(DEVICE_PATH)/MobiCoreDevice.cpp \
 	$(DEVICE_PATH)/NotificationQueue.cpp \
 	$(DEVICE_PATH)/TrustletSession.cpp \
+	$(DEVICE_PATH)/SessionTable.cpp \
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <string.h>
+
+#include "DoorbellHandler.h"
+#include "log.h"
+
+#define LOG_I_RELEASE(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+
+//------------------------------------------------------------------------------
+static uint64_t elapsedUs(const struct timespec *from)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - from->tv_sec) * 1000000 +
+           (now.tv_nsec - from->tv_nsec) / 1000;
+}
+
+//------------------------------------------------------------------------------
+DoorbellHandler::DoorbellHandler(
+    void
+) : windowUs(0), pending(0), batches(0), notifications(0),
+    latencySumUs(0), latencyMaxUs(0)
+{
+    memset(&firstQueued, 0, sizeof(firstQueued));
+    memset(histogram, 0, sizeof(histogram));
+}
+
+//------------------------------------------------------------------------------
+void DoorbellHandler::run(
+    void
+)
+{
+    handleDoorbell();
+    this->exit((void*)-1);
+}
+
+//------------------------------------------------------------------------------
+void DoorbellHandler::setDoorbellWindow(
+    uint32_t windowUs
+)
+{
+    this->windowUs = windowUs;
+}
+
+//------------------------------------------------------------------------------
+uint32_t DoorbellHandler::getDoorbellWindow(
+    void
+)
+{
+    return windowUs;
+}
+
+//------------------------------------------------------------------------------
+bool DoorbellHandler::queueDoorbell(
+    void
+)
+{
+    bool deferred = true;
+
+    if (windowUs == 0) {
+        return false;
+    }
+
+    doorbellMutex.lock();
+    if (pending == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &firstQueued);
+    }
+    pending++;
+    if (pending >= DOORBELL_MAX_BATCH) {
+        // Do not let the NQ fill up, the caller rings right away
+        deferred = false;
+    } else if (pending == 1) {
+        // First one of a batch arms the doorbell thread, the others ride along
+        CThread::wakeup();
+    }
+    doorbellMutex.unlock();
+
+    return deferred;
+}
+
+//------------------------------------------------------------------------------
+uint32_t DoorbellHandler::takeDoorbellBatch(
+    void
+)
+{
+    uint32_t batch;
+    uint32_t bucket = 0;
+    bool dump = false;
+
+    doorbellMutex.lock();
+    batch = pending;
+    pending = 0;
+    if (batch != 0) {
+        uint64_t latencyUs = elapsedUs(&firstQueued);
+        // Batches rarely exceed DOORBELL_MAX_BATCH, the full ones get the last bucket
+        if (batch >= DOORBELL_MAX_BATCH) {
+            bucket = DOORBELL_HISTO_BUCKETS - 1;
+        }
+        while ((bucket < DOORBELL_HISTO_BUCKETS - 2) && (batch > (1U << bucket))) {
+            bucket++;
+        }
+        histogram[bucket]++;
+        batches++;
+        notifications += batch;
+        latencySumUs += latencyUs;
+        if (latencyUs > latencyMaxUs) {
+            latencyMaxUs = latencyUs;
+        }
+        dump = (batches % DOORBELL_STATS_PERIOD) == 0;
+    }
+    doorbellMutex.unlock();
+
+    if (dump) {
+        dumpDoorbellStats();
+    }
+    return batch;
+}
+
+//------------------------------------------------------------------------------
+void DoorbellHandler::dumpDoorbellStats(
+    void
+)
+{
+    doorbellMutex.lock();
+    LOG_I_RELEASE("Doorbell: window %u us, %llu notifications in %llu N-SIQs",
+                  windowUs, (unsigned long long)notifications,
+                  (unsigned long long)batches);
+    LOG_I_RELEASE("Doorbell: batch size 1:%llu 2:%llu 3-4:%llu 5-7:%llu full:%llu",
+                  (unsigned long long)histogram[0], (unsigned long long)histogram[1],
+                  (unsigned long long)histogram[2], (unsigned long long)histogram[3],
+                  (unsigned long long)histogram[4]);
+    LOG_I_RELEASE("Doorbell: added latency avg %llu us, max %llu us",
+                  (unsigned long long)(batches ? latencySumUs / batches : 0),
+                  (unsigned long long)latencyMaxUs);
+    doorbellMutex.unlock();
+}
+
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * Doorbell thread.
+ * Coalesces client notifications to <t-base so that several NQ entries are
+ * announced with a single N-SIQ.
+ */
+#ifndef _DOORBELLHANDLER_H_
+#define _DOORBELLHANDLER_H_
+
+#include <time.h>
+
+#include "CThread.h"
+#include "CMutex.h"
+
+
+#define DOORBELL_MAX_BATCH      8    /**< Ring at once when that many notifications wait (half the NQ) */
+#define DOORBELL_HISTO_BUCKETS  5    /**< Batch sizes 1, 2, 3-4, 5-7, DOORBELL_MAX_BATCH or more */
+#define DOORBELL_STATS_PERIOD   1024 /**< Dump statistics every n-th batch */
+
+class DoorbellHandler: public CThread
+{
+public:
+    DoorbellHandler(void);
+
+    virtual void handleDoorbell() = 0;
+
+    void run();
+
+    /** Set the coalescing window.
+     *
+     * @param windowUs time in microseconds a notification may wait for
+     * others before the N-SIQ is sent, 0 to send it immediately.
+     */
+    void setDoorbellWindow(uint32_t windowUs);
+
+    uint32_t getDoorbellWindow(void);
+
+protected:
+    /** Account a notification just put in the NQ.
+     *
+     * @return true if the doorbell thread will send the N-SIQ, false if the
+     * caller has to send it now.
+     */
+    bool queueDoorbell(void);
+
+    /** Take all notifications covered by the N-SIQ about to be sent.
+     *
+     * @return number of notifications in the batch, 0 if none was pending.
+     */
+    uint32_t takeDoorbellBatch(void);
+
+    void dumpDoorbellStats(void);
+
+private:
+    CMutex          doorbellMutex;
+    uint32_t        windowUs;
+    uint32_t        pending;      /**< Notifications waiting for an N-SIQ */
+    struct timespec firstQueued;  /**< When the oldest pending notification was queued */
+    uint64_t        histogram[DOORBELL_HISTO_BUCKETS];
+    uint64_t        batches;
+    uint64_t        notifications;
+    uint64_t        latencySumUs; /**< Added delay, summed over batches */
+    uint64_t        latencyMaxUs;
+};
+
+#endif /* _DOORBELLHANDLER_H_ */
+
@@ -59,6 +59,10 @@ MobiCoreDevice::MobiCoreDevice()
     mcFault = false;
     mciReused = false;
     mcpMessage = NULL;
+    reapBacklog = 0;
+    reapedClients = 0;
+    reapTimeSumMs = 0;
+    reapTimeMaxMs = 0;
 }
 
 //------------------------------------------------------------------------------
@@ -76,16 +80,7 @@ MobiCoreDevice::~MobiCoreDevice()
 TrustletSession *MobiCoreDevice::getTrustletSession(
     uint32_t sessionId
 ) {
-    for (trustletSessionIterator_t iterator = trustletSessions.begin();
-         iterator != trustletSessions.end();
-         ++iterator)
-    {
-        TrustletSession *session = *iterator;
-        if (session->sessionId == sessionId) {
-            return session;
-        }
-    }
-    return NULL;
+    return trustletSessions.find(sessionId);
 }
 
 
@@ -117,7 +112,7 @@ TrustletSession* MobiCoreDevice::findSession(
     Connection *deviceConnection,
     uint32_t sessionId
 ) {
-    mutex_tslist.lock();
+    uint32_t epoch = trustletSessions.readLock();
     TrustletSession *session = getTrustletSession(sessionId);
     if (session == NULL)
     {
@@ -132,7 +127,7 @@ TrustletSession* MobiCoreDevice::findSession(
             session = NULL;
         }
     }
-    mutex_tslist.unlock();
+    trustletSessions.readUnlock(epoch);
     return session;
 }
 
@@ -216,51 +211,109 @@ mcResult_t MobiCoreDevice::closeSessionInternal(
  * Removes all sessions to a connection. Though, clientLib rejects the closeDevice()
  * command if still sessions connected to the device, this is needed to clean up all
  * sessions if client dies.
+ * The sessions are only detached from the connection here, they are closed
+ * in the background by reapNextSession(), so this does not need the MCP.
  */
 void MobiCoreDevice::close(
     Connection *connection
 ) {
-    // static mutex is the the same for each thread. So this serializes
-    // multiple connections failing at the same time.
-    static CMutex mutex;
-    // Enter critical section
-    mutex.lock();
-
-    // 1. Iterate through device session to find connection
-    // 2. Decide what to do with open Trustlet sessions
-    // 3. Remove & delete deviceSession from vector
-
-    // iterating over the list in reverse order, as the LIFO approach may
-    // avoid some quirks. The assumption is that a driver is opened before a
-    // TA, so we want to terminate the TA first and then the driver. This may
-    // make this a bit easier for everbody.
-
-    // Cannot lock list as we need to receive notifications, but it may change, so search under lock
-    for (;;) {
-        TrustletSession *session = NULL;
-
-        mutex_tslist.lock();
-        for (trustletSessionList_t::reverse_iterator revIt = trustletSessions.rbegin(); revIt != trustletSessions.rend(); revIt++)
-        {
-            if ((*revIt)->deviceConnection == connection) {
-                session = *revIt;
-                break;
-            }
-        }
-        mutex_tslist.unlock();
-        if (!session) {
-            break;
+    std::vector<TrustletSession *> sessions;
+
+    // The sessions keep the shared notification connection until they are gone
+    mutex_connection.lock();
+    std::map<Connection *, SharedNotificationConnection *>::iterator channel = sharedChannels.find(connection);
+    if (channel != sharedChannels.end()) {
+        channel->second->put();
+        sharedChannels.erase(channel);
+    }
+    mutex_connection.unlock();
+
+    trustletSessions.disownAll(connection, sessions);
+    if (!sessions.empty()) {
+        reapJob_t job;
+
+        // Nobody can use the connection to reach these sessions anymore,
+        // it may be deleted as soon as we return
+        mutex_connection.lock();
+        for (std::vector<TrustletSession *>::iterator it = sessions.begin(); it != sessions.end(); it++) {
+            (*it)->deviceConnection = NULL;
+            job.sessions.push_back((*it)->sessionId);
         }
-        mcResult_t mcRet = closeSession(connection, session->sessionId);
+        mutex_connection.unlock();
+        clock_gettime(CLOCK_MONOTONIC, &job.dropped);
+
+        mutex_reap.lock();
+        reapQueue.push_back(job);
+        reapBacklog += job.sessions.size();
+        LOG_I("Tearing down %zu sessions of connection %p, backlog is %u sessions",
+              job.sessions.size(), connection, reapBacklog);
+        mutex_reap.unlock();
+
+        TAExitHandler::wakeup();
+    }
+
+    connection->connectionData = NULL;
+}
+
+
+//------------------------------------------------------------------------------
+bool MobiCoreDevice::reapNextSession(void)
+{
+    uint32_t sessionId;
+    bool last;
+    bool more;
+    struct timespec dropped;
+
+    mutex_reap.lock();
+    if (reapQueue.empty()) {
+        mutex_reap.unlock();
+        return false;
+    }
+    // Terminate the TA first and then the driver, see close()
+    reapJob_t &job = reapQueue.front();
+    sessionId = job.sessions.back();
+    job.sessions.pop_back();
+    reapBacklog--;
+    last = job.sessions.empty();
+    dropped = job.dropped;
+    if (last) {
+        reapQueue.pop_front();
+    }
+    mutex_reap.unlock();
+
+    // The TA exit handler may have closed it already
+    uint32_t epoch = trustletSessions.readLock();
+    bool exists = (getTrustletSession(sessionId) != NULL);
+    trustletSessions.readUnlock(epoch);
+
+    if (exists) {
+        mutex_mcp.lock();
+        mcResult_t mcRet = closeSession(NULL, sessionId);
+        mutex_mcp.unlock();
         if (mcRet != MC_MCP_RET_OK) {
             LOG_I("device closeSession failed with %d", mcRet);
         }
     }
 
-    connection->connectionData = NULL;
+    mutex_reap.lock();
+    if (last) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint64_t ms = (uint64_t)(now.tv_sec - dropped.tv_sec) * 1000 +
+                      (now.tv_nsec - dropped.tv_nsec) / 1000000;
+        reapedClients++;
+        reapTimeSumMs += ms;
+        if (ms > reapTimeMaxMs) {
+            reapTimeMaxMs = ms;
+        }
+        LOG_I("Client teardown took %llu ms (avg %llu ms, max %llu ms), backlog is %u sessions",
+              (unsigned long long)ms, (unsigned long long)(reapTimeSumMs / reapedClients),
+              (unsigned long long)reapTimeMaxMs, reapBacklog);
+    }
+    more = !reapQueue.empty();
+    mutex_reap.unlock();
 
-    // Leave critical section
-    mutex.unlock();
+    return more;
 }
 
 
@@ -282,9 +335,19 @@ void MobiCoreDevice::start(void)
         LOG_I("No DeviceScheduler available.");
     }
 
+    LOG_I("Starting OutboxHandler...");
+    OutboxHandler::start("OutboxHandler");
+
     LOG_I("Starting TAExitHandler...");
     TAExitHandler::start("TAExitHandler");
 
+    if (getDoorbellWindow() != 0)
+    {
+        LOG_I("Starting DoorbellHandler...");
+        // Start the notification coalescing thread
+        DoorbellHandler::start("DoorbellHandler");
+    }
+
     if (mciReused)
     {
         // Remove all pending sessions. In <t-base-302A, there is a maximum of 64 sessions.
@@ -368,6 +431,17 @@ bool MobiCoreDevice::waitMcpNotification(void)
         TAExitHandler::wakeup();
         LOG_I("waitMcpNotification(): terminate Exit handler thread");
 
+        OutboxHandler::terminate();
+        OutboxHandler::wakeup();
+        LOG_I("waitMcpNotification(): terminate Outbox handler thread");
+
+        if (getDoorbellWindow() != 0)
+        {
+            DoorbellHandler::terminate();
+            DoorbellHandler::wakeup();
+            LOG_I("waitMcpNotification(): terminate Doorbell handler thread");
+        }
+
         DeviceIrqHandler::join();
         LOG_I("waitMcpNotification(): IrqHandler joined");
         LOG_E("IrqHandler thread died!");
@@ -380,6 +454,15 @@ bool MobiCoreDevice::waitMcpNotification(void)
         LOG_I("waitMcpNotification(): Exit handler Joined");
         LOG_E("TAExitHandler thread died!");
 
+        OutboxHandler::join();
+        LOG_I("waitMcpNotification(): Outbox handler Joined");
+
+        if (getDoorbellWindow() != 0)
+        {
+            DoorbellHandler::join();
+            LOG_I("waitMcpNotification(): Doorbell handler Joined");
+        }
+
         return false;
     }
     return true;
@@ -528,9 +611,7 @@ mcResult_t MobiCoreDevice::openSession(
         LOG_I(" Trusted App has gp_level %d",trustletSession->gp_level);
         trustletSession->sessionState = TrustletSession::TS_TA_RUNNING;
 
-        mutex_tslist.lock();
-        trustletSessions.push_back(trustletSession);
-        mutex_tslist.unlock();
+        trustletSessions.add(trustletSession);
 
         if (tciHandle != 0 && tciLen != 0) {
             trustletSession->addBulkBuff(new CWsm(NULL, pLoadDataOpenSession->len, tciHandle, 0));
@@ -608,44 +689,115 @@ mcResult_t MobiCoreDevice::checkLoad(
 
 
 //------------------------------------------------------------------------------
-TrustletSession *MobiCoreDevice::registerTrustletConnection(
-    Connection                    *connection,
+TrustletSession *MobiCoreDevice::findNqSession(
     MC_DRV_CMD_NQ_CONNECT_struct *cmdNqConnect
 )
 {
-    LOG_I(" Registering notification socket with Service session %03x.",
+    LOG_I(" Looking up Service session %03x for notification socket.",
           cmdNqConnect->sessionId);
     LOG_V("  Searching sessionId %03x with sessionMagic %d",
           cmdNqConnect->sessionId,
           cmdNqConnect->sessionMagic);
 
 
-    for (trustletSessionIterator_t iterator = trustletSessions.begin();
-         iterator != trustletSessions.end();
-         ++iterator)
-    {
-        TrustletSession *session = *iterator;
+    uint32_t epoch = trustletSessions.readLock();
+    TrustletSession *session = getTrustletSession(cmdNqConnect->sessionId);
+    trustletSessions.readUnlock(epoch);
 
-        if (((uintptr_t)session & UINT_MAX) != cmdNqConnect->deviceSessionId) {
-            continue;
-        }
+    if ((session == NULL)
+            || (((uintptr_t)session & UINT_MAX) != cmdNqConnect->deviceSessionId)
+            || (session->sessionMagic != cmdNqConnect->sessionMagic)) {
+        LOG_I("findNqSession(): search failed");
+        return NULL;
+    }
 
-        if ( (session->sessionMagic != cmdNqConnect->sessionMagic)
-                || (session->sessionId != cmdNqConnect->sessionId)) {
-            continue;
-        }
+    LOG_I(" Found Service session.");
+
+    return session;
+}
 
-        session->notificationConnection = connection;
 
-        LOG_I(" Found Service session, registered connection.");
+//------------------------------------------------------------------------------
+void MobiCoreDevice::attachTrustletConnection(
+    TrustletSession *session,
+    Connection      *connection
+)
+{
+    // Queued notifications must reach the client before any new one
+    mutex_connection.lock();
+    // A client which could not use a shared connection falls back to its own
+    session->dropConnection();
+    session->notificationConnection = connection;
+    if (!session->processQueuedNotifications()) {
+        deferOutbox(session->sessionId);
+    }
+    mutex_connection.unlock();
+}
 
 
-        return session;
+//------------------------------------------------------------------------------
+bool MobiCoreDevice::createSharedChannel(
+    TrustletSession     *session,
+    Connection          *connection,
+    NotificationRing    *ring
+)
+{
+    mutex_connection.lock();
+    Connection *deviceConnection = session->deviceConnection;
+    if (deviceConnection == NULL) {
+        mutex_connection.unlock();
+        delete ring;
+        return false;
     }
 
+    // The map holds the first reference, a client setting up a new channel
+    // leaves the old one to the sessions still using it
+    SharedNotificationConnection *channel = new SharedNotificationConnection(connection, ring);
+    std::map<Connection *, SharedNotificationConnection *>::iterator it = sharedChannels.find(deviceConnection);
+    if (it != sharedChannels.end()) {
+        it->second->put();
+    }
+    sharedChannels[deviceConnection] = channel;
+
+    channel->get();
+    session->dropConnection();
+    session->channel = channel;
+    session->notificationConnection = connection;
+    if (!session->processQueuedNotifications()) {
+        deferOutbox(session->sessionId);
+    }
+    mutex_connection.unlock();
+    return true;
+}
 
-    LOG_I("registerTrustletConnection(): search failed");
-    return NULL;
+
+//------------------------------------------------------------------------------
+mcResult_t MobiCoreDevice::attachSharedChannel(
+    Connection  *deviceConnection,
+    uint32_t    sessionId
+)
+{
+    TrustletSession *session = findSession(deviceConnection, sessionId);
+    if (session == NULL) {
+        return MC_DRV_ERR_DAEMON_UNKNOWN_SESSION;
+    }
+
+    mutex_connection.lock();
+    std::map<Connection *, SharedNotificationConnection *>::iterator it = sharedChannels.find(deviceConnection);
+    if ((it == sharedChannels.end()) || (session->notificationConnection != NULL)) {
+        mutex_connection.unlock();
+        LOG_E("no shared notification connection for session %03x", sessionId);
+        return MC_DRV_ERR_NQ_FAILED;
+    }
+
+    it->second->get();
+    session->channel = it->second;
+    session->notificationConnection = it->second->connection;
+    if (!session->processQueuedNotifications()) {
+        deferOutbox(session->sessionId);
+    }
+    mutex_connection.unlock();
+    return MC_DRV_OK;
 }
 
 
@@ -668,10 +820,10 @@ mcResult_t MobiCoreDevice::closeSession(
         mutex_connection.lock();
         LOG_I(" Closing GP TA session...");
         // Disconnect client from this session
+        trustletSessions.disown(session);
         session->deviceConnection = NULL;
-        // Free connection, i.e. close nq socket
-        delete session->notificationConnection;
-        session->notificationConnection = NULL;
+        // Free connection, i.e. close nq socket unless other sessions share it
+        session->dropConnection();
         // If exit notification from task arrives during MCP_CLOSE,
         // Daemon can see that CA is already away
         session->sessionState = TrustletSession::TS_CLOSE_SEND;
@@ -719,7 +871,7 @@ void MobiCoreDevice::freeSession(
         pWsm = session->popBulkBuff();
     }
 
-    // remove session from list.
+    // remove session from table, nobody can see it afterwards
     mutex_tslist.lock();
     trustletSessions.remove(session);
     mutex_tslist.unlock();
@@ -727,6 +879,16 @@ void MobiCoreDevice::freeSession(
 }
 
 
+//------------------------------------------------------------------------------
+void MobiCoreDevice::queueDeadSession(
+    uint32_t sessionId
+) {
+    mutex_dead.lock();
+    deadSessions.push_back(sessionId);
+    mutex_dead.unlock();
+    TAExitHandler::wakeup();
+}
+
 //------------------------------------------------------------------------------
 void MobiCoreDevice::queueUnknownNotification(
      notification_t notification
@@ -32,6 +32,9 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <list>
+#include <unistd.h>
+#include <poll.h>
+#include <vector>
 
 #include "McTypes.h"
 #include "mc_linux.h"
@@ -290,6 +293,14 @@ void TrustZoneDevice::notify(
     notification_t notification = { sessionId : sessionId, payload : 0 };
 
     nq->putNotification(&notification);
+
+    // In coalescing mode client notifications wait for the doorbell thread,
+    // MCP ones are sent at once and take any pending ones along
+    if (sessionId != SID_MCP && queueDoorbell()) {
+        return;
+    }
+    (void)takeDoorbellBatch();
+
     //IMPROVEMENT-2012-03-07-maneaval What happens when/if nsiq fails?
     //In the old days an exception would be thrown but it was uncertain
     //where it was handled, some server(sock or Netlink). In that case
@@ -639,6 +650,8 @@ void TrustZoneDevice::schedule(void)
         {
             // Slice expired, so force MC internal scheduling decision
             timeslice = SCHEDULING_FREQ;
+            // Client notifications waiting for the doorbell ride along
+            (void)takeDoorbellBatch();
             if (!nsiq())
             {
                 LOG_E("sending N-SIQ failed");
@@ -682,46 +695,65 @@ terminate_scheduler:
 void TrustZoneDevice::handleTaExit(void)
 {
     LOG_I("Starting Trusted Application Exit handler...");
+    bool reaping = false;
     for (;;) {
-        // Wait until we get a notification without CA
-        TAExitHandler::sleep();
-        if (TAExitHandler::shouldTerminate())
-            break;
+        // Wait until we get a notification without CA or a client is dropped
+        if (!reaping) {
+            TAExitHandler::sleep();
+            if (TAExitHandler::shouldTerminate())
+                break;
+        }
 
-        // Wait until socket server frees MCP
-        // Make sure we don't interfere with handleConnection/dropConnection
-        mutex_mcp.lock();
-
-        // Check all sessions
-        // Socket server might have closed already and removed the session we were waken up for
-        for (;;) {
-            mutex_tslist.lock();
-            TrustletSession* ts = NULL;
-            for (trustletSessionList_t::iterator it = trustletSessions.begin(); it != trustletSessions.end(); it++) {
-                if ((*it)->sessionState == TrustletSession::TS_TA_DEAD) {
-                    ts = *it;
-                    break;
+        // Take all sessions queued so far, they are closed as one batch
+        std::vector<uint32_t> batch;
+        mutex_dead.lock();
+        batch.swap(deadSessions);
+        mutex_dead.unlock();
+        if (!batch.empty()) {
+            // Wait until socket server frees MCP
+            // Make sure we don't interfere with handleConnection/dropConnection
+            mutex_mcp.lock();
+
+            // The MCP buffer holds a single command, so the close commands are
+            // sent back to back within one MCP ownership rather than in parallel.
+            // Socket server might have closed already and removed the session we were waken up for
+            std::vector<uint32_t> retry;
+            for (std::vector<uint32_t>::iterator it = batch.begin(); it != batch.end(); it++) {
+                uint32_t epoch = trustletSessions.readLock();
+                TrustletSession* ts = getTrustletSession(*it);
+                if ((ts != NULL) && (ts->sessionState != TrustletSession::TS_TA_DEAD)) {
+                    ts = NULL;
+                }
+                trustletSessions.readUnlock(epoch);
+                if (!ts) {
+                    continue;
                 }
-            }
-            mutex_tslist.unlock();
-            if (!ts) {
-                break;
-            }
 #ifndef NDEBUG
-            uint32_t sessionId = ts->sessionId;
+                uint32_t sessionId = ts->sessionId;
 #endif
-            LOG_I("Cleaning up session %03x", sessionId);
-            // Tell t-base to close the session (list gets locked in handleIrq() when MCP replies)
-            mcResult_t mcRet = closeSessionInternal(ts);
-            // If ok, remove objects
-            if (mcRet == MC_DRV_OK) {
-                freeSession(ts);
-                LOG_I("TA session %03x finally closed", sessionId);
-            } else {
-                LOG_I("TA session %03x could not be closed yet.", sessionId);
+                LOG_I("Cleaning up session %03x", sessionId);
+                // Tell t-base to close the session
+                mcResult_t mcRet = closeSessionInternal(ts);
+                // If ok, remove objects
+                if (mcRet == MC_DRV_OK) {
+                    freeSession(ts);
+                    LOG_I("TA session %03x finally closed", sessionId);
+                } else {
+                    LOG_I("TA session %03x could not be closed yet.", sessionId);
+                    retry.push_back(*it);
+                }
             }
+            LOG_I("Cleaned up %zu dead sessions, %zu left", batch.size() - retry.size(), retry.size());
+
+            // Try again with the next batch
+            mutex_dead.lock();
+            deadSessions.insert(deadSessions.end(), retry.begin(), retry.end());
+            mutex_dead.unlock();
+            mutex_mcp.unlock();
         }
-        mutex_mcp.unlock();
+
+        // Tear down dropped clients one session at a time
+        reaping = reapNextSession();
     }
     TAExitHandler::setExiting();
     signalMcpNotification();
@@ -738,6 +770,8 @@ void TrustZoneDevice::handleIrq(
 
     for (;;)
     {
+        // Sessions which got notifications during this burst
+        std::set<uint32_t> outboxes;
 
         LOG_I(" No notifications pending, waiting for S-SIQ");
         if (!waitSsiq())
@@ -777,7 +811,9 @@ void TrustZoneDevice::handleIrq(
             // Get the Trustlet session for the session ID
             TrustletSession *ts = NULL;
 
-            mutex_tslist.lock();
+            // Sessions cannot be freed while we look at them, but we never
+            // wait for the command path to do so
+            uint32_t epoch = trustletSessions.readLock();
             ts = getTrustletSession(notification->sessionId);
             if (ts == NULL) {
                 /* Couldn't find the session for this notifications
@@ -793,23 +829,38 @@ void TrustZoneDevice::handleIrq(
                 // Get the NQ connection for the session ID
                 Connection *connection = ts->notificationConnection;
                 if (connection == NULL) {
+                    bool dead = (ts->sessionState == TrustletSession::TS_TA_DEAD);
                     ts->queueNotification(notification);
-                    if (ts->deviceConnection == NULL) {
-                        LOG_I("  Notification for disconnected client, scheduling cleanup of sessions.");
-                        TAExitHandler::wakeup();
+                    // Queue each session once, when its TA is found dead
+                    if ((ts->deviceConnection == NULL) && !dead
+                            && (ts->sessionState == TrustletSession::TS_TA_DEAD)) {
+                        LOG_I("  Notification for disconnected client, scheduling cleanup of session.");
+                        queueDeadSession(ts->sessionId);
                     }
                 } else {
-                    LOG_I(" Forward notification to McClient.");
-                    // Forward session ID and additional payload of
-                    // notification to the TLC/Application layer
-                    connection->writeData((void *)notification,
-                                          sizeof(notification_t));
+                    // Only classify here, the burst is forwarded to the
+                    // TLC/Application layer once the queue is empty
+                    ts->postNotification(notification);
+                    outboxes.insert(ts->sessionId);
                 }
                 mutex_connection.unlock();
             }
-            mutex_tslist.unlock();
+            trustletSessions.readUnlock(epoch);
         } // for (;;) over notifiction queue
 
+        // Forward the burst, one write per client, never waiting for one
+        if (!outboxes.empty()) {
+            LOG_I(" Forward notifications to %zu McClient sessions.", outboxes.size());
+            flushOutboxes(outboxes);
+            if (!outboxes.empty()) {
+                // Slow clients, leave them to the outbox handler
+                mutex_outbox.lock();
+                stalledOutboxes.insert(outboxes.begin(), outboxes.end());
+                mutex_outbox.unlock();
+                OutboxHandler::wakeup();
+            }
+        }
+
         // finished processing notifications. It does not matter if there were
         // any notification or not. S-SIQs can also be triggered by an SWd
         // driver which was waiting for a FIQ. In this case the S-SIQ tells
@@ -826,3 +877,137 @@ void TrustZoneDevice::handleIrq(
     signalMcpNotification();
 }
 
+
+//------------------------------------------------------------------------------
+void TrustZoneDevice::handleDoorbell(
+    void
+) {
+    LOG_I("Starting Doorbell handler, window is %u us", getDoorbellWindow());
+
+    for (;;)
+    {
+        // Wait for the first notification of a batch
+        DoorbellHandler::sleep();
+        if (DoorbellHandler::shouldTerminate())
+            break;
+
+        // Give other clients the chance to join the batch
+        usleep(getDoorbellWindow());
+
+        // Nothing to do if an MCP notification, a full batch or the
+        // scheduler's N-SIQ rang meanwhile
+        if (takeDoorbellBatch() == 0)
+            continue;
+
+        if (!nsiq())
+        {
+            LOG_E("sending N-SIQ failed");
+        }
+    }
+
+    dumpDoorbellStats();
+    DoorbellHandler::setExiting();
+    LOG_E("doorbell loop terminated");
+}
+
+
+//------------------------------------------------------------------------------
+void TrustZoneDevice::flushOutboxes(
+    std::set<uint32_t> &sessions
+) {
+    uint32_t epoch = trustletSessions.readLock();
+    mutex_connection.lock();
+    for (std::set<uint32_t>::iterator it = sessions.begin(); it != sessions.end();) {
+        TrustletSession *ts = getTrustletSession(*it);
+        // Session may have been closed meanwhile
+        if ((ts == NULL) || ts->flushOutbox()) {
+            sessions.erase(it++);
+        } else {
+            it++;
+        }
+    }
+    mutex_connection.unlock();
+    trustletSessions.readUnlock(epoch);
+}
+
+
+//------------------------------------------------------------------------------
+void TrustZoneDevice::deferOutbox(
+    uint32_t sessionId
+) {
+    mutex_outbox.lock();
+    stalledOutboxes.insert(sessionId);
+    mutex_outbox.unlock();
+    OutboxHandler::wakeup();
+}
+
+
+//------------------------------------------------------------------------------
+void TrustZoneDevice::handleOutbox(
+    void
+) {
+    LOG_I("Starting Outbox handler...");
+
+    for (;;)
+    {
+        // Wait until the IRQ handler leaves notifications behind
+        OutboxHandler::sleep();
+        if (OutboxHandler::shouldTerminate())
+            break;
+
+        for (;;)
+        {
+            std::set<uint32_t> sessions;
+            std::vector<struct pollfd> fds;
+
+            mutex_outbox.lock();
+            sessions.swap(stalledOutboxes);
+            mutex_outbox.unlock();
+            if (sessions.empty() || OutboxHandler::shouldTerminate())
+                break;
+
+            // Wait until at least one of the clients can take data again
+            int ringTimeout = -1;
+            uint32_t epoch = trustletSessions.readLock();
+            mutex_connection.lock();
+            for (std::set<uint32_t>::iterator it = sessions.begin(); it != sessions.end();) {
+                TrustletSession *ts = getTrustletSession(*it);
+                if ((ts != NULL) && (ts->channel != NULL) && (ts->channel->ring != NULL)) {
+                    // Nothing tells when a ring drains, retry after the
+                    // timeout. A client which stopped reading is kept, but
+                    // only retried now and then.
+                    if (!ts->outboxFull()) {
+                        ringTimeout = OUTBOX_POLL_TIMEOUT;
+                    } else if (ringTimeout == -1) {
+                        LOG_I("Client of session %03x does not drain its ring", *it);
+                        ringTimeout = OUTBOX_IDLE_TIMEOUT;
+                    }
+                } else if ((ts != NULL) && (ts->notificationConnection != NULL)) {
+                    struct pollfd pfd;
+                    pfd.fd = ts->notificationConnection->socketDescriptor;
+                    pfd.events = POLLOUT;
+                    pfd.revents = 0;
+                    fds.push_back(pfd);
+                }
+                it++;
+            }
+            mutex_connection.unlock();
+            trustletSessions.readUnlock(epoch);
+            if (!fds.empty()) {
+                (void)poll(&fds[0], fds.size(), OUTBOX_POLL_TIMEOUT);
+            } else if (ringTimeout != -1) {
+                (void)poll(NULL, 0, ringTimeout);
+            }
+
+            flushOutboxes(sessions);
+
+            mutex_outbox.lock();
+            stalledOutboxes.insert(sessions.begin(), sessions.end());
+            mutex_outbox.unlock();
+        }
+    }
+
+    OutboxHandler::setExiting();
+    LOG_E("outbox loop terminated");
+}
+
@@ -38,6 +38,7 @@
 
 
 #include <stdint.h>
+#include <set>
 
 #include "McTypes.h"
 
@@ -61,6 +62,8 @@ protected:
     CMcKMod_ptr  pMcKMod; /**< kernel module */
     CWsm_ptr     pWsmMcp; /**< WSM use for MCP */
     CWsm_ptr     mobicoreInDDR;  /**< WSM used for Mobicore binary */
+    std::set<uint32_t> stalledOutboxes; /**< Sessions whose client did not take all notifications */
+    CMutex       mutex_outbox; /**< Protects stalledOutboxes */
 
     /** Access functions to the MC Linux kernel module
      */
@@ -70,6 +73,13 @@ protected:
 
     bool waitSsiq(void);
 
+    /** Send the outboxes of the given sessions without blocking.
+     *
+     * @param sessions IDs of the sessions to flush, only the sessions which
+     *                 still have notifications pending are left in it.
+     */
+    void flushOutboxes(std::set<uint32_t> &sessions);
+
 public:
 
     TrustZoneDevice(void);
@@ -136,6 +146,12 @@ public:
     void handleIrq(void);
 
     void handleTaExit(void);
+
+    void handleDoorbell(void);
+
+    void handleOutbox(void);
+
+    void deferOutbox(uint32_t sessionId);
 };
 
 #endif /* TRUSTZONEDEVICE_H_ */
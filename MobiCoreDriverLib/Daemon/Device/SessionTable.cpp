@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <cstdlib>
+#include <sched.h>
+
+#include "SessionTable.h"
+#include "log.h"
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+SessionTable::SessionTable(void) :
+    epoch(0)
+{
+    readers[0] = 0;
+    readers[1] = 0;
+    current = (snapshot_t *)calloc(1, sizeof(snapshot_t));
+}
+
+//------------------------------------------------------------------------------
+SessionTable::~SessionTable(void)
+{
+    free(current);
+}
+
+//------------------------------------------------------------------------------
+uint32_t SessionTable::readLock(void)
+{
+    for (;;) {
+        uint32_t e = epoch;
+        __sync_fetch_and_add(&readers[e & 1], 1);
+        // A writer may have flipped the epoch before we were counted, it
+        // might not wait for us then, so retry in the new epoch
+        if (e == epoch) {
+            return e;
+        }
+        __sync_fetch_and_sub(&readers[e & 1], 1);
+    }
+}
+
+//------------------------------------------------------------------------------
+void SessionTable::readUnlock(uint32_t e)
+{
+    __sync_fetch_and_sub(&readers[e & 1], 1);
+}
+
+//------------------------------------------------------------------------------
+TrustletSession *SessionTable::find(uint32_t sessionId)
+{
+    snapshot_t *snapshot = current;
+    uint32_t low = 0;
+    uint32_t high = snapshot->count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (snapshot->entries[mid].sessionId < sessionId) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if ((low < snapshot->count) && (snapshot->entries[low].sessionId == sessionId)) {
+        return snapshot->entries[low].session;
+    }
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+TrustletSession *SessionTable::findLast(Connection *deviceConnection)
+{
+    TrustletSession *session = NULL;
+
+    mutex.lock();
+    connectionIndex_t::iterator it = byConnection.find(deviceConnection);
+    if ((it != byConnection.end()) && !it->second.empty()) {
+        session = it->second.back();
+    }
+    mutex.unlock();
+    return session;
+}
+
+//------------------------------------------------------------------------------
+void SessionTable::add(TrustletSession *session)
+{
+    mutex.lock();
+    snapshot_t *old = current;
+    snapshot_t *snapshot = (snapshot_t *)malloc(sizeof(snapshot_t) +
+                           (old->count + 1) * sizeof(entry_t));
+    if (snapshot == NULL) {
+        LOG_E("No memory to add session %03x", session->sessionId);
+        mutex.unlock();
+        return;
+    }
+
+    // Keep the entries sorted for the lookup
+    uint32_t i = 0, j = 0;
+    while ((i < old->count) && (old->entries[i].sessionId < session->sessionId)) {
+        snapshot->entries[j++] = old->entries[i++];
+    }
+    snapshot->entries[j].sessionId = session->sessionId;
+    snapshot->entries[j++].session = session;
+    while (i < old->count) {
+        snapshot->entries[j++] = old->entries[i++];
+    }
+    snapshot->count = j;
+
+    byConnection[session->deviceConnection].push_back(session);
+    publish(snapshot);
+    mutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+void SessionTable::disown(TrustletSession *session)
+{
+    mutex.lock();
+    disownLocked(session);
+    mutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+void SessionTable::disownAll(Connection *deviceConnection, vector<TrustletSession *> &sessions)
+{
+    mutex.lock();
+    connectionIndex_t::iterator it = byConnection.find(deviceConnection);
+    if (it != byConnection.end()) {
+        sessions.swap(it->second);
+        byConnection.erase(it);
+    }
+    mutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+void SessionTable::remove(TrustletSession *session)
+{
+    mutex.lock();
+    snapshot_t *old = current;
+    snapshot_t *snapshot = (snapshot_t *)malloc(sizeof(snapshot_t) +
+                           old->count * sizeof(entry_t));
+    if (snapshot == NULL) {
+        // Cannot shrink, but must not leave a dangling entry either
+        LOG_E("No memory to remove session %03x", session->sessionId);
+        for (uint32_t i = 0; i < old->count; i++) {
+            if (old->entries[i].session == session) {
+                old->entries[i].session = NULL;
+            }
+        }
+        synchronize();
+    } else {
+        uint32_t j = 0;
+        for (uint32_t i = 0; i < old->count; i++) {
+            if ((old->entries[i].session != session) && (old->entries[i].session != NULL)) {
+                snapshot->entries[j++] = old->entries[i];
+            }
+        }
+        snapshot->count = j;
+        publish(snapshot);
+    }
+
+    disownLocked(session);
+    mutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+size_t SessionTable::size(void)
+{
+    return current->count;
+}
+
+//------------------------------------------------------------------------------
+void SessionTable::publish(snapshot_t *snapshot)
+{
+    snapshot_t *old = current;
+
+    __sync_synchronize();
+    current = snapshot;
+    synchronize();
+    free(old);
+}
+
+//------------------------------------------------------------------------------
+void SessionTable::synchronize(void)
+{
+    uint32_t e = epoch;
+
+    // New readers see the new snapshot, wait for the ones which may still
+    // look at the old one
+    __sync_synchronize();
+    epoch = e + 1;
+    __sync_synchronize();
+    while (readers[e & 1] != 0) {
+        sched_yield();
+    }
+}
+
+//------------------------------------------------------------------------------
+void SessionTable::disownLocked(TrustletSession *session)
+{
+    connectionIndex_t::iterator it = byConnection.find(session->deviceConnection);
+    if (it == byConnection.end()) {
+        return;
+    }
+
+    vector<TrustletSession *> &sessions = it->second;
+    for (vector<TrustletSession *>::iterator s = sessions.begin(); s != sessions.end(); s++) {
+        if (*s == session) {
+            sessions.erase(s);
+            break;
+        }
+    }
+    if (sessions.empty()) {
+        byConnection.erase(it);
+    }
+}
+
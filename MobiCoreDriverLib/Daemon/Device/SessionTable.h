@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * Trustlet session table.
+ * Sessions are indexed by session ID and by owning client connection.
+ * Lookups by session ID run in a read section which never waits for
+ * writers: writers publish a new sorted snapshot and wait for the readers
+ * of the old one to leave before freeing anything (epoch based RCU).
+ */
+#ifndef SESSIONTABLE_H_
+#define SESSIONTABLE_H_
+
+#include <inttypes.h>
+#include <map>
+#include <vector>
+
+#include "CMutex.h"
+#include "Connection.h"
+#include "TrustletSession.h"
+
+
+class SessionTable
+{
+public:
+    SessionTable(void);
+
+    ~SessionTable(void);
+
+    /** Enter a read section.
+     *
+     * @return epoch to hand back to readUnlock().
+     */
+    uint32_t readLock(void);
+
+    /** Leave a read section.
+     *
+     * @param epoch value returned by readLock().
+     */
+    void readUnlock(uint32_t epoch);
+
+    /** Find a session by ID, caller has to be in a read section.
+     *
+     * @return session or NULL if not found.
+     */
+    TrustletSession *find(uint32_t sessionId);
+
+    /** Find the most recently opened session of a client connection.
+     *
+     * @return session or NULL if the connection owns no session.
+     */
+    TrustletSession *findLast(Connection *deviceConnection);
+
+    void add(TrustletSession *session);
+
+    /** Detach a session from its client connection, it stays findable by ID. */
+    void disown(TrustletSession *session);
+
+    /** Detach all sessions from a client connection, they stay findable by ID.
+     *
+     * @param deviceConnection client connection going away.
+     * @param sessions receives the sessions of the connection, in opening order.
+     */
+    void disownAll(Connection *deviceConnection, std::vector<TrustletSession *> &sessions);
+
+    /** Remove a session. On return no reader can still see it, it may be deleted.
+     * Must not be called from within a read section.
+     */
+    void remove(TrustletSession *session);
+
+    size_t size(void);
+
+private:
+    typedef struct {
+        uint32_t        sessionId;
+        TrustletSession *session;
+    } entry_t;
+
+    typedef struct {
+        uint32_t        count;
+        entry_t         entries[];
+    } snapshot_t;
+
+    typedef std::map<Connection *, std::vector<TrustletSession *> > connectionIndex_t;
+
+    snapshot_t * volatile current; /**< Published snapshot, sorted by session ID */
+    connectionIndex_t   byConnection; /**< Sessions of each client, in opening order */
+    CMutex              mutex; /**< Serializes writers */
+    volatile uint32_t   epoch;
+    volatile uint32_t   readers[2]; /**< Readers in even and odd epochs */
+
+    void publish(snapshot_t *snapshot);
+
+    void synchronize(void);
+
+    void disownLocked(TrustletSession *session);
+};
+
+#endif /* SESSIONTABLE_H_ */
+
@@ -30,16 +30,91 @@
  */
 #include "TrustletSession.h"
 #include <cstdlib>
+#include <sys/uio.h>
 
 #include "log.h"
 
 using namespace std;
 
+//------------------------------------------------------------------------------
+SharedNotificationConnection::SharedNotificationConnection(Connection *connection, NotificationRing *ring)
+{
+    this->connection = connection;
+    this->ring = ring;
+    this->refCount = 1;
+    this->carryOffset = 0;
+}
+
+
+//------------------------------------------------------------------------------
+SharedNotificationConnection::~SharedNotificationConnection(void)
+{
+    delete ring;
+    delete connection;
+}
+
+
+//------------------------------------------------------------------------------
+void SharedNotificationConnection::get(void)
+{
+    mutex.lock();
+    refCount++;
+    mutex.unlock();
+}
+
+
+//------------------------------------------------------------------------------
+void SharedNotificationConnection::put(void)
+{
+    mutex.lock();
+    bool last = (--refCount == 0);
+    mutex.unlock();
+    if (last) {
+        delete this;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+bool SharedNotificationConnection::flushCarry(void)
+{
+    if (carryOffset == 0) {
+        return true;
+    }
+
+    struct iovec iov;
+    iov.iov_base = (uint8_t *)&carry + carryOffset;
+    iov.iov_len = sizeof(notification_t) - carryOffset;
+    ssize_t ret = connection->writeDataVector(&iov, 1);
+    if (ret < 0) {
+        // Client gone, the stream does not matter anymore
+        carryOffset = 0;
+        return true;
+    }
+
+    carryOffset += (uint32_t)ret;
+    if (carryOffset >= sizeof(notification_t)) {
+        carryOffset = 0;
+    }
+    return carryOffset == 0;
+}
+
+
+//------------------------------------------------------------------------------
+void SharedNotificationConnection::keepCarry(const notification_t *notification, uint32_t sent)
+{
+    carry = *notification;
+    carryOffset = sent;
+}
+
+
 //------------------------------------------------------------------------------
 TrustletSession::TrustletSession(Connection *deviceConnection, uint32_t sessionId)
 {
     this->deviceConnection = deviceConnection;
     this->notificationConnection = NULL;
+    this->channel = NULL;
+    this->outboxOffset = 0;
     this->sessionId = sessionId;
     sessionMagic = rand();
     this->gp_level=0;
@@ -51,7 +126,7 @@ TrustletSession::TrustletSession(Connection *deviceConnection, uint32_t sessionI
 TrustletSession::~TrustletSession(void)
 {
     map<uint32_t, CWsm_ptr>::iterator it;
-    delete notificationConnection;
+    dropConnection();
 
     if (!buffers.empty()) {
         LOG_W("%s: Mapped buffers still available %zu", __func__, buffers.size());
@@ -85,21 +160,113 @@ void TrustletSession::queueNotification(notification_t *notification)
 }
 
 //------------------------------------------------------------------------------
-void TrustletSession::processQueuedNotifications(void)
+bool TrustletSession::processQueuedNotifications(void)
 {
     LOG_I(" %s:%i", __FILE__, __LINE__ );
 
     // Nothing to do here!
     if (notificationConnection == NULL)
-        return;
+        return true;
 
+    // Behind anything already waiting, a client which does not read must
+    // not hold up the caller, nor the other sessions on the device
     while (!notifications.empty()) {
-        // Forward session ID and additional payload of
-        // notification to the just established connection
-        notificationConnection->writeData((void *)&notifications.front(),
-                                          sizeof(notification_t));
+        postNotification(&notifications.front());
         notifications.pop();
     }
+    return flushOutbox();
+}
+
+//------------------------------------------------------------------------------
+void TrustletSession::dropConnection(void)
+{
+    if (channel != NULL) {
+        channel->put();
+        channel = NULL;
+    } else {
+        delete notificationConnection;
+    }
+    notificationConnection = NULL;
+}
+
+//------------------------------------------------------------------------------
+void TrustletSession::postNotification(notification_t *notification)
+{
+    if (outbox.size() >= TS_OUTBOX_SIZE) {
+        // The first entry may be partly sent already, it has to stay
+        deque<notification_t>::iterator victim = outbox.begin() + (outboxOffset ? 1 : 0);
+        for (deque<notification_t>::iterator it = victim; it != outbox.end(); it++) {
+            if (it->payload == 0) {
+                victim = it;
+                break;
+            }
+        }
+        LOG_W("Outbox of session %03x full, dropping notification with payload %d",
+              sessionId, victim->payload);
+        outbox.erase(victim);
+    }
+    outbox.push_back(*notification);
+}
+
+//------------------------------------------------------------------------------
+bool TrustletSession::flushOutbox(void)
+{
+    struct iovec iov[TS_OUTBOX_SIZE];
+    int cnt = 0;
+
+    if (notificationConnection == NULL) {
+        // Client gone, nobody to deliver to
+        outbox.clear();
+        outboxOffset = 0;
+        return true;
+    }
+
+    if ((channel != NULL) && (channel->ring != NULL)) {
+        while (!outbox.empty() && channel->ring->push(&outbox.front())) {
+            outbox.pop_front();
+        }
+        return outbox.empty();
+    }
+
+    // Entries of other sessions must not be cut into on a shared connection
+    if ((channel != NULL) && !channel->flushCarry()) {
+        return false;
+    }
+
+    for (deque<notification_t>::iterator it = outbox.begin();
+            it != outbox.end() && cnt < TS_OUTBOX_SIZE; it++, cnt++) {
+        iov[cnt].iov_base = &(*it);
+        iov[cnt].iov_len = sizeof(notification_t);
+    }
+    if (cnt == 0) {
+        return true;
+    }
+    iov[0].iov_base = (uint8_t *)iov[0].iov_base + outboxOffset;
+    iov[0].iov_len -= outboxOffset;
+
+    ssize_t ret = notificationConnection->writeDataVector(iov, cnt);
+    if (ret < 0) {
+        LOG_E("Forwarding %d notifications to session %03x failed", cnt, sessionId);
+        outbox.clear();
+        outboxOffset = 0;
+        return true;
+    }
+
+    // Remove what went out, remember where a partly sent entry stopped
+    size_t sent = outboxOffset + (size_t)ret;
+    while (!outbox.empty() && sent >= sizeof(notification_t)) {
+        outbox.pop_front();
+        sent -= sizeof(notification_t);
+    }
+    if ((channel != NULL) && (sent != 0)) {
+        // The channel finishes the entry before anybody else writes
+        channel->keepCarry(&outbox.front(), (uint32_t)sent);
+        outbox.pop_front();
+        sent = 0;
+    }
+    outboxOffset = (uint32_t)sent;
+
+    return outbox.empty() && ((channel == NULL) || !channel->hasCarry());
 }
 
 //------------------------------------------------------------------------------
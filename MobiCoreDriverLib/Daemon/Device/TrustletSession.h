@@ -34,14 +34,68 @@
 #include "NotificationQueue.h"
 #include "CWsm.h"
 #include "Connection.h"
+#include "CMutex.h"
+#include "NotificationRing.h"
 #include <queue>
+#include <deque>
 #include <map>
 
+#define TS_OUTBOX_SIZE  64  /**< Notifications kept for a client which does not read */
+
+
+/**
+ * Notification connection shared by all sessions of one client.
+ * Every session holding it keeps a reference, the last one closes the
+ * connection. The carry is only touched under the device's mutex_connection.
+ */
+class SharedNotificationConnection
+{
+private:
+    CMutex mutex; // Protects refCount
+    uint32_t refCount;
+    notification_t carry; // Entry which went out partly
+    uint32_t carryOffset; // Bytes of carry already sent, 0 if none pending
+
+public:
+    Connection *connection;
+    NotificationRing *ring; // Notifications go here instead of the connection if set
+
+    SharedNotificationConnection(Connection *connection, NotificationRing *ring);
+
+    ~SharedNotificationConnection(void);
+
+    void get(void);
+
+    /**
+     * Drop a reference, deletes the channel with the last one.
+     */
+    void put(void);
+
+    /**
+     * Finish sending a partly sent entry, so that the next entry starts
+     * on a boundary. Never waits for the socket.
+     *
+     * @return true if nothing is pending anymore.
+     */
+    bool flushCarry(void);
+
+    /**
+     * Take over the rest of an entry of which only sent bytes went out.
+     */
+    void keepCarry(const notification_t *notification, uint32_t sent);
+
+    bool hasCarry(void) {
+        return carryOffset != 0;
+    }
+};
+
 
 class TrustletSession
 {
 private:
     std::queue<notification_t> notifications;
+    std::deque<notification_t> outbox; // Notifications not yet sent to the client
+    uint32_t outboxOffset; // Bytes of the first outbox entry already sent
     std::map<uint32_t, CWsm_ptr> buffers;
 
 public:
@@ -49,6 +103,7 @@ public:
     uint32_t sessionMagic; // Random data
     Connection *deviceConnection; // Command socket for client "device"
     Connection *notificationConnection; // Notification socket for client session
+    SharedNotificationConnection *channel; // Set if notificationConnection is shared with other sessions
     uint32_t gp_level;
     enum TS_STATE {
         TS_TA_RUNNING,//->dead,close_send
@@ -63,7 +118,37 @@ public:
 
     void queueNotification(notification_t *notification);
 
-    void processQueuedNotifications(void);
+    /**
+     * Move the notifications queued while no client was connected to the
+     * outbox and send what the client takes without blocking.
+     *
+     * @return true if nothing is left for the outbox handler.
+     */
+    bool processQueuedNotifications(void);
+
+    /**
+     * Close the notification connection, or drop the reference to it if
+     * it is shared.
+     */
+    void dropConnection(void);
+
+    /**
+     * Add a notification to the outbox of a connected session.
+     * When the outbox overflows, plain wake-ups are dropped before
+     * notifications carrying a payload.
+     */
+    void postNotification(notification_t *notification);
+
+    /**
+     * Send the outbox to the client without blocking.
+     *
+     * @return true if the outbox is empty afterwards.
+     */
+    bool flushOutbox(void);
+
+    bool outboxFull(void) {
+        return outbox.size() >= TS_OUTBOX_SIZE;
+    }
 
     bool addBulkBuff(CWsm_ptr pWsm);
 
@@ -75,8 +160,5 @@ public:
 
 };
 
-typedef std::list<TrustletSession *> trustletSessionList_t;
-typedef trustletSessionList_t::iterator trustletSessionIterator_t;
-
 #endif /* TRUSTLETSESSION_H_ */
 
@@ -38,7 +38,10 @@
 #define MOBICOREDEVICE_H_
 
 #include <stdint.h>
+#include <time.h>
 #include <vector>
+#include <deque>
+#include <map>
 
 #include "McTypes.h"
 #include "MobiCoreDriverApi.h"
@@ -53,8 +56,11 @@
 #include "DeviceScheduler.h"
 #include "DeviceIrqHandler.h"
 #include "TAExitHandler.h"
+#include "DoorbellHandler.h"
+#include "OutboxHandler.h"
 #include "NotificationQueue.h"
 #include "TrustletSession.h"
+#include "SessionTable.h"
 #include "mcVersionInfo.h"
 
 
@@ -80,7 +86,8 @@ typedef struct {
  */
 extern MobiCoreDevice *getDeviceInstance(void);
 
-class MobiCoreDevice : public DeviceScheduler, public DeviceIrqHandler, public TAExitHandler
+class MobiCoreDevice : public DeviceScheduler, public DeviceIrqHandler, public TAExitHandler,
+    public DoorbellHandler, public OutboxHandler
 {
 
 protected:
@@ -90,11 +97,26 @@ protected:
     mcpMessage_t        *mcpMessage; /**< Pointer to the MCP message structure within the MCI buffer */
     CSemaphore          mcpSessionNotification; /**< Semaphore to synchronize incoming notifications for the MCP session */
 
-    trustletSessionList_t trustletSessions; /**< Available Trustlet Sessions */
+    SessionTable        trustletSessions; /**< Available Trustlet Sessions */
     mcVersionInfo_t     *mcVersionInfo; /**< MobiCore version info. */
     bool                mcFault; /**< Signal RTM fault */
     bool                mciReused; /**< Signal restart of Daemon. */
     CMutex              mutex_connection; // Mutex to share session->notificationConnection for GP cases
+    std::map<Connection *, SharedNotificationConnection *> sharedChannels; /**< Shared notification connection per device connection, protected by mutex_connection */
+    std::vector<uint32_t> deadSessions; /**< Sessions of gone clients whose TA died, to be closed by handleTaExit() */
+    CMutex              mutex_dead; // Protects deadSessions
+
+    typedef struct {
+        std::vector<uint32_t> sessions; /**< Sessions left to close, in opening order */
+        struct timespec     dropped; /**< When the client went away */
+    } reapJob_t;
+
+    std::deque<reapJob_t> reapQueue; /**< Dropped clients whose sessions are closed in the background */
+    CMutex              mutex_reap; // Protects reapQueue and the teardown statistics
+    uint32_t            reapBacklog; /**< Sessions waiting in reapQueue */
+    uint64_t            reapedClients; /**< Clients torn down so far */
+    uint64_t            reapTimeSumMs; /**< Teardown latency, summed over clients */
+    uint64_t            reapTimeMaxMs; /**< Worst teardown latency */
 
 
     /* In a special case a Trustlet can create a race condition in the daemon.
@@ -123,9 +145,28 @@ protected:
         Connection *deviceConnection,
         uint32_t sessionId);
 
+    /**
+     * Look up a session without locking.
+     * Caller has to be within a trustletSessions read section.
+     */
     TrustletSession *getTrustletSession(
         uint32_t sessionId);
 
+    /**
+     * Hand a dead session over to the TA exit handler for cleanup.
+     */
+    void queueDeadSession(
+        uint32_t sessionId);
+
+    /**
+     * Close the next session of a dropped client.
+     * Takes mutex_mcp for this one session only, so other clients get their
+     * MCP commands through in between.
+     *
+     * @return true if more sessions are waiting.
+     */
+    bool reapNextSession(void);
+
     mcResult_t mshNotifyAndWait(void);
 
     void signalMcpNotification(void);
@@ -141,7 +182,7 @@ private:
 
 public:
     CMutex mutex_mcp;    // This mutex should be taken before any access to below functions
-    CMutex mutex_tslist; // Mutex to share Trustlet  session list  ==> WARNING, do not CI, temporary fix.
+    CMutex mutex_tslist; // Serializes registration of notification connections with session removal
 
     virtual ~MobiCoreDevice();
 
@@ -162,8 +203,35 @@ public:
                          mcDrvRspOpenSessionPayload_ptr   pRspOpenSessionPayload);
 
 
-    TrustletSession *registerTrustletConnection(Connection *connection,
-            MC_DRV_CMD_NQ_CONNECT_struct  *cmdNqConnect);
+    /**
+     * Find the session a notification connection is meant for.
+     * The connection is only used once attachTrustletConnection() is called.
+     * Caller must hold mutex_tslist until then.
+     */
+    TrustletSession *findNqSession(MC_DRV_CMD_NQ_CONNECT_struct *cmdNqConnect);
+
+    /**
+     * Start forwarding notifications of a session to its notification
+     * connection, including the ones queued so far.
+     */
+    void attachTrustletConnection(TrustletSession *session, Connection *connection);
+
+    /**
+     * Make a notification connection the shared one of the session's client
+     * and attach the session to it.
+     * Caller must hold mutex_tslist.
+     *
+     * @param ring Shared memory ring to deliver to instead, may be NULL.
+     * @return false if the client is gone.
+     */
+    bool createSharedChannel(TrustletSession *session, Connection *connection,
+                             NotificationRing *ring);
+
+    /**
+     * Attach a session to the shared notification connection of its client.
+     * Caller must hold mutex_tslist.
+     */
+    mcResult_t attachSharedChannel(Connection *deviceConnection, uint32_t sessionId);
 
 
     void freeSession(TrustletSession *session);
@@ -200,6 +268,16 @@ public:
 
     virtual void handleIrq(void) = 0;
 
+    virtual void handleDoorbell(void) = 0;
+
+    virtual void handleOutbox(void) = 0;
+
+    /**
+     * Leave the notifications a client did not take yet to the outbox
+     * handler.
+     */
+    virtual void deferOutbox(uint32_t sessionId) = 0;
+
     //virtual bool freeWsm(CWsm_ptr pWsm) = 0;
 
     /**
@@ -14,4 +14,9 @@ LOCAL_C_INCLUDES += $(LOCAL_PATH)/$(FSD_PATH)/public \
                     $(LOCAL_PATH)/ClientLib/public/GP \
 
 # Add new source files here
-LOCAL_SRC_FILES += $(FSD_PATH)/FSD.cpp \
\ No newline at end of file
+LOCAL_SRC_FILES += $(FSD_PATH)/FSD.cpp \
+                   $(FSD_PATH)/FSDCache.cpp \
+                   $(FSD_PATH)/FSDFdCache.cpp \
+                   $(FSD_PATH)/FSDStats.cpp \
+                   $(FSD_PATH)/FSDBackend.cpp \
+                   $(FSD_PATH)/FSDPackBackend.cpp \
\ No newline at end of file
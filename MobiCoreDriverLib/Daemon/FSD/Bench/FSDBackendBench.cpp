@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * FSD backend benchmark.
+ *
+ * Writes a number of small objects of one TA through an FSD backend, each
+ * made durable like a write-through FSD request, then reads them all back,
+ * checks for them in random order, reads a few of them over and over, and
+ * reports operations per second and the average latency. Run it once per backend to compare the flat and the
+ * sharded file-per-object layout with pack files.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <vector>
+
+#include "FSDBackend.h"
+#include "PrivateRegistry.h"
+
+// The benchmark runs without the registry, nothing deletes TA storage
+uint32_t mcRegistryStorageGeneration(void)
+{
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+static double elapsed(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+//------------------------------------------------------------------------------
+static string objectPath(const string &dir, uint32_t i)
+{
+    char name[48];
+
+    // Object names are 20 bytes in hex, as FSD makes them
+    snprintf(name, sizeof(name), "/%032x%08x", 0, i);
+    return dir + name;
+}
+
+//------------------------------------------------------------------------------
+static void report(const char *what, uint32_t ops, uint32_t failed, double secs)
+{
+    printf("%-10s %u ops in %.3f s: %.1f IOPS, %.2f us/op, %u failed\n", what, ops, secs,
+           secs > 0 ? (ops - failed) / secs : 0.0, secs * 1000000.0 / ops, failed);
+}
+
+//------------------------------------------------------------------------------
+static void printUsage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-lxmq] [-n OBJECTS] [-s SIZE] [-d DIR]\n", name);
+    fprintf(stderr, "-l\t\tuse pack files (default one file per object)\n");
+    fprintf(stderr, "-x\t\tuse sharded directories for the object files\n");
+    fprintf(stderr, "-m\t\twrite the objects in the flat layout, to time their migration\n");
+    fprintf(stderr, "-q\t\tsync once after all writes instead of after each\n");
+    fprintf(stderr, "-n OBJECTS\tnumber of objects (default 1000)\n");
+    fprintf(stderr, "-s SIZE\t\tobject size in bytes (default 256)\n");
+    fprintf(stderr, "-d DIR\t\tscratch directory (default /data/local/tmp/fsdbench)\n");
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    uint32_t objects = 1000;
+    uint32_t size = 256;
+    string root = "/data/local/tmp/fsdbench";
+    bool migrate = false;
+    bool syncEach = true;
+    int c;
+
+    while ((c = getopt(argc, argv, "lxmqn:s:d:h")) != -1) {
+        switch (c) {
+        case 'l':
+            FSDBackend::setType(FSD_BACKEND_PACK);
+            break;
+        case 'x':
+            FSDBackend::setType(FSD_BACKEND_SHARDED);
+            break;
+        case 'm':
+            migrate = true;
+            break;
+        case 'q':
+            syncEach = false;
+            break;
+        case 'n':
+            objects = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            size = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            root = optarg;
+            break;
+        default:
+            printUsage(argv[0]);
+            return 2;
+        }
+    }
+    if (objects == 0 || size == 0) {
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    // A fresh TA directory for every run
+    char ta[32];
+    snprintf(ta, sizeof(ta), "/%08x", (uint32_t)getpid());
+    const string dir = root + ta;
+    mkdir(root.c_str(), 0700);
+    if (mkdir(dir.c_str(), 0700) != 0) {
+        fprintf(stderr, "cannot create %s: %s\n", dir.c_str(), strerror(errno));
+        return 1;
+    }
+
+    FSDBackend *backend = FSDBackend::get();
+    FSDFileBackend flat;
+    FSDBackend *writer = migrate ? &flat : backend;
+    std::vector<uint8_t> buf(size);
+    struct timeval start;
+    uint32_t failed = 0;
+
+    gettimeofday(&start, NULL);
+    for (uint32_t i = 0; i < objects; i++) {
+        memset(&buf[0], (int)i, size);
+        if (!writer->write(objectPath(dir, i), &buf[0], size, true) ||
+                (syncEach && !writer->sync(dir))) {
+            failed++;
+        }
+    }
+    if (!syncEach && !writer->sync(dir)) {
+        failed = objects;
+    }
+    report("write", objects, failed, elapsed(&start));
+
+    failed = 0;
+    gettimeofday(&start, NULL);
+    for (uint32_t i = 0; i < objects; i++) {
+        uint32_t objectSize = 0;
+        if (backend->read(objectPath(dir, i), &buf[0], size, &objectSize) != TEEC_SUCCESS ||
+                objectSize != size || buf[0] != (uint8_t)i) {
+            failed++;
+        }
+    }
+    report(migrate ? "migrate" : "read", objects, failed, elapsed(&start));
+
+    // Lookups land anywhere in the TA directory
+    std::vector<uint32_t> order(objects);
+    for (uint32_t i = 0; i < objects; i++) {
+        order[i] = i;
+    }
+    srand(objects);
+    for (uint32_t i = objects - 1; i > 0; i--) {
+        uint32_t j = rand() % (i + 1);
+        uint32_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    failed = 0;
+    gettimeofday(&start, NULL);
+    for (uint32_t i = 0; i < objects; i++) {
+        if (!backend->exists(objectPath(dir, order[i]))) {
+            failed++;
+        }
+    }
+    report("stat", objects, failed, elapsed(&start));
+
+    failed = 0;
+    gettimeofday(&start, NULL);
+    for (uint32_t i = 0; i < objects; i++) {
+        uint32_t objectSize = 0;
+        if (backend->read(objectPath(dir, order[i]), &buf[0], size, &objectSize) != TEEC_SUCCESS ||
+                objectSize != size) {
+            failed++;
+        }
+    }
+    report("open", objects, failed, elapsed(&start));
+
+    // A few hot objects, read over and over as TAs do with their metadata
+    uint32_t hot = objects < 16 ? objects : 16;
+    failed = 0;
+    gettimeofday(&start, NULL);
+    for (uint32_t i = 0; i < objects; i++) {
+        uint32_t objectSize = 0;
+        if (backend->read(objectPath(dir, i % hot), &buf[0], size, &objectSize) != TEEC_SUCCESS ||
+                objectSize != size) {
+            failed++;
+        }
+    }
+    report("hot read", objects, failed, elapsed(&start));
+
+    failed = 0;
+    gettimeofday(&start, NULL);
+    for (uint32_t i = 0; i < objects; i++) {
+        if (!backend->remove(objectPath(dir, i))) {
+            failed++;
+        }
+    }
+    backend->sync(dir);
+    report("delete", objects, failed, elapsed(&start));
+
+    printf("scratch data left in %s\n", dir.c_str());
+    return 0;
+}
@@ -44,22 +44,27 @@
 #include "log.h"
 
 #include "MobiCoreRegistry.h"
+#include "FSDBackend.h"
 
 /* The following definitions are not exported in the header files of the
    client API. */
 #define TEE_DATA_FLAG_EXCLUSIVE              0x00000400
-#define TEE_ERROR_STORAGE_NO_SPACE       ((TEEC_Result)0xFFFF3041)
-#define TEE_ERROR_CORRUPT_OBJECT         ((TEEC_Result)0xF0100001)
 
 extern string getTbStoragePath();
 
+uint32_t FSD::channels = 1;
+FSDCache FSD::cache;
+FSDStats FSD::stats;
+CMutex FSD::objectLocks[FSD_OBJECT_LOCKS];
+
 //------------------------------------------------------------------------------
 FSD::FSD(
-		void
+		uint32_t channel
 )
 {
     memset(&sessionHandle, 0, sizeof(mcSessionHandle_t));
     dci = NULL;
+    this->channel = channel;
 }
 
 FSD::~FSD(
@@ -67,6 +72,26 @@ FSD::~FSD(
 )
 {
 	FSD_Close();
+	if (channel == 0) {
+		cache.flush();
+		stats.dump();
+	}
+}
+
+//------------------------------------------------------------------------------
+void FSD::setChannels(
+    uint32_t channels
+)
+{
+    FSD::channels = channels ? channels : 1;
+}
+
+//------------------------------------------------------------------------------
+uint32_t FSD::getChannels(
+    void
+)
+{
+    return channels;
 }
 
 //------------------------------------------------------------------------------
@@ -88,8 +113,15 @@ void FSD::run(
         }
     }
 
+    if (channel == 0 && FSDCache::getWriteBack()) {
+        cache.start("McDaemon.FSDwb");
+    }
+    if (channel == 0) {
+        stats.start("McDaemon.FSDst");
+    }
+
     do {
-        LOG_I("%s: starting File Storage Daemon", TAG_LOG);
+        LOG_I("%s: starting File Storage Daemon channel %u", TAG_LOG, channel);
         ret = FSD_Open();
         if (ret != MC_DRV_OK)
             break;
@@ -227,6 +259,7 @@ mcResult_t FSD::FSD_Close(void){
 
 void FSD::FSD_listenDci(void){
     mcResult_t  mcRet;
+    uint64_t    phaseUs[FSD_PHASES];
     LOG_I("FSD_listenDci(): DCI listener \n");
 
 
@@ -235,17 +268,25 @@ void FSD::FSD_listenDci(void){
         LOG_I("FSD_listenDci(): Waiting for notification\n");
 
         /* Wait for notification from SWd */
+        uint64_t start = FSDStats::now();
         if (MC_DRV_OK != mcWaitNotification(&sessionHandle, MC_INFINITE_TIMEOUT))
         {
             LOG_E("FSD_listenDci(): mcWaitNotification failed\n");
             break;
         }
+        uint64_t received = FSDStats::now();
 
         /* Received exception. */
         LOG_I("FSD_listenDci(): Received Command (0x%.8x) from STH\n",
               dci->sth_request.type);
 
+        uint32_t type = dci->sth_request.type;
+        uint32_t bytes = (type == STH_MESSAGE_TYPE_READ || type == STH_MESSAGE_TYPE_WRITE) ?
+                         dci->sth_request.payloadLen : 0;
         mcRet = FSD_ExecuteCommand();
+        uint64_t executed = FSDStats::now();
+        /* The DCI belongs to the STH again once it is notified */
+        bool failed = (dci->sth_request.status != TEEC_SUCCESS);
 
         /* notify the STH*/
         mcRet = mcNotify(&sessionHandle);
@@ -253,6 +294,10 @@ void FSD::FSD_listenDci(void){
             LOG_E("FSD_executeCommand(): mcNotify returned: %d\n", mcRet);
             break;
         }
+        phaseUs[FSD_PHASE_WAIT] = received - start;
+        phaseUs[FSD_PHASE_IO] = executed - received;
+        phaseUs[FSD_PHASE_NOTIFY] = FSDStats::now() - executed;
+        stats.record(type, bytes, failed, phaseUs);
     }
 }
 
@@ -342,8 +387,35 @@ void FSD_CreateFilePath(
 
 }
 
+// Requests for the same object always map to the same lock
+static uint32_t FSD_ObjectLockIndex(
+				STH_FSD_message_t    *sth_request
+){
+	const unsigned char* p = (const unsigned char*)&sth_request->uuid;
+	uint32_t hash = 2166136261u;
+	uint32_t i=0;
+
+	for (i = 0; i < sizeof(TEE_UUID); i++) {
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+	for (i = 0; i < STH_PUBLIC_FILE_NAME_SIZE; i++) {
+		hash = (hash ^ sth_request->filename[i]) * 16777619u;
+	}
+	return hash % FSD_OBJECT_LOCKS;
+}
+
 //------------------------------------------------------------------------------
 mcResult_t FSD::FSD_ExecuteCommand(void){
+	// Deleting a whole TA directory excludes requests for any object
+	bool lockAll = (dci->sth_request.type == STH_MESSAGE_TYPE_DELETE_ALL);
+	uint32_t lock = FSD_ObjectLockIndex(&dci->sth_request);
+	uint32_t i=0;
+
+	for (i = 0; i < FSD_OBJECT_LOCKS; i++) {
+		if (lockAll || i == lock) {
+			objectLocks[i].lock();
+		}
+	}
 	switch(dci->sth_request.type)
 			{
 				//--------------------------------------
@@ -383,6 +455,11 @@ mcResult_t FSD::FSD_ExecuteCommand(void){
 					LOG_E("FSD_ExecuteCommand(): Received unknown command %x. Ignoring..\n", dci->sth_request.type);
 					break;
 			}
+	for (i = FSD_OBJECT_LOCKS; i > 0; i--) {
+		if (lockAll || i - 1 == lock) {
+			objectLocks[i - 1].unlock();
+		}
+	}
 	return dci->sth_request.status;
 }
 
@@ -391,9 +468,9 @@ mcResult_t FSD::FSD_ExecuteCommand(void){
 
 
 mcResult_t FSD::FSD_LookFile(void){
-	FILE * pFile=NULL;
 	STH_FSD_message_t* sth_request=NULL;
-	size_t res;
+	mcResult_t ret;
+	uint32_t size=0;
 	string storage = getTbStoragePath();
 	char TAdirpath[storage.length()+1+TEE_UUID_STRING_SIZE+1];
 	char Filepath[storage.length()+1+TEE_UUID_STRING_SIZE+1+2*FILENAMESIZE+1];
@@ -413,40 +490,37 @@ mcResult_t FSD::FSD_LookFile(void){
 					sizeof(Filepath),
 					TAdirpath,
 					sizeof(TAdirpath));
-	pFile = fopen(Filepath, "r");
-	if (pFile==NULL)
+	if (cache.read(Filepath, sth_request->payload, sth_request->payloadLen) >= 0)
 	{
-		LOG_E("%s: Error looking for file 0x%.8x\n",__func__,TEEC_ERROR_ITEM_NOT_FOUND);
-		return TEEC_ERROR_ITEM_NOT_FOUND;
+		return TEEC_SUCCESS;
 	}
-
-	res = fread(sth_request->payload,sizeof(char),sth_request->payloadLen,pFile);
-
-	if (ferror(pFile))
+	ret = FSDBackend::get()->read(Filepath, sth_request->payload, sth_request->payloadLen, &size);
+	if (ret != TEEC_SUCCESS)
 	{
-		LOG_E("%s: Error reading file res is %zu and errno is %s\n",__func__,res,strerror(errno));
-        fclose(pFile);
+		LOG_E("%s: Error looking for file 0x%.8x\n",__func__,TEEC_ERROR_ITEM_NOT_FOUND);
 		return TEEC_ERROR_ITEM_NOT_FOUND;
 	}
 
-    if (res < sth_request->payloadLen)
+    if (size < sth_request->payloadLen)
     {
         //File is shorter than expected
-        if (feof(pFile)) {
-            LOG_I("%s: EOF reached: res is %zu, payloadLen is %d\n",__func__,res, sth_request->payloadLen);
-        }
+        LOG_I("%s: EOF reached: size is %u, payloadLen is %d\n",__func__,size, sth_request->payloadLen);
     }
 
-	fclose(pFile);
+	// Only objects read as a whole can be served from the cache
+	if (size <= sth_request->payloadLen)
+	{
+		cache.fill(Filepath, sth_request->payload, size);
+	}
 
 	return TEEC_SUCCESS;
 }
 
 
 mcResult_t FSD::FSD_ReadFile(void){
-	FILE * pFile=NULL;
 	STH_FSD_message_t* sth_request=NULL;
-	size_t res;
+	mcResult_t ret;
+	uint32_t size=0;
 	string storage = getTbStoragePath();
 	char TAdirpath[storage.length()+1+TEE_UUID_STRING_SIZE+1];
 	char Filepath[storage.length()+1+TEE_UUID_STRING_SIZE+1+2*FILENAMESIZE+1];
@@ -467,49 +541,46 @@ mcResult_t FSD::FSD_ReadFile(void){
 					TAdirpath,
 					sizeof(TAdirpath));
 
-	pFile = fopen(Filepath, "r");
-	if (pFile==NULL)
+	if (cache.read(Filepath, sth_request->payload, sth_request->payloadLen) >= 0)
+	{
+		return TEEC_SUCCESS;
+	}
+	ret = FSDBackend::get()->read(Filepath, sth_request->payload, sth_request->payloadLen, &size);
+	if (ret == TEEC_ERROR_ITEM_NOT_FOUND)
 	{
 		LOG_E("%s: Error looking for file 0x%.8x\n", __func__,TEEC_ERROR_ITEM_NOT_FOUND);
 		return TEEC_ERROR_ITEM_NOT_FOUND;
 	}
-	res = fread(sth_request->payload,sizeof(char),sth_request->payloadLen,pFile);
-
-	if (ferror(pFile))
+	if (ret != TEEC_SUCCESS)
 	{
-		LOG_E("%s: Error reading file res is %zu and errno is %s\n",__func__,res,strerror(errno));
-		fclose(pFile);
 		return TEE_ERROR_CORRUPT_OBJECT;
 	}
 
-    if (res < sth_request->payloadLen)
+    if (size < sth_request->payloadLen)
     {
        //File is shorter than expected
-       if (feof(pFile)) {
-           LOG_I("%s: EOF reached: res is %zu, payloadLen is %d\n",__func__,res, sth_request->payloadLen);
-       }
+       LOG_I("%s: EOF reached: size is %u, payloadLen is %d\n",__func__,size, sth_request->payloadLen);
     }
 
-    fclose(pFile);
+    // Only objects read as a whole can be served from the cache
+    if (size <= sth_request->payloadLen)
+    {
+        cache.fill(Filepath, sth_request->payload, size);
+    }
 
 	return TEEC_SUCCESS;
 }
 
 
 mcResult_t FSD::FSD_WriteFile(void){
-	FILE * pFile=NULL;
-	int fd=0;
 	STH_FSD_message_t* sth_request=NULL;
-	size_t res=0;
 	int stat=0;
 	string storage = getTbStoragePath();
 	char TAdirpath[storage.length()+1+TEE_UUID_STRING_SIZE+1];
 	char Filepath[storage.length()+1+TEE_UUID_STRING_SIZE+1+2*FILENAMESIZE+1];
-	char Filepath_new[storage.length()+TEE_UUID_STRING_SIZE+2*FILENAMESIZE+strlen(NEW_EXT)+1];
 
 	memset(TAdirpath, 0, storage.length()+1+TEE_UUID_STRING_SIZE+1);
 	memset(Filepath, 0, storage.length()+1+TEE_UUID_STRING_SIZE+1+2*FILENAMESIZE+1);
-	memset(Filepath_new, 0, storage.length()+TEE_UUID_STRING_SIZE+2*FILENAMESIZE+strlen(NEW_EXT)+1);
 	sth_request= &dci->sth_request;
 	FSD_CreateTaDirPath(
 					storage,
@@ -531,87 +602,25 @@ mcResult_t FSD::FSD_WriteFile(void){
 					sizeof(Filepath),
 					TAdirpath,
 					sizeof(TAdirpath));
-	strncpy(Filepath_new,Filepath,sizeof(Filepath) - 1);
-	strncat(Filepath_new,NEW_EXT,strlen(NEW_EXT));
-	LOG_I("%s: filename.new   %s\n", __func__, Filepath_new);
 	if(sth_request->flags == TEE_DATA_FLAG_EXCLUSIVE)
 	{
 		LOG_I("%s: opening file in exclusive mode\n",__func__);
-		fd = open(Filepath, O_WRONLY | O_CREAT | O_EXCL, S_IWUSR);
-		if (fd == -1)
+		if (cache.contains(Filepath) || FSDBackend::get()->exists(Filepath))
 		{
-			LOG_E("%s: error creating file: %s \n",__func__,strerror(errno));
+			LOG_E("%s: error creating file: %s \n",__func__,strerror(EEXIST));
 			return TEE_ERROR_CORRUPT_OBJECT;
 		}
-		else
-		{
-			close(fd);
-		}
 	}
-	pFile = fopen(Filepath_new, "w");
-	LOG_I("%s: opening file for writing\n",__func__);
-	if(pFile==NULL)
+	if (!cache.write(Filepath, sth_request->payload, sth_request->payloadLen,
+			objectLocks[FSD_ObjectLockIndex(sth_request)]))
 	{
-		if(remove(Filepath)==-1)
-		{
-			LOG_E("%s: remove failed: %s\n",__func__, strerror(errno));
-		}
-		return TEE_ERROR_STORAGE_NO_SPACE;
-	}
-	res = fwrite(sth_request->payload,sizeof(char),sth_request->payloadLen,pFile);
-
-	if (ferror(pFile))
-	{
-		LOG_E("%s: Error writing file res is %zu and errno is %s\n",__func__,res,strerror(errno));
-		fclose(pFile);
-		if(remove(Filepath)==-1)
-		{
-			LOG_E("%s: remove failed: %s\n",__func__, strerror(errno));
-		}
-		if(remove(Filepath_new)==-1)
-		{
-			LOG_E("%s: remove failed: %s\n",__func__, strerror(errno));
-		}
 		return TEE_ERROR_STORAGE_NO_SPACE;
 	}
-	else
-	{
-		res = fclose(pFile);
-		if ((int32_t) res < 0)
-		{
-			LOG_E("%s: Error closing file res is %zu and errno is %s\n",__func__,res,strerror(errno));
-			if(remove(Filepath)==-1)
-            {
-                LOG_E("%s: remove failed: %s\n",__func__, strerror(errno));
-            }
-			if(remove(Filepath_new)==-1)
-            {
-                LOG_E("%s: remove failed: %s\n",__func__, strerror(errno));
-            }
-			return TEE_ERROR_STORAGE_NO_SPACE;
-		}
-
-		res = rename(Filepath_new,Filepath);
-		if ((int32_t) res < 0)
-		{
-			LOG_E("%s: Error renaming: %s\n",__func__,strerror(errno));
-			if(remove(Filepath)==-1)
-            {
-                LOG_E("%s: remove failed: %s\n",__func__, strerror(errno));
-            }
-			if(remove(Filepath_new)==-1)
-            {
-                LOG_E("%s: remove failed: %s\n",__func__, strerror(errno));
-            }
-			return TEE_ERROR_STORAGE_NO_SPACE;
-		}
-	}
 	return TEEC_SUCCESS;
 }
 
 
 mcResult_t FSD::FSD_DeleteFile(void){
-	FILE * pFile=NULL;
 	mcResult_t ret;
 	size_t res;
 	STH_FSD_message_t* sth_request=NULL;
@@ -635,22 +644,13 @@ mcResult_t FSD::FSD_DeleteFile(void){
 					TAdirpath,
 					sizeof(TAdirpath));
 
-	pFile = fopen(Filepath, "r");
-	if (pFile==NULL)
+	cache.remove(Filepath);
+	if (!FSDBackend::get()->remove(Filepath))
 	{
-		LOG_I("%s: file not found: %s (%s)\n",__func__, Filepath, strerror(errno));
-		ret = TEEC_SUCCESS;
-	}
-	else
-	{
-		fclose(pFile);
-		if(remove(Filepath)==-1)
-		{
-			ret = TEE_ERROR_STORAGE_NO_SPACE;
-		}
+		ret = TEE_ERROR_STORAGE_NO_SPACE;
 	}
 
-	res = rmdir(TAdirpath);
+	res = cache.removeDir(TAdirpath);
 	if (((int32_t) res < 0) && (errno != ENOTEMPTY) && (errno != EEXIST) && (errno != ENOENT))
 	{
 		ret = TEE_ERROR_STORAGE_NO_SPACE;
@@ -675,6 +675,14 @@ mcResult_t FSD::FSD_DeleteFile(void){
 mcResult_t FSD::FSD_DeleteDir(void)
 {
     STH_FSD_message_t *sth_request = &dci->sth_request;
+    string storage = getTbStoragePath();
+    char TAdirpath[storage.length() + 1 + TEE_UUID_STRING_SIZE + 1];
+
+    memset(TAdirpath, 0, sizeof(TAdirpath));
+    FSD_CreateTaDirPath(storage, sth_request, TAdirpath, sizeof(TAdirpath));
+    // All object locks are held: no write of this TA is in flight, and the
+    // flush thread cannot write one of its objects into a new directory
+    cache.removeAll(TAdirpath);
 
     switch (mcRegistryCleanupTA((mcUuid_t *) &sth_request->uuid)) {
     case MC_DRV_OK:
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * FSD storage backends.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "FSDBackend.h"
+#include "FSDPackBackend.h"
+#include "PrivateRegistry.h"
+#include "log.h"
+
+#define NEW_EXT ".new"
+
+static uint32_t backendType = FSD_BACKEND_FILES;
+static FSDBackend *backend = NULL;
+static pthread_once_t backendOnce = PTHREAD_ONCE_INIT;
+
+//------------------------------------------------------------------------------
+static void createBackend(void)
+{
+    if (backendType == FSD_BACKEND_PACK) {
+        FSDPackBackend *pack = new FSDPackBackend();
+        pack->start("McDaemon.FSDpk");
+        backend = pack;
+        LOG_I("FSD: storing objects in pack files");
+    } else {
+        backend = new FSDFileBackend(backendType == FSD_BACKEND_SHARDED);
+    }
+}
+
+//------------------------------------------------------------------------------
+void FSDBackend::setType(
+    uint32_t type
+)
+{
+    backendType = type;
+}
+
+//------------------------------------------------------------------------------
+FSDBackend *FSDBackend::get(
+    void
+)
+{
+    pthread_once(&backendOnce, createBackend);
+    return backend;
+}
+
+//------------------------------------------------------------------------------
+static string dirOf(const string &path)
+{
+    return path.substr(0, path.rfind('/'));
+}
+
+//------------------------------------------------------------------------------
+static bool syncDir(const string &dir)
+{
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        // Nothing left to make durable in a directory deleted meanwhile
+        return errno == ENOENT;
+    }
+    bool synced = (fsync(fd) == 0);
+    if (!synced) {
+        LOG_E("%s: fsync %s failed: %s\n", __func__, dir.c_str(), strerror(errno));
+    }
+    close(fd);
+    return synced;
+}
+
+//------------------------------------------------------------------------------
+static bool readAll(int fd, void *buf, uint32_t len)
+{
+    uint32_t done = 0;
+
+    while (done < len) {
+        ssize_t res = pread(fd, (uint8_t *)buf + done, len - done, done);
+        if (res <= 0) {
+            if (res == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += res;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static bool writeAll(int fd, const void *data, uint32_t len)
+{
+    uint32_t done = 0;
+
+    while (done < len) {
+        ssize_t res = pwrite(fd, (const uint8_t *)data + done, len - done, done);
+        if (res <= 0) {
+            if (res == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += res;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+FSDFileBackend::FSDFileBackend(
+    bool sharded
+) : sharded(sharded), dirtySeq(0)
+{
+}
+
+//------------------------------------------------------------------------------
+mcResult_t FSDFileBackend::read(
+    const string &path,
+    void *buf,
+    uint32_t len,
+    uint32_t *size
+)
+{
+    uint32_t generation = mcRegistryStorageGeneration();
+    struct stat st;
+
+    int fd = fds.acquire(path, size);
+    if (fd == -1) {
+        fd = open(shardPath(path).c_str(), O_RDONLY);
+        if (fd == -1 && sharded && errno == ENOENT) {
+            fd = open(migrate(path).c_str(), O_RDONLY);
+        }
+        if (fd == -1) {
+            return TEEC_ERROR_ITEM_NOT_FOUND;
+        }
+        if (fstat(fd, &st) != 0) {
+            LOG_E("%s: fstat failed: %s\n", __func__, strerror(errno));
+            close(fd);
+            return TEE_ERROR_CORRUPT_OBJECT;
+        }
+        *size = st.st_size;
+    }
+    if (len > *size) {
+        len = *size;
+    }
+    if (!readAll(fd, buf, len)) {
+        LOG_E("%s: Error reading file: %s\n", __func__, strerror(errno));
+        close(fd);
+        return TEE_ERROR_CORRUPT_OBJECT;
+    }
+    fds.release(path, fd, *size, generation);
+    return TEEC_SUCCESS;
+}
+
+//------------------------------------------------------------------------------
+bool FSDFileBackend::exists(
+    const string &path
+)
+{
+    return fds.contains(path) || access(shardPath(path).c_str(), F_OK) == 0 ||
+           (sharded && access(path.c_str(), F_OK) == 0);
+}
+
+//------------------------------------------------------------------------------
+/** Replace an object file, the new content is synced before the rename. */
+bool FSDFileBackend::write(
+    const string &path,
+    const void *data,
+    uint32_t len,
+    bool createTaDir
+)
+{
+    uint32_t generation = mcRegistryStorageGeneration();
+    const string file = shardPath(path);
+    const string newPath = file + NEW_EXT;
+    bool stored = false;
+
+    fds.invalidate(path);
+    int fd = open(newPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1 && errno == ENOENT) {
+        // Deleting another object of the TA removed the empty directory
+        makeDirs(file, createTaDir);
+        fd = open(newPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    }
+    if (fd != -1) {
+        stored = writeAll(fd, data, len) && (fsync(fd) == 0);
+        if (!stored) {
+            LOG_E("%s: Error writing file: %s\n", __func__, strerror(errno));
+        }
+        if (stored && rename(newPath.c_str(), file.c_str()) != 0) {
+            LOG_E("%s: Error renaming: %s\n", __func__, strerror(errno));
+            stored = false;
+        }
+        if (stored) {
+            // The file just written is the object now, keep it for reading
+            fds.release(path, fd, len, generation);
+        } else {
+            close(fd);
+        }
+    }
+    if (!stored) {
+        // The previous content stays the object
+        ::remove(newPath.c_str());
+        return false;
+    }
+    markDirty(dirOf(file));
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/** Make the renames in the directories of a TA durable. */
+bool FSDFileBackend::sync(
+    const string &dir
+)
+{
+    map<string, uint32_t> dirs;
+    bool synced = true;
+
+    dirsMutex.lock();
+    for (map<string, uint32_t>::iterator it = dirtyDirs.lower_bound(dir);
+            it != dirtyDirs.end() && it->first.compare(0, dir.size(), dir) == 0; ++it) {
+        if (it->first.size() == dir.size() || it->first[dir.size()] == '/') {
+            dirs.insert(*it);
+        }
+    }
+    dirsMutex.unlock();
+
+    for (map<string, uint32_t>::iterator it = dirs.begin(); it != dirs.end(); ++it) {
+        synced = syncDir(it->first) && synced;
+    }
+
+    // Directories renamed in again meanwhile stay dirty
+    dirsMutex.lock();
+    for (map<string, uint32_t>::iterator it = dirs.begin(); it != dirs.end(); ++it) {
+        map<string, uint32_t>::iterator dirty = dirtyDirs.find(it->first);
+        if (synced && dirty != dirtyDirs.end() && dirty->second == it->second) {
+            dirtyDirs.erase(dirty);
+        }
+    }
+    dirsMutex.unlock();
+    return synced;
+}
+
+//------------------------------------------------------------------------------
+bool FSDFileBackend::remove(
+    const string &path
+)
+{
+    const string file = shardPath(path);
+    bool removed = true;
+
+    fds.invalidate(path);
+    if (::remove(file.c_str()) == -1 && errno != ENOENT) {
+        LOG_E("%s: remove failed: %s (%s)\n", __func__, file.c_str(), strerror(errno));
+        removed = false;
+    }
+    if (sharded) {
+        if (::remove(path.c_str()) == -1 && errno != ENOENT) {
+            LOG_E("%s: remove failed: %s (%s)\n", __func__, path.c_str(), strerror(errno));
+            removed = false;
+        }
+        // Drop the shard directories once their last object is deleted.
+        // The TA directory is left to the caller, which removes it after
+        // its last object.
+        const string leaf = dirOf(file);
+        if (rmdir(leaf.c_str()) == 0) {
+            rmdir(dirOf(leaf).c_str());
+        }
+    }
+    return removed;
+}
+
+//------------------------------------------------------------------------------
+string FSDFileBackend::shardPath(
+    const string &path
+)
+{
+    if (!sharded) {
+        return path;
+    }
+
+    size_t slash = path.rfind('/');
+    uint32_t hash = 2166136261u;
+    for (size_t i = slash + 1; i < path.size(); i++) {
+        hash = (hash ^ (uint8_t)path[i]) * 16777619u;
+    }
+    char shard[16];
+    snprintf(shard, sizeof(shard), "/%02x/%02x/", hash % FSD_SHARD_FANOUT,
+             (hash / FSD_SHARD_FANOUT) % FSD_SHARD_FANOUT);
+    return path.substr(0, slash) + shard + path.substr(slash + 1);
+}
+
+//------------------------------------------------------------------------------
+/** Move an object of the flat layout into its shard.
+ * @return Where the object is now. */
+string FSDFileBackend::migrate(
+    const string &path
+)
+{
+    const string file = shardPath(path);
+
+    if (access(path.c_str(), F_OK) != 0) {
+        return file;
+    }
+    if (!makeDirs(file, false) || rename(path.c_str(), file.c_str()) != 0) {
+        LOG_W("%s: cannot move %s into its shard: %s\n", __func__, path.c_str(), strerror(errno));
+        return path;
+    }
+    markDirty(dirOf(path));
+    markDirty(dirOf(file));
+    return file;
+}
+
+//------------------------------------------------------------------------------
+/** Create the directories up to an object file. Without createTaDir, only
+ * shard directories below an existing TA directory are created. */
+bool FSDFileBackend::makeDirs(
+    const string &file,
+    bool createTaDir
+)
+{
+    const string leaf = dirOf(file);
+    const string mid = dirOf(leaf);
+    const string ta = dirOf(mid);
+
+    if (!sharded) {
+        return createTaDir && (mkdir(leaf.c_str(), 0700) == 0 || errno == EEXIST);
+    }
+    if (createTaDir && mkdir(ta.c_str(), 0700) != 0 && errno != EEXIST) {
+        return false;
+    }
+    if (mkdir(mid.c_str(), 0700) == 0) {
+        markDirty(ta);
+    } else if (errno != EEXIST) {
+        return false;
+    }
+    if (mkdir(leaf.c_str(), 0700) == 0) {
+        markDirty(mid);
+    } else if (errno != EEXIST) {
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+void FSDFileBackend::markDirty(
+    const string &dir
+)
+{
+    dirsMutex.lock();
+    dirtyDirs[dir] = ++dirtySeq;
+    dirsMutex.unlock();
+}
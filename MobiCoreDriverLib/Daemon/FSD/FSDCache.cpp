@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * FSD object cache.
+ */
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "FSDBackend.h"
+#include "FSDCache.h"
+#include "PrivateRegistry.h"
+#include "log.h"
+
+uint32_t FSDCache::flushMs = 0;
+
+//------------------------------------------------------------------------------
+static string dirOf(const string &path)
+{
+    return path.substr(0, path.rfind('/'));
+}
+
+//------------------------------------------------------------------------------
+FSDCache::FSDCache(
+    void
+) : size(0), generation(mcRegistryStorageGeneration()), coalesced(0)
+{
+}
+
+//------------------------------------------------------------------------------
+void FSDCache::setWriteBack(
+    uint32_t flushMs
+)
+{
+    FSDCache::flushMs = flushMs;
+}
+
+//------------------------------------------------------------------------------
+uint32_t FSDCache::getWriteBack(
+    void
+)
+{
+    return flushMs;
+}
+
+//------------------------------------------------------------------------------
+void FSDCache::run(
+    void
+)
+{
+    struct timespec interval;
+
+    interval.tv_sec = flushMs / 1000;
+    interval.tv_nsec = (flushMs % 1000) * 1000000;
+    LOG_I("FSD: write-back cache, flushing every %u ms", flushMs);
+    while (!shouldTerminate()) {
+        nanosleep(&interval, NULL);
+        flush();
+    }
+}
+
+//------------------------------------------------------------------------------
+int32_t FSDCache::read(
+    const string &path,
+    void *buf,
+    uint32_t len
+)
+{
+    int32_t res = -1;
+
+    cacheMutex.lock();
+    revalidate();
+    EntryList::iterator it = lookup(path);
+    if (it != lru.end()) {
+        res = it->data.size() < len ? it->data.size() : len;
+        if (res > 0) {
+            memcpy(buf, &it->data[0], res);
+        }
+    }
+    cacheMutex.unlock();
+    return res;
+}
+
+//------------------------------------------------------------------------------
+bool FSDCache::contains(
+    const string &path
+)
+{
+    cacheMutex.lock();
+    revalidate();
+    bool found = (lookup(path) != lru.end());
+    cacheMutex.unlock();
+    return found;
+}
+
+//------------------------------------------------------------------------------
+void FSDCache::fill(
+    const string &path,
+    const void *data,
+    uint32_t len
+)
+{
+    if (len > FSD_CACHE_MAX_OBJECT) {
+        return;
+    }
+    cacheMutex.lock();
+    revalidate();
+    if (lookup(path) == lru.end()) {
+        insert(path, data, len, NULL);
+        evict();
+    }
+    cacheMutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+bool FSDCache::write(
+    const string &path,
+    const void *data,
+    uint32_t len,
+    CMutex &lock
+)
+{
+    bool stored = true;
+
+    cacheMutex.lock();
+    revalidate();
+    EntryList::iterator it = lookup(path);
+    if (flushMs == 0 || len > FSD_CACHE_MAX_OBJECT) {
+        // Write-through: the object is on storage before the TA hears back.
+        // FSD orders requests per object, so the I/O can run unlocked.
+        if (it != lru.end()) {
+            erase(it);
+        }
+        cacheMutex.unlock();
+        FSDBackend *backend = FSDBackend::get();
+        stored = backend->write(path, data, len, true) && backend->sync(dirOf(path));
+        if (!stored || len > FSD_CACHE_MAX_OBJECT) {
+            return stored;
+        }
+        cacheMutex.lock();
+        it = lookup(path);
+        if (it != lru.end()) {
+            erase(it);
+        }
+        insert(path, data, len, NULL);
+    } else {
+        // The flush thread never creates a TA directory, and removeDir()
+        // leaves it to dirty objects: make sure it is there from now on
+        if (it == lru.end() || !it->dirty) {
+            mkdir(dirOf(path).c_str(), 0700);
+        }
+        if (it == lru.end()) {
+            insert(path, data, len, &lock);
+        } else {
+            // Several writes before the next flush only cost one
+            if (it->dirty) {
+                coalesced++;
+            }
+            size = size - it->data.size() + len;
+            it->data.assign((const uint8_t *)data, (const uint8_t *)data + len);
+            it->dirty = true;
+            it->lock = &lock;
+        }
+    }
+    evict();
+    cacheMutex.unlock();
+    return stored;
+}
+
+//------------------------------------------------------------------------------
+void FSDCache::remove(
+    const string &path
+)
+{
+    cacheMutex.lock();
+    EntryList::iterator it = lookup(path);
+    if (it != lru.end()) {
+        erase(it);
+    }
+    cacheMutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+int FSDCache::removeDir(
+    const string &dir
+)
+{
+    const string prefix = dir + "/";
+    bool pending = false;
+    int res = -1;
+
+    cacheMutex.lock();
+    for (map<string, EntryList::iterator>::iterator it = index.lower_bound(prefix);
+            it != index.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+        if (it->second->dirty) {
+            pending = true;
+            break;
+        }
+    }
+    if (pending) {
+        errno = ENOTEMPTY;
+    } else {
+        res = rmdir(dir.c_str());
+    }
+    cacheMutex.unlock();
+    return res;
+}
+
+//------------------------------------------------------------------------------
+void FSDCache::removeAll(
+    const string &dir
+)
+{
+    const string prefix = dir + "/";
+
+    cacheMutex.lock();
+    map<string, EntryList::iterator>::iterator it = index.lower_bound(prefix);
+    while (it != index.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+        EntryList::iterator entry = it->second;
+        ++it;
+        erase(entry);
+    }
+    cacheMutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+void FSDCache::flush(
+    void
+)
+{
+    vector<pair<string, CMutex *> > pending;
+    set<string> dirs;
+    uint32_t flushed = 0;
+
+    cacheMutex.lock();
+    for (EntryList::iterator it = lru.begin(); it != lru.end(); ++it) {
+        if (it->dirty) {
+            pending.push_back(make_pair(it->path, it->lock));
+        }
+    }
+    cacheMutex.unlock();
+
+    // FSD requests take the object lock before the cache, so do we. Holding
+    // it, no deletion of the whole TA directory can run in between.
+    for (size_t i = 0; i < pending.size(); i++) {
+        pending[i].second->lock();
+        cacheMutex.lock();
+        // Drops the object if its TA storage was deleted since it was written
+        revalidate();
+        map<string, EntryList::iterator>::iterator it = index.find(pending[i].first);
+        if (it != index.end() && it->second->dirty && flushEntry(*it->second, dirs)) {
+            flushed++;
+        }
+        cacheMutex.unlock();
+        pending[i].second->unlock();
+    }
+
+    for (set<string>::iterator it = dirs.begin(); it != dirs.end(); ++it) {
+        FSDBackend::get()->sync(*it);
+    }
+    if (flushed) {
+        cacheMutex.lock();
+        LOG_I("FSD: flushed %u objects, %u writes coalesced so far", flushed, coalesced);
+        cacheMutex.unlock();
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Drop objects whose TA storage was deleted behind the back of the cache.
+ * The directory may already be back, created by a later write, so it is
+ * told apart by its identity rather than by its existence. */
+void FSDCache::revalidate(
+    void
+)
+{
+    uint32_t current = mcRegistryStorageGeneration();
+    struct stat st;
+
+    if (current == generation) {
+        return;
+    }
+    generation = current;
+    for (EntryList::iterator it = lru.begin(); it != lru.end();) {
+        EntryList::iterator next = it;
+        ++next;
+        if (stat(dirOf(it->path).c_str(), &st) != 0 ||
+                st.st_dev != it->dev || st.st_ino != it->ino) {
+            erase(it);
+        }
+        it = next;
+    }
+}
+
+//------------------------------------------------------------------------------
+FSDCache::EntryList::iterator FSDCache::lookup(
+    const string &path
+)
+{
+    map<string, EntryList::iterator>::iterator it = index.find(path);
+    if (it == index.end()) {
+        return lru.end();
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second;
+}
+
+//------------------------------------------------------------------------------
+void FSDCache::insert(
+    const string &path,
+    const void *data,
+    uint32_t len,
+    CMutex *lock
+)
+{
+    Entry entry;
+    struct stat st;
+
+    entry.path = path;
+    entry.dirty = (lock != NULL);
+    entry.lock = lock;
+    entry.dev = 0;
+    entry.ino = 0;
+    if (stat(dirOf(path).c_str(), &st) == 0) {
+        entry.dev = st.st_dev;
+        entry.ino = st.st_ino;
+    }
+    lru.push_front(entry);
+    lru.front().data.assign((const uint8_t *)data, (const uint8_t *)data + len);
+    index[path] = lru.begin();
+    size += len;
+}
+
+//------------------------------------------------------------------------------
+void FSDCache::erase(
+    EntryList::iterator it
+)
+{
+    size -= it->data.size();
+    index.erase(it->path);
+    lru.erase(it);
+}
+
+//------------------------------------------------------------------------------
+/** Drop the least recently used clean objects. Dirty ones stay until the
+ * flush thread wrote them out under their object lock. */
+void FSDCache::evict(
+    void
+)
+{
+    EntryList::iterator it = lru.end();
+
+    while (size > FSD_CACHE_SIZE && it != lru.begin()) {
+        EntryList::iterator victim = --it;
+        if (!victim->dirty) {
+            ++it;
+            erase(victim);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+bool FSDCache::flushEntry(
+    Entry &entry,
+    set<string> &dirs
+)
+{
+    const uint8_t *data = entry.data.empty() ? NULL : &entry.data[0];
+
+    if (!FSDBackend::get()->write(entry.path, data, entry.data.size(), false)) {
+        return false;
+    }
+    entry.dirty = false;
+    entry.lock = NULL;
+    dirs.insert(dirOf(entry.path));
+    return true;
+}
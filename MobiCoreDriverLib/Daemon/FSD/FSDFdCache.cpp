@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * FSD file descriptor cache.
+ */
+#include <unistd.h>
+
+#include "FSDFdCache.h"
+#include "PrivateRegistry.h"
+
+//------------------------------------------------------------------------------
+FSDFdCache::FSDFdCache(
+    void
+) : generation(mcRegistryStorageGeneration())
+{
+}
+
+//------------------------------------------------------------------------------
+FSDFdCache::~FSDFdCache(
+    void
+)
+{
+    while (!lru.empty()) {
+        erase(lru.begin());
+    }
+}
+
+//------------------------------------------------------------------------------
+int FSDFdCache::acquire(
+    const string &path,
+    uint32_t *size
+)
+{
+    int fd = -1;
+
+    fdMutex.lock();
+    revalidate();
+    map<string, EntryList::iterator>::iterator it = index.find(path);
+    if (it != index.end()) {
+        fd = it->second->fd;
+        *size = it->second->size;
+        lru.erase(it->second);
+        index.erase(it);
+    }
+    fdMutex.unlock();
+    return fd;
+}
+
+//------------------------------------------------------------------------------
+void FSDFdCache::release(
+    const string &path,
+    int fd,
+    uint32_t size,
+    uint32_t generation
+)
+{
+    fdMutex.lock();
+    revalidate();
+    if (generation != this->generation) {
+        // The file may belong to a TA directory deleted meanwhile
+        fdMutex.unlock();
+        close(fd);
+        return;
+    }
+    map<string, EntryList::iterator>::iterator it = index.find(path);
+    if (it != index.end()) {
+        erase(it->second);
+    }
+    Entry entry;
+    entry.path = path;
+    entry.fd = fd;
+    entry.size = size;
+    lru.push_front(entry);
+    index[path] = lru.begin();
+    while (lru.size() > FSD_FD_CACHE_SIZE) {
+        erase(--lru.end());
+    }
+    fdMutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+bool FSDFdCache::contains(
+    const string &path
+)
+{
+    fdMutex.lock();
+    revalidate();
+    bool found = (index.find(path) != index.end());
+    fdMutex.unlock();
+    return found;
+}
+
+//------------------------------------------------------------------------------
+void FSDFdCache::invalidate(
+    const string &path
+)
+{
+    fdMutex.lock();
+    map<string, EntryList::iterator>::iterator it = index.find(path);
+    if (it != index.end()) {
+        erase(it->second);
+    }
+    fdMutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+/** Close all files once the registry deleted TA storage. */
+void FSDFdCache::revalidate(
+    void
+)
+{
+    uint32_t current = mcRegistryStorageGeneration();
+
+    if (current == generation) {
+        return;
+    }
+    generation = current;
+    while (!lru.empty()) {
+        erase(lru.begin());
+    }
+}
+
+//------------------------------------------------------------------------------
+void FSDFdCache::erase(
+    EntryList::iterator it
+)
+{
+    close(it->fd);
+    index.erase(it->path);
+    lru.erase(it);
+}
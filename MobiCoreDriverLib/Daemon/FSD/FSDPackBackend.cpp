@@ -0,0 +1,597 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * Log-structured FSD backend.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+#include "FSDPackBackend.h"
+#include "PrivateRegistry.h"
+#include "log.h"
+
+#define PACK_RECORD_MAGIC   0x52445346 /* "FSDR" */
+#define PACK_RECORD_DELETED 0x0001     /**< Tombstone of a deleted object */
+
+/** Header of a record, followed by the object name and the object. */
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;       /**< Of the rest of the record */
+    uint16_t nameLen;
+    uint16_t flags;
+    uint32_t dataLen;
+} packRecord_t;
+
+//------------------------------------------------------------------------------
+static uint32_t recordSize(uint32_t nameLen, uint32_t dataLen)
+{
+    return sizeof(packRecord_t) + nameLen + dataLen;
+}
+
+//------------------------------------------------------------------------------
+static uint32_t recordCrc(const packRecord_t *header, const void *name, const void *data)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    crc = crc32(crc, (const Bytef *)&header->nameLen, sizeof(*header) - offsetof(packRecord_t, nameLen));
+    crc = crc32(crc, (const Bytef *)name, header->nameLen);
+    if (header->dataLen > 0) {
+        // crc32() restarts when given no buffer
+        crc = crc32(crc, (const Bytef *)data, header->dataLen);
+    }
+    return crc;
+}
+
+//------------------------------------------------------------------------------
+static string segmentPath(const string &dir, uint32_t seq)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "/" PACK_FILE_PREFIX "%08x", seq);
+    return dir + name;
+}
+
+//------------------------------------------------------------------------------
+static bool preadAll(int fd, void *buf, uint32_t len, uint32_t offset)
+{
+    uint8_t *p = (uint8_t *)buf;
+    uint32_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = pread(fd, p + done, len - done, offset + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        done += ret;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static bool pwriteAll(int fd, const void *buf, uint32_t len, uint32_t offset)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    uint32_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = pwrite(fd, p + done, len - done, offset + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        done += ret;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static void splitPath(const string &path, string &dir, string &name)
+{
+    size_t slash = path.rfind('/');
+
+    dir = path.substr(0, slash);
+    name = path.substr(slash + 1);
+}
+
+//------------------------------------------------------------------------------
+FSDPackBackend::FSDPackBackend(
+    void
+) : generation(mcRegistryStorageGeneration()), files(true)
+{
+}
+
+//------------------------------------------------------------------------------
+mcResult_t FSDPackBackend::read(
+    const string &path,
+    void *buf,
+    uint32_t len,
+    uint32_t *size
+)
+{
+    mcResult_t ret = TEEC_SUCCESS;
+    string dir, name;
+
+    splitPath(path, dir, name);
+    Pack *pack = getPack(dir);
+    map<string, Location>::iterator it = pack->index.find(name);
+    if (it == pack->index.end()) {
+        pack->mutex.unlock();
+        return files.read(path, buf, len, size);
+    }
+    Location &loc = it->second;
+    if (!preadAll(pack->segments[loc.seq].fd, buf, loc.len < len ? loc.len : len,
+                  loc.offset + sizeof(packRecord_t) + name.size())) {
+        LOG_E("%s: Error reading %s: %s\n", __func__, path.c_str(), strerror(errno));
+        ret = TEE_ERROR_CORRUPT_OBJECT;
+    }
+    *size = loc.len;
+    pack->mutex.unlock();
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+bool FSDPackBackend::exists(
+    const string &path
+)
+{
+    string dir, name;
+
+    splitPath(path, dir, name);
+    Pack *pack = getPack(dir);
+    bool found = (pack->index.find(name) != pack->index.end());
+    pack->mutex.unlock();
+    return found || files.exists(path);
+}
+
+//------------------------------------------------------------------------------
+bool FSDPackBackend::write(
+    const string &path,
+    const void *data,
+    uint32_t len,
+    bool createTaDir
+)
+{
+    string dir, name;
+
+    splitPath(path, dir, name);
+    Pack *pack = getPack(dir);
+    bool stored = append(pack, name, data, len, false, createTaDir);
+    bool compact = needsCompaction(pack);
+    pack->mutex.unlock();
+    if (compact) {
+        wakeup();
+    }
+    return stored;
+}
+
+//------------------------------------------------------------------------------
+bool FSDPackBackend::sync(
+    const string &dir
+)
+{
+    Pack *pack = getPack(dir);
+    bool synced = syncPack(pack);
+    pack->mutex.unlock();
+    return synced;
+}
+
+//------------------------------------------------------------------------------
+bool FSDPackBackend::remove(
+    const string &path
+)
+{
+    bool removed = true;
+    string dir, name;
+
+    splitPath(path, dir, name);
+    Pack *pack = getPack(dir);
+    if (pack->index.find(name) != pack->index.end()) {
+        removed = append(pack, name, NULL, 0, true, false);
+    }
+    bool compact = needsCompaction(pack);
+    pack->mutex.unlock();
+    if (compact) {
+        wakeup();
+    }
+    return files.remove(path) && removed;
+}
+
+//------------------------------------------------------------------------------
+void FSDPackBackend::run(
+    void
+)
+{
+    while (!shouldTerminate()) {
+        sleep();
+        compact();
+    }
+}
+
+//------------------------------------------------------------------------------
+void FSDPackBackend::compact(
+    void
+)
+{
+    vector<Pack*> all;
+
+    packsMutex.lock();
+    for (map<string, Pack*>::iterator it = packs.begin(); it != packs.end(); ++it) {
+        all.push_back(it->second);
+    }
+    packsMutex.unlock();
+
+    for (size_t i = 0; i < all.size(); i++) {
+        all[i]->mutex.lock();
+        if (all[i]->loaded && needsCompaction(all[i])) {
+            compactPack(all[i]);
+        }
+        all[i]->mutex.unlock();
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Find the pack of a TA directory and lock it, loading it on first use. */
+FSDPackBackend::Pack *FSDPackBackend::getPack(
+    const string &dir
+)
+{
+    struct stat st;
+
+    packsMutex.lock();
+    uint32_t current = mcRegistryStorageGeneration();
+    if (current != generation) {
+        // Forget the packs of TA directories deleted or replaced meanwhile
+        generation = current;
+        for (map<string, Pack*>::iterator it = packs.begin(); it != packs.end(); ++it) {
+            Pack *pack = it->second;
+            pack->mutex.lock();
+            if (pack->loaded && !pack->segments.empty() &&
+                    (stat(pack->dir.c_str(), &st) != 0 || st.st_dev != pack->dev || st.st_ino != pack->ino)) {
+                reset(pack);
+            }
+            pack->mutex.unlock();
+        }
+    }
+    Pack *&pack = packs[dir];
+    if (pack == NULL) {
+        pack = new Pack();
+        pack->dir = dir;
+        pack->loaded = false;
+    }
+    Pack *found = pack;
+    packsMutex.unlock();
+
+    found->mutex.lock();
+    load(found);
+    return found;
+}
+
+//------------------------------------------------------------------------------
+void FSDPackBackend::load(
+    Pack *pack
+)
+{
+    struct stat st;
+    struct dirent *de;
+    set<uint32_t> seqs;
+
+    if (pack->loaded) {
+        return;
+    }
+    pack->loaded = true;
+    pack->active = 0;
+    pack->dirDirty = false;
+    pack->liveBytes = 0;
+    pack->totalBytes = 0;
+    pack->dev = 0;
+    pack->ino = 0;
+
+    DIR *dp = opendir(pack->dir.c_str());
+    if (dp == NULL) {
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        if (strncmp(de->d_name, PACK_FILE_PREFIX, strlen(PACK_FILE_PREFIX)) == 0) {
+            seqs.insert(strtoul(de->d_name + strlen(PACK_FILE_PREFIX), NULL, 16));
+        }
+    }
+    closedir(dp);
+    if (stat(pack->dir.c_str(), &st) == 0) {
+        pack->dev = st.st_dev;
+        pack->ino = st.st_ino;
+    }
+
+    for (set<uint32_t>::iterator it = seqs.begin(); it != seqs.end(); ++it) {
+        Segment segment;
+        segment.fd = open(segmentPath(pack->dir, *it).c_str(), O_RDWR);
+        if (segment.fd == -1 || fstat(segment.fd, &st) != 0) {
+            LOG_E("%s: cannot open pack %08x of %s: %s\n", __func__, *it, pack->dir.c_str(), strerror(errno));
+            if (segment.fd != -1) {
+                close(segment.fd);
+            }
+            continue;
+        }
+        uint32_t valid = replay(pack, *it, segment);
+        segment.size = st.st_size;
+        if (valid < segment.size) {
+            LOG_W("%s: pack %08x of %s is damaged after %u of %u bytes\n", __func__,
+                  *it, pack->dir.c_str(), valid, segment.size);
+            if (*it == *seqs.rbegin() && ftruncate(segment.fd, valid) == 0) {
+                // Drop a record torn by a crash, later records follow it
+                segment.size = valid;
+            }
+        }
+        pack->segments[*it] = segment;
+        pack->totalBytes += segment.size;
+        // Never append behind damage, recovery would stop there
+        pack->active = (valid == segment.size) ? *it : 0;
+    }
+    if (!pack->segments.empty()) {
+        LOG_I("FSD: %s: %zu objects in %zu pack files", pack->dir.c_str(),
+              pack->index.size(), pack->segments.size());
+    }
+}
+
+//------------------------------------------------------------------------------
+void FSDPackBackend::reset(
+    Pack *pack
+)
+{
+    for (map<uint32_t, Segment>::iterator it = pack->segments.begin(); it != pack->segments.end(); ++it) {
+        close(it->second.fd);
+    }
+    pack->segments.clear();
+    pack->index.clear();
+    pack->unsynced.clear();
+    pack->loaded = false;
+}
+
+//------------------------------------------------------------------------------
+/** Apply the records of a pack file to the index.
+ * @return Size of the valid records at the start of the file. */
+uint32_t FSDPackBackend::replay(
+    Pack *pack,
+    uint32_t seq,
+    Segment &segment
+)
+{
+    struct stat st;
+    packRecord_t header;
+    vector<uint8_t> buf;
+    uint32_t offset = 0;
+
+    if (fstat(segment.fd, &st) != 0) {
+        return 0;
+    }
+    while (offset + sizeof(header) <= (uint64_t)st.st_size) {
+        if (!preadAll(segment.fd, &header, sizeof(header), offset) || header.magic != PACK_RECORD_MAGIC) {
+            break;
+        }
+        uint32_t size = recordSize(header.nameLen, header.dataLen);
+        if (header.dataLen > PACK_SEGMENT_SIZE * 16 || offset + (uint64_t)size > (uint64_t)st.st_size) {
+            break;
+        }
+        buf.resize(header.nameLen + header.dataLen + 1);
+        if (!preadAll(segment.fd, &buf[0], header.nameLen + header.dataLen, offset + sizeof(header)) ||
+                recordCrc(&header, &buf[0], &buf[header.nameLen]) != header.crc) {
+            break;
+        }
+
+        const string name((const char *)&buf[0], header.nameLen);
+        map<string, Location>::iterator it = pack->index.find(name);
+        if (it != pack->index.end()) {
+            pack->liveBytes -= recordSize(name.size(), it->second.len);
+            pack->index.erase(it);
+        }
+        if (!(header.flags & PACK_RECORD_DELETED)) {
+            Location loc = { seq, offset, header.dataLen };
+            pack->index[name] = loc;
+            pack->liveBytes += size;
+        }
+        offset += size;
+    }
+    return offset;
+}
+
+//------------------------------------------------------------------------------
+bool FSDPackBackend::append(
+    Pack *pack,
+    const string &name,
+    const void *data,
+    uint32_t len,
+    bool deleted,
+    bool createTaDir
+)
+{
+    struct stat st;
+    packRecord_t header;
+
+    if (pack->active == 0 || pack->segments[pack->active].size >= PACK_SEGMENT_SIZE) {
+        uint32_t seq = pack->segments.empty() ? 1 : pack->segments.rbegin()->first + 1;
+        Segment segment;
+        segment.size = 0;
+        // Deleting another object of the TA may have removed the empty directory
+        if (createTaDir) {
+            mkdir(pack->dir.c_str(), 0700);
+        }
+        segment.fd = open(segmentPath(pack->dir, seq).c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (segment.fd == -1) {
+            LOG_E("%s: cannot create pack %08x of %s: %s\n", __func__, seq, pack->dir.c_str(), strerror(errno));
+            return false;
+        }
+        if (stat(pack->dir.c_str(), &st) == 0) {
+            pack->dev = st.st_dev;
+            pack->ino = st.st_ino;
+        }
+        pack->segments[seq] = segment;
+        pack->active = seq;
+        pack->dirDirty = true;
+    }
+
+    Segment &segment = pack->segments[pack->active];
+    header.magic = PACK_RECORD_MAGIC;
+    header.nameLen = name.size();
+    header.flags = deleted ? PACK_RECORD_DELETED : 0;
+    header.dataLen = len;
+    header.crc = recordCrc(&header, name.data(), data);
+
+    uint32_t size = recordSize(header.nameLen, len);
+    vector<uint8_t> record(size);
+    memcpy(&record[0], &header, sizeof(header));
+    memcpy(&record[sizeof(header)], name.data(), header.nameLen);
+    if (len > 0) {
+        memcpy(&record[sizeof(header) + header.nameLen], data, len);
+    }
+    if (!pwriteAll(segment.fd, &record[0], size, segment.size)) {
+        LOG_E("%s: Error writing pack %08x of %s: %s\n", __func__, pack->active, pack->dir.c_str(), strerror(errno));
+        if (ftruncate(segment.fd, segment.size) != 0) {
+            // Do not append behind a partial record, recovery would stop there
+            pack->active = 0;
+        }
+        return false;
+    }
+
+    map<string, Location>::iterator it = pack->index.find(name);
+    if (it != pack->index.end()) {
+        pack->liveBytes -= recordSize(name.size(), it->second.len);
+        pack->index.erase(it);
+    }
+    if (!deleted) {
+        Location loc = { pack->active, segment.size, len };
+        pack->index[name] = loc;
+        pack->liveBytes += size;
+    }
+    segment.size += size;
+    pack->totalBytes += size;
+    pack->unsynced.insert(pack->active);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+bool FSDPackBackend::syncPack(
+    Pack *pack
+)
+{
+    bool synced = true;
+
+    for (set<uint32_t>::iterator it = pack->unsynced.begin(); it != pack->unsynced.end(); ++it) {
+        if (fdatasync(pack->segments[*it].fd) != 0) {
+            LOG_E("%s: fdatasync failed: %s\n", __func__, strerror(errno));
+            synced = false;
+        }
+    }
+    if (synced) {
+        pack->unsynced.clear();
+    }
+    if (pack->dirDirty) {
+        int fd = open(pack->dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd == -1 || fsync(fd) != 0) {
+            LOG_E("%s: Error syncing %s: %s\n", __func__, pack->dir.c_str(), strerror(errno));
+            synced = false;
+        } else {
+            pack->dirDirty = false;
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    return synced;
+}
+
+//------------------------------------------------------------------------------
+bool FSDPackBackend::needsCompaction(
+    Pack *pack
+)
+{
+    return pack->totalBytes >= PACK_COMPACT_MIN && pack->liveBytes * 2 < pack->totalBytes;
+}
+
+//------------------------------------------------------------------------------
+/** Copy the live records of a TA to new pack files and drop the old ones. */
+bool FSDPackBackend::compactPack(
+    Pack *pack
+)
+{
+    map<uint32_t, Segment> old = pack->segments;
+    uint64_t before = pack->totalBytes;
+    vector<string> names;
+    vector<uint8_t> data;
+
+    for (map<string, Location>::iterator it = pack->index.begin(); it != pack->index.end(); ++it) {
+        names.push_back(it->first);
+    }
+    // Start a new pack file
+    pack->active = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        Location loc = pack->index[names[i]];
+        data.resize(loc.len + 1);
+        if (!preadAll(old[loc.seq].fd, &data[0], loc.len, loc.offset + sizeof(packRecord_t) + names[i].size()) ||
+                !append(pack, names[i], &data[0], loc.len, false, false)) {
+            LOG_E("%s: compacting %s failed\n", __func__, pack->dir.c_str());
+            return false;
+        }
+    }
+    if (!syncPack(pack)) {
+        return false;
+    }
+
+    // Oldest first: a crash must not leave a record behind without the
+    // tombstone which followed it
+    for (map<uint32_t, Segment>::iterator it = old.begin(); it != old.end(); ++it) {
+        close(it->second.fd);
+        unlink(segmentPath(pack->dir, it->first).c_str());
+        pack->segments.erase(it->first);
+        pack->unsynced.erase(it->first);
+        pack->totalBytes -= it->second.size;
+    }
+    if (pack->segments.find(pack->active) == pack->segments.end()) {
+        pack->active = 0;
+    }
+    pack->dirDirty = true;
+    syncPack(pack);
+    LOG_I("FSD: compacted %s from %llu to %llu bytes", pack->dir.c_str(),
+          (unsigned long long)before, (unsigned long long)pack->totalBytes);
+    return true;
+}
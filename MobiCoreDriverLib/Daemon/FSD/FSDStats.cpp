@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * FSD statistics.
+ */
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "FSDStats.h"
+#include "log.h"
+
+#define LOG_I_RELEASE(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+
+static const char *const typeNames[FSD_STATS_TYPES] = {
+    "LOOK", "READ", "WRITE", "DELETE", "DELETE_ALL", "UNKNOWN"
+};
+
+static const char *const phaseNames[FSD_PHASES] = {
+    "wait", "io", "notify"
+};
+
+sem_t FSDStats::dumpRequest;
+
+//------------------------------------------------------------------------------
+FSDStats::FSDStats(
+    void
+)
+{
+    memset(counters, 0, sizeof(counters));
+    sem_init(&dumpRequest, 0, 0);
+}
+
+//------------------------------------------------------------------------------
+void FSDStats::run(
+    void
+)
+{
+    while (!shouldTerminate()) {
+        if (sem_wait(&dumpRequest) == 0) {
+            dump();
+        } else if (errno != EINTR) {
+            LOG_ERRNO("sem_wait");
+            break;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+void FSDStats::requestDump(
+    void
+)
+{
+    sem_post(&dumpRequest);
+}
+
+//------------------------------------------------------------------------------
+void FSDStats::record(
+    uint32_t type,
+    uint32_t bytes,
+    bool failed,
+    const uint64_t phaseUs[FSD_PHASES]
+)
+{
+    if (type >= FSD_STATS_TYPES) {
+        type = FSD_STATS_TYPES - 1;
+    }
+
+    statsMutex.lock();
+    Counters &c = counters[type];
+    c.requests++;
+    if (failed) {
+        c.failed++;
+    } else {
+        c.bytes += bytes;
+    }
+    for (uint32_t i = 0; i < FSD_PHASES; i++) {
+        Histogram &h = c.phases[i];
+        uint32_t bucket = 0;
+        while ((bucket < FSD_STATS_BUCKETS - 1) && (phaseUs[i] >= (1ULL << (bucket + 1)))) {
+            bucket++;
+        }
+        h.buckets[bucket]++;
+        h.count++;
+        h.sumUs += phaseUs[i];
+        if (phaseUs[i] > h.maxUs) {
+            h.maxUs = phaseUs[i];
+        }
+    }
+    statsMutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+/** One line of totals and one per phase for each message type seen, each a
+ * list of key=value pairs for log scrapers. */
+void FSDStats::dump(
+    void
+)
+{
+    char histo[FSD_STATS_BUCKETS * 21];
+
+    statsMutex.lock();
+    for (uint32_t type = 0; type < FSD_STATS_TYPES; type++) {
+        const Counters &c = counters[type];
+        if (c.requests == 0) {
+            continue;
+        }
+        LOG_I_RELEASE("FSD stats: type=%s requests=%llu failed=%llu bytes=%llu",
+                      typeNames[type], (unsigned long long)c.requests,
+                      (unsigned long long)c.failed, (unsigned long long)c.bytes);
+        for (uint32_t i = 0; i < FSD_PHASES; i++) {
+            const Histogram &h = c.phases[i];
+            size_t len = 0;
+            histo[0] = '\0';
+            for (uint32_t b = 0; b < FSD_STATS_BUCKETS; b++) {
+                len += snprintf(histo + len, sizeof(histo) - len, "%s%llu",
+                                b ? "," : "", (unsigned long long)h.buckets[b]);
+            }
+            LOG_I_RELEASE("FSD stats: type=%s phase=%s avg_us=%llu p50_us=%llu p99_us=%llu max_us=%llu histo_log2_us=%s",
+                          typeNames[type], phaseNames[i],
+                          (unsigned long long)(h.sumUs / h.count),
+                          (unsigned long long)percentile(h, 50),
+                          (unsigned long long)percentile(h, 99),
+                          (unsigned long long)h.maxUs, histo);
+        }
+    }
+    statsMutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+uint64_t FSDStats::now(
+    void
+)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//------------------------------------------------------------------------------
+/** @return the upper bound of the bucket holding the percentile, capped by
+ * the largest latency seen. The last bucket is open-ended, it is bounded by
+ * the largest latency only. */
+uint64_t FSDStats::percentile(
+    const Histogram &histogram,
+    uint32_t percent
+)
+{
+    uint64_t rank = (histogram.count * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    for (uint32_t b = 0; b < FSD_STATS_BUCKETS; b++) {
+        seen += histogram.buckets[b];
+        if (seen >= rank) {
+            if (b == FSD_STATS_BUCKETS - 1) {
+                return histogram.maxUs;
+            }
+            uint64_t bound = (1ULL << (b + 1)) - 1;
+            return bound < histogram.maxUs ? bound : histogram.maxUs;
+        }
+    }
+    return histogram.maxUs;
+}
@@ -40,6 +40,9 @@
 #include <string>
 #include <cstdio>
 #include "CThread.h"
+#include "CMutex.h"
+#include "FSDCache.h"
+#include "FSDStats.h"
 #include "MobiCoreDriverApi.h"
 #include "drSecureStorage_Api.h"
 #include <errno.h>
@@ -55,6 +58,7 @@
 #define TEE_UUID_STRING_SIZE  	32
 #define FILENAMESIZE			20
 #define NEW_EXT					".new"
+#define FSD_OBJECT_LOCKS		32	/**< Requests for objects sharing a lock are serialized */
 
 #define TAG_LOG	"FSD"
 
@@ -65,10 +69,10 @@ public:
     /**
      * FSD contructor.
      *
-     * @param tbstoragepath Absolute path to the secure storage
+     * @param channel Index of the STH session this instance serves
      */
     FSD(
-        void
+        uint32_t channel = 0
     );
 
     /**
@@ -84,6 +88,15 @@ public:
      */
     virtual void run(void);
 
+    /**
+     * Set the number of STH sessions served concurrently, before FSD starts.
+     * Requests on different sessions only wait for each other when they
+     * are for the same object.
+     */
+    static void setChannels(uint32_t channels);
+
+    static uint32_t getChannels(void);
+
     /*
     *   FSD_Open
     *
@@ -115,6 +128,11 @@ public:
 private:
     mcSessionHandle_t   	sessionHandle; /**< current session */
     dciMessage_t*       	dci; /**< dci buffer */
+    uint32_t            	channel; /**< index of the STH session */
+    static uint32_t     	channels;
+    static FSDCache     	cache; /**< recently used objects, shared by all channels */
+    static FSDStats     	stats; /**< requests served by all channels */
+    static CMutex       	objectLocks[FSD_OBJECT_LOCKS];
 
 
     /** Private methods*/
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * FSD storage backends.
+ * A backend keeps the objects of trusted storage. Objects are named by the
+ * path they have in the file-per-object layout, "<storage>/<TA>/<object>",
+ * whatever the backend makes of it.
+ */
+#ifndef FSDBACKEND_H_
+#define FSDBACKEND_H_
+
+#include <inttypes.h>
+#include <map>
+#include <string>
+
+#include "CMutex.h"
+#include "FSDFdCache.h"
+
+#include "MobiCoreDriverApi.h"
+#include "tee_type.h"
+#include "tee_error.h"
+
+using namespace std;
+
+/* The following definitions are not exported in the header files of the
+   client API. */
+#define TEE_ERROR_STORAGE_NO_SPACE       ((TEEC_Result)0xFFFF3041)
+#define TEE_ERROR_CORRUPT_OBJECT         ((TEEC_Result)0xF0100001)
+
+#define FSD_BACKEND_FILES   0   /**< One file per object, the default */
+#define FSD_BACKEND_PACK    1   /**< Log-structured pack files per TA */
+#define FSD_BACKEND_SHARDED 2   /**< One file per object, in hashed subdirectories */
+
+#define FSD_SHARD_FANOUT    64  /**< Subdirectories per level of a sharded TA directory */
+
+class FSDBackend
+{
+public:
+    virtual ~FSDBackend(void) {}
+
+    /** Select the backend, before FSD starts. */
+    static void setType(uint32_t type);
+
+    /** The backend selected, created on first use. */
+    static FSDBackend *get(void);
+
+    /** Read the first len bytes of an object.
+     *
+     * @param size set to the size of the whole object.
+     * @return TEEC_SUCCESS, TEEC_ERROR_ITEM_NOT_FOUND or TEE_ERROR_CORRUPT_OBJECT.
+     */
+    virtual mcResult_t read(const string &path, void *buf, uint32_t len, uint32_t *size) = 0;
+
+    virtual bool exists(const string &path) = 0;
+
+    /** Create or replace an object, durable once sync() returns. The
+     * previous content is kept if the write fails.
+     *
+     * @param createTaDir recreate the TA directory if it went missing.
+     * Writes of the flush thread must not, the TA may have been deleted.
+     */
+    virtual bool write(const string &path, const void *data, uint32_t len, bool createTaDir) = 0;
+
+    /** Make the objects written to a TA directory durable. */
+    virtual bool sync(const string &dir) = 0;
+
+    /** @return false if the object exists but could not be deleted. */
+    virtual bool remove(const string &path) = 0;
+};
+
+/** One file per object, each write replaces the file atomically. Files
+ * of recently used objects are kept open and read with pread(). Sharded,
+ * the file of an object goes two levels of subdirectories below the TA
+ * directory, picked by a hash of its name, so that no directory grows
+ * large. Objects found in the flat layout are moved on first read. */
+class FSDFileBackend: public FSDBackend
+{
+public:
+    FSDFileBackend(bool sharded = false);
+
+    mcResult_t read(const string &path, void *buf, uint32_t len, uint32_t *size);
+
+    bool exists(const string &path);
+
+    bool write(const string &path, const void *data, uint32_t len, bool createTaDir);
+
+    bool sync(const string &dir);
+
+    bool remove(const string &path);
+
+private:
+    bool                    sharded;
+    CMutex                  dirsMutex;
+    map<string, uint32_t>   dirtyDirs;  /**< Directories with unsynced renames, by last rename */
+    uint32_t                dirtySeq;
+    FSDFdCache              fds;
+
+    string shardPath(const string &path);
+    string migrate(const string &path);
+    bool makeDirs(const string &file, bool createTaDir);
+    void markDirty(const string &dir);
+};
+
+#endif /* FSDBACKEND_H_ */
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * FSD object cache.
+ * Keeps recently used trusted storage objects in memory. Writes either go
+ * straight to storage (write-through) or are collected and flushed by the
+ * cache thread at a bounded interval (write-back).
+ */
+#ifndef FSDCACHE_H_
+#define FSDCACHE_H_
+
+#include <inttypes.h>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "CThread.h"
+#include "CMutex.h"
+#include "MobiCoreDriverApi.h"
+
+using namespace std;
+
+
+#define FSD_CACHE_SIZE          (1024 * 1024) /**< Bytes of object data kept in memory */
+#define FSD_CACHE_MAX_OBJECT    (64 * 1024)   /**< Larger objects are never cached */
+
+class FSDCache: public CThread
+{
+public:
+    FSDCache(void);
+
+    /** Select the durability policy, before FSD starts.
+     *
+     * @param flushMs maximum time in milliseconds a written object may stay
+     * in memory only, 0 to write every object through to storage.
+     */
+    static void setWriteBack(uint32_t flushMs);
+
+    static uint32_t getWriteBack(void);
+
+    /** Flush thread, only started in write-back mode. */
+    void run(void);
+
+    /** Copy up to len bytes of a cached object.
+     *
+     * @return number of bytes copied, -1 if the object is not cached.
+     */
+    int32_t read(const string &path, void *buf, uint32_t len);
+
+    bool contains(const string &path);
+
+    /** Cache an object just read from storage. */
+    void fill(const string &path, const void *data, uint32_t len);
+
+    /** Write an object, through to storage or into the cache.
+     *
+     * @param lock FSD lock of the object, held by the caller. The flush
+     * thread takes it before writing the object out.
+     * @return false if the object could not be stored.
+     */
+    bool write(const string &path, const void *data, uint32_t len, CMutex &lock);
+
+    /** Forget an object about to be deleted, including pending writes. */
+    void remove(const string &path);
+
+    /** Remove an empty TA directory, unless it has objects not flushed yet.
+     *
+     * @return 0 on success, -1 with errno set as by rmdir() otherwise.
+     */
+    int removeDir(const string &dir);
+
+    /** Forget all objects of a TA directory about to be deleted, including
+     * pending writes. The caller holds all FSD object locks. */
+    void removeAll(const string &dir);
+
+    /** Write all pending objects to storage. */
+    void flush(void);
+
+private:
+    struct Entry {
+        string          path;
+        vector<uint8_t> data;
+        bool            dirty;
+        CMutex          *lock;      /**< FSD lock of the object, set while dirty */
+        dev_t           dev;        /**< Identity of the TA directory, which */
+        ino_t           ino;        /**< a TA cleanup may replace */
+    };
+    typedef list<Entry> EntryList;
+
+    CMutex                              cacheMutex;
+    EntryList                           lru;        /**< Most recently used first */
+    map<string, EntryList::iterator>    index;
+    uint32_t                            size;       /**< Bytes of object data cached */
+    uint32_t                            generation; /**< Registry storage generation seen last */
+    uint32_t                            coalesced;  /**< Writes replaced before being flushed */
+    static uint32_t                     flushMs;
+
+    void revalidate(void);
+    EntryList::iterator lookup(const string &path);
+    void insert(const string &path, const void *data, uint32_t len, CMutex *lock);
+    void erase(EntryList::iterator it);
+    void evict(void);
+    bool flushEntry(Entry &entry, set<string> &dirs);
+};
+
+#endif /* FSDCACHE_H_ */
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * FSD file descriptor cache.
+ * Keeps the files of recently used trusted storage objects open, so that
+ * reading a hot object costs a single pread(). Object files are only ever
+ * replaced by rename or deleted, never modified in place, so an open
+ * descriptor stays valid until its object is written or removed.
+ */
+#ifndef FSDFDCACHE_H_
+#define FSDFDCACHE_H_
+
+#include <inttypes.h>
+#include <list>
+#include <map>
+#include <string>
+
+#include "CMutex.h"
+
+using namespace std;
+
+
+#define FSD_FD_CACHE_SIZE   64  /**< Object files kept open */
+
+class FSDFdCache
+{
+public:
+    FSDFdCache(void);
+
+    ~FSDFdCache(void);
+
+    /** Take the descriptor of an object out of the cache, so that no other
+     * thread closes it while in use.
+     *
+     * @param size set to the size of the object.
+     * @return the descriptor, -1 if the object file is not open.
+     */
+    int acquire(const string &path, uint32_t *size);
+
+    /** Put the descriptor of an object file, acquired or just opened, back
+     * into the cache. It is closed if the cache is full or storage was
+     * deleted meanwhile.
+     *
+     * @param generation registry storage generation read before the
+     * descriptor was acquired or opened.
+     */
+    void release(const string &path, int fd, uint32_t size, uint32_t generation);
+
+    /** @return true if the file of the object is open, and so exists. */
+    bool contains(const string &path);
+
+    /** Close the file of an object about to be replaced or deleted. */
+    void invalidate(const string &path);
+
+private:
+    struct Entry {
+        string      path;
+        int         fd;
+        uint32_t    size;
+    };
+    typedef list<Entry> EntryList;
+
+    CMutex                              fdMutex;
+    EntryList                           lru;        /**< Most recently used first */
+    map<string, EntryList::iterator>    index;
+    uint32_t                            generation; /**< Registry storage generation seen last */
+
+    void revalidate(void);
+    void erase(EntryList::iterator it);
+};
+
+#endif /* FSDFDCACHE_H_ */
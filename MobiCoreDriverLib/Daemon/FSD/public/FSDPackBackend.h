@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * Log-structured FSD backend.
+ * The objects of a TA are appended as records to pack files in the TA
+ * directory, instead of being one file each. An index in memory maps each
+ * object to its latest record. It is rebuilt by replaying the pack files
+ * the first time the TA is used, which also drops records torn by a crash.
+ * A background thread rewrites packs holding mostly dead records.
+ */
+#ifndef FSDPACKBACKEND_H_
+#define FSDPACKBACKEND_H_
+
+#include <sys/types.h>
+#include <map>
+#include <set>
+
+#include "CThread.h"
+#include "CMutex.h"
+#include "FSDBackend.h"
+
+
+#define PACK_FILE_PREFIX    "pack."
+#define PACK_SEGMENT_SIZE   (1024 * 1024) /**< Pack files are rolled over at this size */
+#define PACK_COMPACT_MIN    (256 * 1024)  /**< Packs are left alone below this size */
+
+class FSDPackBackend: public FSDBackend, public CThread
+{
+public:
+    FSDPackBackend(void);
+
+    mcResult_t read(const string &path, void *buf, uint32_t len, uint32_t *size);
+
+    bool exists(const string &path);
+
+    bool write(const string &path, const void *data, uint32_t len, bool createTaDir);
+
+    bool sync(const string &dir);
+
+    bool remove(const string &path);
+
+    /** Compaction thread. */
+    void run(void);
+
+    /** Rewrite the live objects of every TA whose packs are mostly dead. */
+    void compact(void);
+
+private:
+    struct Location {
+        uint32_t seq;       /**< Pack file */
+        uint32_t offset;    /**< Of the record */
+        uint32_t len;       /**< Of the object */
+    };
+    struct Segment {
+        int      fd;
+        uint32_t size;
+    };
+    struct Pack {
+        CMutex                      mutex;
+        string                      dir;
+        dev_t                       dev;        /**< Identity of the directory, which */
+        ino_t                       ino;        /**< a TA cleanup may replace */
+        bool                        loaded;
+        map<string, Location>       index;      /**< Object name to latest record */
+        map<uint32_t, Segment>      segments;   /**< By sequence number */
+        uint32_t                    active;     /**< Pack file appended to, 0 for a new one */
+        set<uint32_t>               unsynced;   /**< Pack files written since the last sync */
+        bool                        dirDirty;   /**< Pack files created since the last sync */
+        uint64_t                    liveBytes;  /**< Size of the indexed records */
+        uint64_t                    totalBytes; /**< Size of all pack files */
+    };
+
+    CMutex                  packsMutex;
+    map<string, Pack*>      packs;      /**< By TA directory, never freed */
+    uint32_t                generation; /**< Registry storage generation seen last */
+    FSDFileBackend          files;      /**< Objects written before packs were used, in either layout */
+
+    Pack *getPack(const string &dir);
+    void load(Pack *pack);
+    void reset(Pack *pack);
+    uint32_t replay(Pack *pack, uint32_t seq, Segment &segment);
+    bool append(Pack *pack, const string &name, const void *data, uint32_t len, bool deleted,
+                bool createTaDir);
+    bool syncPack(Pack *pack);
+    bool compactPack(Pack *pack);
+    bool needsCompaction(Pack *pack);
+};
+
+#endif /* FSDPACKBACKEND_H_ */
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * FSD statistics.
+ * Counts the requests served per message type, with their payload bytes and
+ * latency histograms for the three phases of a request: waiting for it
+ * (mcWaitNotification), executing it (object lock and storage I/O) and
+ * notifying the STH of the response. The statistics are written to the log
+ * whenever the daemon receives SIGUSR1.
+ */
+#ifndef FSDSTATS_H_
+#define FSDSTATS_H_
+
+#include <inttypes.h>
+#include <semaphore.h>
+
+#include "CThread.h"
+#include "CMutex.h"
+
+#define FSD_STATS_TYPES     6   /**< The STH message types, then unknown ones */
+#define FSD_STATS_BUCKETS   16  /**< Latency buckets, by powers of two of microseconds */
+
+#define FSD_PHASE_WAIT      0   /**< Waiting for the request */
+#define FSD_PHASE_IO        1   /**< Executing the request */
+#define FSD_PHASE_NOTIFY    2   /**< Notifying the response */
+#define FSD_PHASES          3
+
+class FSDStats: public CThread
+{
+public:
+    FSDStats(void);
+
+    /** Dump thread, writes the statistics out for each requestDump(). */
+    void run(void);
+
+    /** Ask the dump thread for the statistics. Safe in a signal handler. */
+    static void requestDump(void);
+
+    /** Account for a request served.
+     *
+     * @param type STH message type of the request.
+     * @param bytes payload bytes read or written.
+     * @param failed true if the request did not succeed.
+     * @param phaseUs time spent in each phase, in microseconds.
+     */
+    void record(uint32_t type, uint32_t bytes, bool failed, const uint64_t phaseUs[FSD_PHASES]);
+
+    void dump(void);
+
+    /** @return a monotonic time in microseconds. */
+    static uint64_t now(void);
+
+private:
+    struct Histogram {
+        uint64_t    count;
+        uint64_t    sumUs;
+        uint64_t    maxUs;
+        uint64_t    buckets[FSD_STATS_BUCKETS];
+    };
+    struct Counters {
+        uint64_t    requests;
+        uint64_t    failed;
+        uint64_t    bytes;
+        Histogram   phases[FSD_PHASES];
+    };
+
+    CMutex          statsMutex;
+    Counters        counters[FSD_STATS_TYPES];
+    static sem_t    dumpRequest;
+
+    static uint64_t percentile(const Histogram &histogram, uint32_t percent);
+};
+
+#endif /* FSDSTATS_H_ */
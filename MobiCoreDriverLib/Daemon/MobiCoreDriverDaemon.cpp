@@ -49,9 +49,13 @@
 #include "MobiCoreDevice.h"
 #include "NetlinkServer.h"
 #include "FSD.h"
+#include "FSDBackend.h"
 
 #define DRIVER_TCI_LEN 4096
 
+/** Size of the pieces a TA blob is received in. */
+#define TA_BLOB_CHUNK_SIZE (64 * 1024)
+
 MC_CHECK_VERSION(MCI, 1, 0);
 MC_CHECK_VERSION(SO, 2, 0);
 MC_CHECK_VERSION(MCLF, 2, 0);
@@ -65,13 +69,15 @@ static void checkMobiCoreVersion(MobiCoreDevice *mobiCoreDevice);
 MobiCoreDriverDaemon::MobiCoreDriverDaemon(
     bool enableScheduler,
     bool loadDriver,
-    std::vector<std::string> drivers)
+    std::vector<std::string> drivers,
+    uint32_t doorbellWindow)
 {
     mobiCoreDevice = NULL;
 
     this->enableScheduler = enableScheduler;
     this->loadDriver = loadDriver;
     this->drivers = drivers;
+    this->doorbellWindow = doorbellWindow;
 
     for (int i = 0; i < MAX_SERVERS; i++) {
         servers[i] = NULL;
@@ -99,6 +105,19 @@ MobiCoreDriverDaemon::~MobiCoreDriverDaemon(
 }
 
 
+//------------------------------------------------------------------------------
+void *MobiCoreDriverDaemon::composeImagesThread(void *arg)
+{
+    MobiCoreDriverDaemon *daemon = (MobiCoreDriverDaemon *)arg;
+
+    // Images are replaced atomically, so opens may go on meanwhile
+    daemon->reg_lock.readLock();
+    mcRegistryComposeImages();
+    daemon->reg_lock.unlock();
+    return NULL;
+}
+
+
 //------------------------------------------------------------------------------
 void MobiCoreDriverDaemon::run(
     void
@@ -128,6 +147,12 @@ void MobiCoreDriverDaemon::run(
         return;
     }
 
+    // Coalesce client notifications if requested
+    if (doorbellWindow) {
+        LOG_I_RELEASE("Coalescing notifications within %u us", doorbellWindow);
+        mobiCoreDevice->setDoorbellWindow(doorbellWindow);
+    }
+
     // start device (scheduler)
     mobiCoreDevice->start();
 
@@ -143,6 +168,19 @@ void MobiCoreDriverDaemon::run(
     // Look for tokens and send it to <t-base if any
     installEndorsementToken();
 
+    // Finish registry cleanups interrupted by a restart
+    mcRegistryReapTombstones();
+    mcRegistryRemoveStagedFiles();
+    mcRegistryCollectObjects();
+
+    // Session opens only read TA images, compose the missing ones meanwhile
+    pthread_t imagesThread;
+    if (pthread_create(&imagesThread, NULL, composeImagesThread, this) == 0) {
+        pthread_detach(imagesThread);
+    } else {
+        LOG_ERRNO("pthread_create");
+    }
+
     LOG_I("Creating socket servers");
     // Start listening for incoming TLC connections
     servers[0] = new NetlinkServer(this);
@@ -210,10 +248,8 @@ void MobiCoreDriverDaemon::dropConnection(
         // A connection has been found and has to be closed
         LOG_I("dropConnection(): closing still open device.");
 
-        // Make sure nobody else writes the MCP, e.g. netlink/socket server, cleanup of TAs
-        device->mutex_mcp.lock();
+        // Sessions are closed in the background, other clients keep going
         device->close(connection);
-        device->mutex_mcp.unlock();
     }
 }
 
@@ -355,10 +391,17 @@ bool MobiCoreDriverDaemon::loadDeviceDriver(
 //------------------------------------------------------------------------------
 inline bool getData(Connection *con, void *buf, uint32_t len)
 {
-    uint32_t rlen = con->readData(buf, len);
-    if (rlen < len || (int32_t)rlen < 0) {
-        LOG_E("reading from Client failed");
-        return false;
+    uint8_t *p = (uint8_t *)buf;
+    uint32_t done = 0;
+
+    // Large payloads do not arrive in one piece
+    while (done < len) {
+        ssize_t rlen = con->readData(p + done, len - done);
+        if (rlen <= 0) {
+            LOG_E("reading from Client failed");
+            return false;
+        }
+        done += rlen;
     }
     return true;
 }
@@ -428,7 +471,9 @@ void MobiCoreDriverDaemon::processOpenSession(Connection *connection, bool isGpU
     CHECK_DEVICE(device, connection);
 
     // Get service blob from registry
+    reg_lock.readLock();
     regObject_t *regObj = mcRegistryGetServiceBlob(&cmdOpenSession.uuid, isGpUuid);
+    reg_lock.unlock();
     if (NULL == regObj) {
         /* resort to the Secure World to look for the target UUID */
 
@@ -510,6 +555,23 @@ void MobiCoreDriverDaemon::processOpenSession(Connection *connection, bool isGpU
 
 //------------------------------------------------------------------------------
 mcResult_t MobiCoreDriverDaemon::processLoadCheck(mcSpid_t spid, void *blob, uint32_t size)
+{
+    // Get service blob from registry
+    reg_lock.readLock();
+    regObject_t *regObj = mcRegistryMemGetServiceBlob(spid, blob, size);
+    reg_lock.unlock();
+    if (NULL == regObj) {
+        LOG_E(" mcRegistryMemGetServiceBlob failed");
+        return MC_DRV_ERR_TRUSTLET_NOT_FOUND;
+    }
+    mcResult_t ret = processLoadCheck(regObj);
+    // Free memory occupied by Trustlet data
+    free(regObj);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+mcResult_t MobiCoreDriverDaemon::processLoadCheck(regObject_t *regObj)
 {
 
     // Device required
@@ -520,23 +582,14 @@ mcResult_t MobiCoreDriverDaemon::processLoadCheck(mcSpid_t spid, void *blob, uin
         return MC_DRV_ERR_DAEMON_DEVICE_NOT_OPEN;
     }
 
-    // Get service blob from registry
-    regObject_t *regObj = mcRegistryMemGetServiceBlob(spid, blob, size);
-    if (NULL == regObj) {
-        LOG_E(" mcRegistryMemGetServiceBlob failed");
-        return MC_DRV_ERR_TRUSTLET_NOT_FOUND;
-    }
     if (regObj->len == 0) {
-        free(regObj);
-        LOG_E("mcRegistryMemGetServiceBlob returned registry object with length equal to zero");
+        LOG_E("registry object with length equal to zero");
         return MC_DRV_ERR_TRUSTLET_NOT_FOUND;
     }
     LOG_I(" Sharing Service loaded at %p with Secure World", (addr_t)(regObj->value));
 
     CWsm_ptr pWsm = device->registerWsmL2((addr_t)(regObj->value), regObj->len, 0);
     if (pWsm == NULL) {
-        // Free memory occupied by Trustlet data
-        free(regObj);
         LOG_E("allocating WSM for Trustlet failed");
         return MC_DRV_ERR_DAEMON_KMOD_ERROR;
     }
@@ -558,16 +611,11 @@ mcResult_t MobiCoreDriverDaemon::processLoadCheck(mcSpid_t spid, void *blob, uin
     // This will also destroy the WSM object.
     if (!device->unregisterWsmL2(pWsm)) {
         pWsm = NULL;
-        // Free memory occupied by Trustlet data
-        free(regObj);
         LOG_E("deallocating WSM for Trustlet failed");
         return MC_DRV_ERR_DAEMON_KMOD_ERROR;
     }
     pWsm = NULL;
 
-    // Free memory occupied by Trustlet data
-    free(regObj);
-
     if (ret != MC_DRV_OK) {
         LOG_E("TA could not be loaded.");
         return ret;
@@ -610,7 +658,9 @@ void MobiCoreDriverDaemon::processOpenTrustlet(Connection *connection)
     }
 
     // Get service blob from registry
+    reg_lock.readLock();
     regObject_t *regObj = mcRegistryMemGetServiceBlob(cmdOpenTrustlet.spid, (uint8_t *)payload, len);
+    reg_lock.unlock();
 
     // Free the payload object no matter what
     free(payload);
@@ -695,7 +745,7 @@ void MobiCoreDriverDaemon::processCloseSession(Connection *connection)
 
 
 //------------------------------------------------------------------------------
-void MobiCoreDriverDaemon::processNqConnect(Connection *connection)
+void MobiCoreDriverDaemon::processNqConnect(Connection *connection, uint32_t commandId)
 {
     // Set up the channel for sending SWd notifications to the client
     // MC_DRV_CMD_NQ_CONNECT is only allowed on new connections not
@@ -733,20 +783,68 @@ void MobiCoreDriverDaemon::processNqConnect(Connection *connection)
      * That way an arriving SSIQ/notification-from-driver will not use the nq-socket before the ok message was sent.
      */
     device->mutex_tslist.lock();
-    TrustletSession *ts = device->registerTrustletConnection(
-                              connection,
-                              &cmd);
+    TrustletSession *ts = device->findNqSession(&cmd);
     if (!ts) {
-        LOG_E("registerTrustletConnection() failed!");
+        LOG_E("findNqSession() failed!");
         writeResult(connection, MC_DRV_ERR_UNKNOWN);
         device->mutex_tslist.unlock();
         return;
     }
 
-    writeResult(connection, MC_DRV_OK);
+    if (commandId == MC_DRV_CMD_NQ_CONNECT) {
+        writeResult(connection, MC_DRV_OK);
+        device->attachTrustletConnection(ts, connection);
+        device->mutex_tslist.unlock();
+        return;
+    }
+
+    NotificationRing *ring = NULL;
+    if (commandId == MC_DRV_CMD_NQ_CONNECT_RING) {
+        mcDrvRspNqConnectRing_t rsp;
+        rsp.header.responseId = MC_DRV_OK;
+        rsp.ringLen = 0;
+
+        ring = new NotificationRing();
+        if (!ring->create(NQ_RING_ENTRIES)) {
+            // The connection itself still works
+            LOG_W("No notification ring for session %03x", ts->sessionId);
+            delete ring;
+            ring = NULL;
+        }
+        if (ring != NULL) {
+            int fds[2] = { ring->getMemFd(), ring->getDoorbell() };
+            rsp.ringLen = ring->getLength();
+            connection->writeDataFds(&rsp, sizeof(rsp), fds, 2);
+            ring->closeMemFd();
+        } else {
+            connection->writeData(&rsp, sizeof(rsp));
+        }
+    } else {
+        writeResult(connection, MC_DRV_OK);
+    }
+
+    if (!device->createSharedChannel(ts, connection, ring)) {
+        LOG_E("client of session %03x is gone", ts->sessionId);
+    }
     device->mutex_tslist.unlock();
+}
+
 
-    ts->processQueuedNotifications();
+//------------------------------------------------------------------------------
+void MobiCoreDriverDaemon::processNqAttach(Connection *connection)
+{
+    MC_DRV_CMD_NQ_ATTACH_struct cmd;
+    RECV_PAYLOAD_FROM_CLIENT(connection, &cmd);
+
+    // Device required
+    MobiCoreDevice *device = (MobiCoreDevice *) (connection->connectionData);
+    CHECK_DEVICE(device, connection);
+
+    device->mutex_tslist.lock();
+    mcResult_t ret = device->attachSharedChannel(connection, cmd.sessionId);
+    device->mutex_tslist.unlock();
+
+    writeResult(connection, ret);
 }
 
 
@@ -911,6 +1009,7 @@ mcDrvResponseHeader_t rspRegistry = { responseId :
     mcSoAuthTokenCont_t auth;
     mcSpid_t spid;
     mcUuid_t uuid;
+    bool sized = true;
 
     memset(&spid, 0, sizeof(spid));
 
@@ -919,32 +1018,69 @@ mcDrvResponseHeader_t rspRegistry = { responseId :
         return;
     }
 
+    switch (commandId) {
+    case MC_DRV_REG_READ_AUTH_TOKEN_SIZED:
+        commandId = MC_DRV_REG_READ_AUTH_TOKEN;
+        break;
+    case MC_DRV_REG_READ_ROOT_CONT_SIZED:
+        commandId = MC_DRV_REG_READ_ROOT_CONT;
+        break;
+    case MC_DRV_REG_READ_SP_CONT_SIZED:
+        commandId = MC_DRV_REG_READ_SP_CONT;
+        break;
+    case MC_DRV_REG_READ_TL_CONT_SIZED:
+        commandId = MC_DRV_REG_READ_TL_CONT;
+        break;
+    default:
+        sized = false;
+        break;
+    }
+
     switch (commandId) {
     case MC_DRV_REG_READ_AUTH_TOKEN:
+        reg_lock.readLock();
         rspRegistry.responseId = mcRegistryReadAuthToken(&auth);
+        reg_lock.unlock();
         buf = &auth;
         len = sizeof(mcSoAuthTokenCont_t);
         break;
     case MC_DRV_REG_READ_ROOT_CONT:
+        reg_lock.readLock();
         rspRegistry.responseId = mcRegistryReadRoot(buf, &len);
+        reg_lock.unlock();
         break;
     case MC_DRV_REG_READ_SP_CONT:
         if (!getData(connection, &spid, sizeof(spid)))
             break;
+        reg_lock.readLock();
         rspRegistry.responseId = mcRegistryReadSp(spid, buf, &len);
+        reg_lock.unlock();
         break;
     case MC_DRV_REG_READ_TL_CONT:
         if (!getData(connection, &uuid, sizeof(uuid)))
             break;
         if (!getData(connection, &spid, sizeof(spid)))
             break;
+        reg_lock.readLock();
         rspRegistry.responseId = mcRegistryReadTrustletCon(&uuid, spid, buf, &len);
+        reg_lock.unlock();
         break;
     default:
         break;
     }
     connection->writeData(&rspRegistry, sizeof(rspRegistry));
-    if (rspRegistry.responseId != MC_DRV_ERR_INVALID_OPERATION)
+    if (rspRegistry.responseId == MC_DRV_ERR_INVALID_OPERATION)
+        return;
+    if (!sized) {
+        // Original layout, the client closes the connection after reading
+        connection->writeData(buf, len);
+        return;
+    }
+    // Size first, so that the client can keep using the connection
+    if (rspRegistry.responseId != MC_DRV_OK)
+        len = 0;
+    connection->writeData(&len, sizeof(len));
+    if (len)
         connection->writeData(buf, len);
 }
 
@@ -955,6 +1091,7 @@ mcDrvResponseHeader_t rspRegistry = { responseId :
                                           MC_DRV_ERR_INVALID_OPERATION
                                         };
     uint32_t soSize = 0;
+    uint32_t bufSize;
     void *so;
 
     if (!checkPermission(connection)) {
@@ -968,7 +1105,12 @@ mcDrvResponseHeader_t rspRegistry = { responseId :
         connection->writeData(&rspRegistry, sizeof(rspRegistry));
         return;
     }
-    so = malloc(soSize);
+    // TA blobs go to the registry in chunks, everything else is small
+    bufSize = soSize;
+    if (commandId == MC_DRV_REG_STORE_TA_BLOB && bufSize > TA_BLOB_CHUNK_SIZE) {
+        bufSize = TA_BLOB_CHUNK_SIZE;
+    }
+    so = malloc(bufSize);
     if (so == NULL) {
         LOG_E("Allocation failure");
         rspRegistry.responseId = MC_DRV_ERR_NO_FREE_MEMORY;
@@ -980,7 +1122,9 @@ mcDrvResponseHeader_t rspRegistry = { responseId :
     case MC_DRV_REG_STORE_AUTH_TOKEN: {
         if (!getData(connection, so, soSize))
             break;
+        reg_lock.readLock();
         rspRegistry.responseId = mcRegistryStoreAuthToken(so, soSize);
+        reg_lock.unlock();
         if (rspRegistry.responseId != MC_DRV_OK) {
             LOG_E("mcRegistryStoreAuthToken() failed");
             break;
@@ -996,7 +1140,9 @@ mcDrvResponseHeader_t rspRegistry = { responseId :
     case MC_DRV_REG_WRITE_ROOT_CONT: {
         if (!getData(connection, so, soSize))
             break;
+        reg_lock.readLock();
         rspRegistry.responseId = mcRegistryStoreRoot(so, soSize);
+        reg_lock.unlock();
         if (rspRegistry.responseId != MC_DRV_OK) {
             LOG_E("mcRegistryStoreRoot() failed");
             break;
@@ -1016,7 +1162,9 @@ mcDrvResponseHeader_t rspRegistry = { responseId :
             break;
         if (!getData(connection, so, soSize))
             break;
+        reg_lock.readLock();
         rspRegistry.responseId = mcRegistryStoreSp(spid, so, soSize);
+        reg_lock.unlock();
         break;
     }
     case MC_DRV_REG_WRITE_TL_CONT: {
@@ -1029,42 +1177,63 @@ mcDrvResponseHeader_t rspRegistry = { responseId :
             break;
         if (!getData(connection, so, soSize))
             break;
+        reg_lock.readLock();
         rspRegistry.responseId = mcRegistryStoreTrustletCon(&uuid, spid, so, soSize);
+        reg_lock.unlock();
         break;
     }
     case MC_DRV_REG_WRITE_SO_DATA: {
         if (!getData(connection, so, soSize))
             break;
+        reg_lock.readLock();
         rspRegistry.responseId = mcRegistryStoreData(so, soSize);
+        reg_lock.unlock();
         break;
     }
     case MC_DRV_REG_STORE_TA_BLOB: {
-        uint32_t blobSize = soSize;
+        uint32_t left = soSize;
         mcSpid_t spid;
-        void     *blob;
+        regBlobFile_t blobFile;
         memset(&spid, 0, sizeof(spid));
         if (!getData(connection, &spid, sizeof(spid)))
             break;
-        blob = malloc(blobSize);
-        if (blob == NULL) {
-            LOG_E("Allocation failure");
-            rspRegistry.responseId = MC_DRV_ERR_NO_FREE_MEMORY;
-            break;
+        // Receive the whole blob even on error, the connection stays usable
+        mcResult_t ret = mcRegistryOpenTABlobFile(&blobFile, soSize);
+        while (left > 0) {
+            uint32_t len = left < bufSize ? left : bufSize;
+            if (!getData(connection, so, len))
+                break;
+            if (ret == MC_DRV_OK)
+                ret = mcRegistryWriteTABlobFile(&blobFile, so, len);
+            left -= len;
         }
-        if (!getData(connection, blob, blobSize)) {
-            free(blob);
+        if (left > 0) {
+            mcRegistryCloseTABlobFile(&blobFile);
             break;
         }
-        //LOG_I("processLoadCheck");
-        rspRegistry.responseId = processLoadCheck(spid, blob, blobSize);
-        if (rspRegistry.responseId != MC_DRV_OK){
-            LOG_I("processLoadCheck failed");
-            free(blob);
-            break;
+        if (ret == MC_DRV_OK)
+            ret = mcRegistryMapTABlobFile(&blobFile);
+        if (ret == MC_DRV_OK) {
+            //LOG_I("processLoadCheck");
+            // Built around the received file, the blob is not copied
+            reg_lock.readLock();
+            regObject_t *regObj = mcRegistryMapTABlobFileObject(spid, &blobFile);
+            reg_lock.unlock();
+            if (regObj == NULL)
+                ret = MC_DRV_ERR_TRUSTLET_NOT_FOUND;
+            else
+                ret = processLoadCheck(regObj);
+            if (ret != MC_DRV_OK)
+                LOG_I("processLoadCheck failed");
         }
-        //LOG_I("mcRegistryStoreTABlob");
-        rspRegistry.responseId = mcRegistryStoreTABlob(spid, blob, blobSize);
-        free(blob);
+        if (ret == MC_DRV_OK) {
+            //LOG_I("mcRegistryStoreTABlobFile");
+            reg_lock.writeLock();
+            ret = mcRegistryStoreTABlobFile(spid, &blobFile);
+            reg_lock.unlock();
+        }
+        mcRegistryCloseTABlobFile(&blobFile);
+        rspRegistry.responseId = ret;
         break;
     }
     default:
@@ -1090,10 +1259,14 @@ mcDrvResponseHeader_t rspRegistry = { responseId :
 
     switch (commandId) {
     case MC_DRV_REG_DELETE_AUTH_TOKEN:
+        reg_lock.writeLock();
         rspRegistry.responseId = mcRegistryDeleteAuthToken();
+        reg_lock.unlock();
         break;
     case MC_DRV_REG_DELETE_ROOT_CONT: {
+        reg_lock.writeLock();
         rspRegistry.responseId = mcRegistryCleanupRoot();
+        reg_lock.unlock();
         if (rspRegistry.responseId != MC_DRV_OK) {
             LOG_E("mcRegistryCleanupRoot() failed");
             break;
@@ -1105,20 +1278,26 @@ mcDrvResponseHeader_t rspRegistry = { responseId :
     case MC_DRV_REG_DELETE_SP_CONT:
         if (!getData(connection, &spid, sizeof(spid)))
             break;
+        reg_lock.writeLock();
         rspRegistry.responseId = mcRegistryCleanupSp(spid);
+        reg_lock.unlock();
         break;
     case MC_DRV_REG_DELETE_TL_CONT:
         if (!getData(connection, &uuid, sizeof(uuid)))
             break;
         if (!getData(connection, &spid, sizeof(spid)))
             break;
+        reg_lock.writeLock();
         rspRegistry.responseId = mcRegistryCleanupTrustlet(&uuid, spid);
+        reg_lock.unlock();
         break;
     case MC_DRV_REG_DELETE_TA_OBJS:
         if (!getData(connection, &uuid, sizeof(uuid))) {
             break;
         }
+        reg_lock.writeLock();
         rspRegistry.responseId = mcRegistryCleanupGPTAStorage(&uuid);
+        reg_lock.unlock();
         break;
     default:
         break;
@@ -1127,6 +1306,102 @@ mcDrvResponseHeader_t rspRegistry = { responseId :
     connection->writeData(&rspRegistry, sizeof(rspRegistry));
 }
 
+//------------------------------------------------------------------------------
+void MobiCoreDriverDaemon::processRegistryStoreBatch(Connection *connection)
+{
+mcDrvResponseHeader_t rspRegistry = { responseId :
+                                          MC_DRV_ERR_INVALID_OPERATION
+                                        };
+    mcRegistryBatchItem_t items[MC_REG_BATCH_MAX];
+    uint32_t count = 0;
+    uint32_t i, received = 0;
+
+    if (!checkPermission(connection)) {
+        connection->writeData(&rspRegistry, sizeof(rspRegistry));
+        return;
+    }
+
+    if (!getData(connection, &count, sizeof(count)) ||
+        count == 0 || count > MC_REG_BATCH_MAX) {
+        LOG_E("Invalid registry batch size %u", count);
+        connection->writeData(&rspRegistry, sizeof(rspRegistry));
+        return;
+    }
+
+    // Receive all items before touching the registry
+    for (received = 0; received < count; received++) {
+        mcDrvRegBatchItem_t hdr;
+        mcRegistryBatchItem_t *item = &items[received];
+        if (!getData(connection, &hdr, sizeof(hdr)))
+            break;
+        item->type = hdr.type;
+        item->spid = hdr.spid;
+        item->uuid = hdr.uuid;
+        item->size = hdr.size;
+        item->result = MC_DRV_ERR_INVALID_OPERATION;
+        item->so = malloc(hdr.size ? hdr.size : 1);
+        if (item->so == NULL) {
+            LOG_E("Allocation failure");
+            break;
+        }
+        if (!getData(connection, item->so, hdr.size)) {
+            free(item->so);
+            break;
+        }
+    }
+    if (received < count) {
+        // No per-item status follows, the client drops the connection
+        for (i = 0; i < received; i++) {
+            free(items[i].so);
+        }
+        connection->writeData(&rspRegistry, sizeof(rspRegistry));
+        return;
+    }
+
+    // TA blobs are checked by <t-base before anything is stored
+    rspRegistry.responseId = MC_DRV_OK;
+    for (i = 0; i < count; i++) {
+        if (items[i].type != MC_REG_ITEM_TA_BLOB)
+            continue;
+        rspRegistry.responseId = processLoadCheck(items[i].spid, items[i].so, items[i].size);
+        if (rspRegistry.responseId != MC_DRV_OK) {
+            LOG_I("processLoadCheck failed for batch item %u", i);
+            items[i].result = rspRegistry.responseId;
+            break;
+        }
+    }
+
+    if (rspRegistry.responseId == MC_DRV_OK) {
+        reg_lock.writeLock();
+        rspRegistry.responseId = mcRegistryStoreBatch(items, count);
+        reg_lock.unlock();
+    }
+
+    // Update <t-base with new tokens, as the single commands do
+    for (i = 0; i < count && rspRegistry.responseId == MC_DRV_OK; i++) {
+        if (items[i].type == MC_REG_ITEM_AUTH_TOKEN) {
+            LOG_I("Auth Token stored. Updating <t-base.");
+            if (!loadToken((uint8_t *)items[i].so, sizeof(mcSoAuthTokenCont_t))) {
+                LOG_E("Failed to pass Auth Token to <t-base.");
+            }
+        } else if (items[i].type == MC_REG_ITEM_ROOT_CONT) {
+            LOG_I("Root container stored. Updating <t-base.");
+            if (!loadToken((uint8_t *)items[i].so, sizeof(mcSoRootCont_t))) {
+                LOG_E("Failed to pass Root container to <t-base.");
+            }
+        }
+    }
+
+    // A bare MC_DRV_ERR_INVALID_OPERATION header means no item status follows
+    if (rspRegistry.responseId == MC_DRV_ERR_INVALID_OPERATION)
+        rspRegistry.responseId = MC_DRV_ERR_UNKNOWN;
+    connection->writeData(&rspRegistry, sizeof(rspRegistry));
+    for (i = 0; i < count; i++) {
+        connection->writeData(&items[i].result, sizeof(items[i].result));
+        free(items[i].so);
+    }
+}
+
 //------------------------------------------------------------------------------
 bool MobiCoreDriverDaemon::readCommand(Connection *connection, uint32_t *command_id) {
     /* In case of RTM fault do not try to signal anything to MobiCore
@@ -1163,6 +1438,9 @@ bool MobiCoreDriverDaemon::readCommand(Connection *connection, uint32_t *command
     case MC_DRV_CMD_OPEN_TRUSTED_APP:
     case MC_DRV_CMD_CLOSE_SESSION:
     case MC_DRV_CMD_NQ_CONNECT:
+    case MC_DRV_CMD_NQ_CONNECT_SHARED:
+    case MC_DRV_CMD_NQ_CONNECT_RING:
+    case MC_DRV_CMD_NQ_ATTACH:
     case MC_DRV_CMD_NOTIFY:
     case MC_DRV_CMD_MAP_BULK_BUF:
     case MC_DRV_CMD_UNMAP_BULK_BUF:
@@ -1178,11 +1456,16 @@ bool MobiCoreDriverDaemon::readCommand(Connection *connection, uint32_t *command
     case MC_DRV_REG_READ_ROOT_CONT:
     case MC_DRV_REG_READ_SP_CONT:
     case MC_DRV_REG_READ_TL_CONT:
+    case MC_DRV_REG_READ_AUTH_TOKEN_SIZED:
+    case MC_DRV_REG_READ_ROOT_CONT_SIZED:
+    case MC_DRV_REG_READ_SP_CONT_SIZED:
+    case MC_DRV_REG_READ_TL_CONT_SIZED:
     case MC_DRV_REG_DELETE_AUTH_TOKEN:
     case MC_DRV_REG_DELETE_ROOT_CONT:
     case MC_DRV_REG_DELETE_SP_CONT:
     case MC_DRV_REG_DELETE_TL_CONT:
     case MC_DRV_REG_DELETE_TA_OBJS:
+    case MC_DRV_REG_STORE_BATCH:
         break;
     default:
         LOG_E("Unknown command: %d=0x%x", mcDrvCommandHeader.commandId, mcDrvCommandHeader.commandId);
@@ -1195,7 +1478,6 @@ bool MobiCoreDriverDaemon::readCommand(Connection *connection, uint32_t *command
 
 void MobiCoreDriverDaemon::handleCommand(Connection *connection, uint32_t command_id) {
     // This is the big lock around everything the Daemon does, including socket and MCI access
-    static CMutex reg_mutex;
     static CMutex siq_mutex;
 
     LOG_I("%s()==== %p %d", __FUNCTION__, connection, command_id);
@@ -1238,8 +1520,16 @@ void MobiCoreDriverDaemon::handleCommand(Connection *connection, uint32_t comman
         break;
         //-----------------------------------------
     case MC_DRV_CMD_NQ_CONNECT:
+    case MC_DRV_CMD_NQ_CONNECT_SHARED:
+    case MC_DRV_CMD_NQ_CONNECT_RING:
         siq_mutex.lock();
-        processNqConnect(connection);
+        processNqConnect(connection, command_id);
+        siq_mutex.unlock();
+        break;
+        //-----------------------------------------
+    case MC_DRV_CMD_NQ_ATTACH:
+        siq_mutex.lock();
+        processNqAttach(connection);
         siq_mutex.unlock();
         break;
         //-----------------------------------------
@@ -1271,7 +1561,8 @@ void MobiCoreDriverDaemon::handleCommand(Connection *connection, uint32_t comman
         mobiCoreDevice->mutex_mcp.unlock();
         break;
         //-----------------------------------------
-        /* Registry functionality */
+        /* Registry functionality, locked by reg_lock once the payload is read.
+         * These run on the client thread, not on the server worker. */
         // Write Registry Data
     case MC_DRV_REG_STORE_AUTH_TOKEN:
     case MC_DRV_REG_WRITE_ROOT_CONT:
@@ -1279,9 +1570,7 @@ void MobiCoreDriverDaemon::handleCommand(Connection *connection, uint32_t comman
     case MC_DRV_REG_WRITE_TL_CONT:
     case MC_DRV_REG_WRITE_SO_DATA:
     case MC_DRV_REG_STORE_TA_BLOB:
-        reg_mutex.lock();
         processRegistryWriteData(command_id, connection);
-        reg_mutex.unlock();
         break;
         //-----------------------------------------
         // Read Registry Data
@@ -1289,9 +1578,11 @@ void MobiCoreDriverDaemon::handleCommand(Connection *connection, uint32_t comman
     case MC_DRV_REG_READ_ROOT_CONT:
     case MC_DRV_REG_READ_SP_CONT:
     case MC_DRV_REG_READ_TL_CONT:
-        reg_mutex.lock();
+    case MC_DRV_REG_READ_AUTH_TOKEN_SIZED:
+    case MC_DRV_REG_READ_ROOT_CONT_SIZED:
+    case MC_DRV_REG_READ_SP_CONT_SIZED:
+    case MC_DRV_REG_READ_TL_CONT_SIZED:
         processRegistryReadData(command_id, connection);
-        reg_mutex.unlock();
         break;
         //-----------------------------------------
         // Delete registry data
@@ -1300,9 +1591,12 @@ void MobiCoreDriverDaemon::handleCommand(Connection *connection, uint32_t comman
     case MC_DRV_REG_DELETE_SP_CONT:
     case MC_DRV_REG_DELETE_TL_CONT:
     case MC_DRV_REG_DELETE_TA_OBJS:
-        reg_mutex.lock();
         processRegistryDeleteData(command_id, connection);
-        reg_mutex.unlock();
+        break;
+        //-----------------------------------------
+        // Store registry batch
+    case MC_DRV_REG_STORE_BATCH:
+        processRegistryStoreBatch(connection);
         break;
     }
 
@@ -1325,12 +1619,21 @@ void printUsage(
 #warning "MOBICORE_COMPONENT_BUILD_TAG is not defined!"
 #endif
 
-    fprintf(stderr, "usage: %s [-mdsbhp]\n", args[0]);
+    fprintf(stderr, "usage: %s [-mdsbhpcgozwtlx]\n", args[0]);
     fprintf(stderr, "Start <t-base Daemon\n\n");
     fprintf(stderr, "-h\t\tshow this help\n");
     fprintf(stderr, "-b\t\tfork to background\n");
     fprintf(stderr, "-s\t\tdisable daemon scheduler(default enabled)\n");
     fprintf(stderr, "-r DRIVER\t<t-base driver to load at start-up\n");
+    fprintf(stderr, "-c USECS\tcoalesce client notifications within USECS (default 0, disabled)\n");
+    fprintf(stderr, "-g\t\tshare registry directory syncs between concurrent writers\n");
+    fprintf(stderr, "-o\t\tstore identical TA blobs once, by content\n");
+    fprintf(stderr, "-z\t\tstore TA blobs compressed\n");
+    fprintf(stderr, "-w MSECS\twrite trusted storage back within MSECS (default 0, write-through)\n");
+    fprintf(stderr, "-t CHANNELS\tserve trusted storage on CHANNELS STH sessions (default 1)\n");
+    fprintf(stderr, "-l\t\tstore trusted storage objects in log-structured pack files\n");
+    fprintf(stderr, "-x\t\tspread trusted storage object files over hashed subdirectories\n");
+    fprintf(stderr, "\nSend SIGUSR1 to log trusted storage statistics\n");
 }
 
 //------------------------------------------------------------------------------
@@ -1346,6 +1649,17 @@ void terminateDaemon(
     LOG_E("Signal %d received\n", signum);
 }
 
+//------------------------------------------------------------------------------
+/**
+ * Signal handler asking for the trusted storage statistics
+ */
+void dumpDaemonStats(
+    int signum
+)
+{
+    FSDStats::requestDump();
+}
+
 //------------------------------------------------------------------------------
 /**
  * Main entry of the <t-base Driver Daemon.
@@ -1368,8 +1682,10 @@ int main(int argc, char *args[])
     std::vector<std::string> drivers;
     // By default don't fork
     bool forkDaemon = false;
+    // By default every notification gets its own N-SIQ
+    uint32_t doorbellWindow = 0;
 
-    while ((c = getopt(argc, args, "r:sbhp:")) != -1) {
+    while ((c = getopt(argc, args, "r:sbhp:c:gozw:t:lx")) != -1) {
         switch (c) {
         case 'h': /* Help */
             errFlag++;
@@ -1384,6 +1700,30 @@ int main(int argc, char *args[])
             driverLoadFlag = 1;
             drivers.push_back(optarg);
             break;
+        case 'c': /* Notification coalescing window */
+            doorbellWindow = strtoul(optarg, NULL, 0);
+            break;
+        case 'g': /* Registry group commit */
+            mcRegistrySetGroupCommit(true);
+            break;
+        case 'o': /* Registry content store */
+            mcRegistrySetContentStore(true);
+            break;
+        case 'z': /* Registry compression */
+            mcRegistrySetCompression(true);
+            break;
+        case 'w': /* FSD write-back interval */
+            FSDCache::setWriteBack(strtoul(optarg, NULL, 0));
+            break;
+        case 't': /* FSD channels */
+            FSD::setChannels(strtoul(optarg, NULL, 0));
+            break;
+        case 'l': /* FSD pack files */
+            FSDBackend::setType(FSD_BACKEND_PACK);
+            break;
+        case 'x': /* FSD sharded directories */
+            FSDBackend::setType(FSD_BACKEND_SHARDED);
+            break;
         case ':':       /* -r operand */
             fprintf(stderr, "Option -%c requires an operand\n", optopt);
             errFlag++;
@@ -1422,6 +1762,10 @@ int main(int argc, char *args[])
     action.sa_flags = 0;
     sigaction (SIGINT, &action, NULL);
     sigaction (SIGTERM, &action, NULL);
+    // Restart system calls, the statistics must not disturb the daemon
+    action.sa_handler = dumpDaemonStats;
+    action.sa_flags = SA_RESTART;
+    sigaction (SIGUSR1, &action, NULL);
     signal(SIGPIPE, SIG_IGN);
 
     mobiCoreDriverDaemon = new MobiCoreDriverDaemon(
@@ -1429,7 +1773,9 @@ int main(int argc, char *args[])
         schedulerFlag,
         /* Auto Driver loading */
         driverLoadFlag,
-        drivers);
+        drivers,
+        /* Notification coalescing */
+        doorbellWindow);
 
     // Start the driver
     mobiCoreDriverDaemon->run();
@@ -1511,7 +1857,10 @@ bool MobiCoreDriverDaemon::loadToken(uint8_t *token, uint32_t sosize)
         loadTokenData.len = sosize;
 
         conn = new Connection();
+        // Registry commands do not run on the server worker, serialize MCP here
+        mobiCoreDevice->mutex_mcp.lock();
         uint32_t mcRet = mobiCoreDevice->loadToken(conn, &loadTokenData);
+        mobiCoreDevice->mutex_mcp.unlock();
 
         /* Unregister physical memory from kernel module. This will also destroy
          * the WSM object.
@@ -1553,6 +1902,7 @@ void MobiCoreDriverDaemon::installEndorsementToken(void)
 
     // Search order:  1. authtoken 2. authtoken backup 3. root container
     sosize = 0;
+    reg_lock.readLock();
     mcResult_t ret = mcRegistryReadAuthToken(&authtoken);
     if (ret != MC_DRV_OK) {
         LOG_I("Failed to read AuthToken (ret=%u). Trying AuthToken backup", ret);
@@ -1583,6 +1933,7 @@ void MobiCoreDriverDaemon::installEndorsementToken(void)
         p = (uint8_t *) &authtoken;
         sosize = sizeof(authtoken);
     }
+    reg_lock.unlock();
 
     if (sosize) {
         LOG_I("Found token of size: %u", sosize);
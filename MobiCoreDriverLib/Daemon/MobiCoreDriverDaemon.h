@@ -39,6 +39,8 @@
 #include "Server/public/Server.h"
 
 #include "MobiCoreDevice.h"
+#include "PrivateRegistry.h"
+#include "CRWLock.h"
 #include <string>
 #include <list>
 
@@ -76,13 +78,15 @@ public:
      * @param enableScheduler Enable NQ IRQ scheduler
      * @param loadDriver Load driver at daemon startup
      * @param driverPath Startup driver path
+     * @param doorbellWindow Notification coalescing window in us, 0 to disable
      */
     MobiCoreDriverDaemon(
         bool enableScheduler,
 
         /**< <t-base driver loading at start-up */
         bool loadDriver,
-        std::vector<std::string> drivers
+        std::vector<std::string> drivers,
+        uint32_t doorbellWindow
     );
 
     virtual ~MobiCoreDriverDaemon();
@@ -97,10 +101,23 @@ private:
     /**< Flag to load drivers at startup */
     bool loadDriver;
     std::vector<std::string> drivers;
+    /**< Time client notifications may wait to share an N-SIQ */
+    uint32_t doorbellWindow;
     /**< List of resources for the loaded drivers */
     driverResourcesList_t driverResources;
     /**< List of servers processing connections */
     Server *servers[MAX_SERVERS];
+    /**< Registry lock. Shared by readers and by single file stores, which
+     * replace their file atomically; exclusive for deletes and multi-file
+     * stores */
+    CRWLock reg_lock;
+
+    /**
+     * Compose the TA images missing after start-up, in the background.
+     *
+     * @param arg The daemon.
+     */
+    static void *composeImagesThread(void *arg);
 
     bool checkPermission(Connection *connection);
 
@@ -152,6 +169,14 @@ private:
 
     mcResult_t processLoadCheck(mcSpid_t spid, void *blob, uint32_t size);
 
+    /**
+     * Check Load TA command on a registry object already built
+     *
+     * @param regObj registry object of the TA, left to the caller
+     * @return MC_DRV_OK if the TA can be loaded, otherwise error code
+     */
+    mcResult_t processLoadCheck(regObject_t *regObj);
+
     /**
      * Open Trustlet command
      *
@@ -163,8 +188,17 @@ private:
      * NQ Connect command
      *
      * @param connection Connection object
+     * @param commandId MC_DRV_CMD_NQ_CONNECT, or one of the commands setting up the
+     *        channel for all sessions of the client
+     */
+    void processNqConnect(Connection *connection, uint32_t commandId);
+
+    /**
+     * NQ Attach command
+     *
+     * @param connection Connection object
      */
-    void processNqConnect(Connection *connection);
+    void processNqAttach(Connection *connection);
 
     /**
      * Close Device command
@@ -239,6 +273,13 @@ private:
      */
     void processRegistryDeleteData(uint32_t commandId, Connection *connection);
 
+    /**
+     * Registry batch store command
+     *
+     * @param connection Connection object
+     */
+    void processRegistryStoreBatch(Connection *connection);
+
     /**
      * Load Token
      * This function loads a token (if found) from the registry and uses it as
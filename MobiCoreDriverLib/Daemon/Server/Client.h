@@ -68,7 +68,7 @@ public:
     bool isDead() const {
         return dead_;
     }
-    // Safe because called on command MC_DRV_CMD_NQ_CONNECT so thread is locked waiting for command to be treated
+    // Safe because called on command MC_DRV_CMD_NQ_CONNECT(_SHARED/_RING) so thread is locked waiting for command to be treated
     void detachConnection() {
         connection_ = NULL;
     }
@@ -93,6 +93,11 @@ public:
                 // Notification: send immediately
                 handler_->handleCommand(connection_, command_id_);
                 continue;
+            } else if (MC_DRV_IS_REG_CMD(command_id_)) {
+                // Registry: handled here so that registry readers from
+                // several clients run in parallel, the handler locks
+                handler_->handleCommand(connection_, command_id_);
+                continue;
             }
             // Standard command or needs dropping: queue
             pthread_mutex_lock(&mutex_);
@@ -38,6 +38,8 @@
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdio.h>
+#include <vector>
 
 //#define LOG_VERBOSE
 #include "log.h"
@@ -86,7 +88,7 @@ Server::Server(ConnectionHandler *handler, const char *localAddr):
 //------------------------------------------------------------------------------
 void Server::run() {
     bool isFSDStarted=false;
-    FSD *FileStorageDaemon=NULL;
+    std::vector<FSD*> FileStorageDaemons;
 
     do {
         LOG_I("Server: start listening on socket %s", socketAddr.c_str());
@@ -129,10 +131,14 @@ void Server::run() {
             FD_SET(serverSock, &fdReadSockets);
 
             if (!isFSDStarted) {
-                // Create the <t-base File Storage Daemon
-                FileStorageDaemon = new FSD();
-                // Start File Storage Daemon
-                FileStorageDaemon->start("McDaemon.FSD");
+                // Create the <t-base File Storage Daemon, one per STH channel
+                for (uint32_t i = 0; i < FSD::getChannels(); i++) {
+                    char name[32];
+                    snprintf(name, sizeof(name), i ? "McDaemon.FSD%u" : "McDaemon.FSD", i);
+                    FileStorageDaemons.push_back(new FSD(i));
+                    // Start File Storage Daemon
+                    FileStorageDaemons.back()->start(name);
+                }
 
                 isFSDStarted=true;
             }
@@ -210,9 +216,9 @@ void Server::run() {
     } while (false);
 
     //Wait for File Storage Daemon to exit
-    if (FileStorageDaemon) {
-        FileStorageDaemon->join();
-        delete FileStorageDaemon;
+    for (size_t i = 0; i < FileStorageDaemons.size(); i++) {
+        FileStorageDaemons[i]->join();
+        delete FileStorageDaemons[i];
     }
 
     LOG_ERRNO("Exiting Server, because");
@@ -54,6 +54,9 @@ typedef enum {
     MC_DRV_CMD_GET_MOBICORE_VERSION = 11,
     MC_DRV_CMD_OPEN_TRUSTLET        = 12,
     MC_DRV_CMD_OPEN_TRUSTED_APP     = 13,
+    MC_DRV_CMD_NQ_CONNECT_SHARED    = 14,
+    MC_DRV_CMD_NQ_ATTACH            = 15,
+    MC_DRV_CMD_NQ_CONNECT_RING      = 16,
 
     // Registry Commands
 
@@ -79,9 +82,20 @@ typedef enum {
     MC_DRV_REG_STORE_TA_BLOB        = 0x10000D,
     // Delete all TA objects
     MC_DRV_REG_DELETE_TA_OBJS       = 0x10000E,
+    // Store several containers/TA blobs as one transaction
+    MC_DRV_REG_STORE_BATCH          = 0x10000F,
+    // Read OPS as above, the response header is followed by the data size
+    // so that the connection can be reused (daemon 0.6 and later)
+    MC_DRV_REG_READ_AUTH_TOKEN_SIZED = 0x100010,
+    MC_DRV_REG_READ_ROOT_CONT_SIZED  = 0x100011,
+    MC_DRV_REG_READ_SP_CONT_SIZED    = 0x100012,
+    MC_DRV_REG_READ_TL_CONT_SIZED    = 0x100013,
 
 } mcDrvCmd_t;
 
+/** Registry commands are all allocated from 0x100000 upwards. */
+#define MC_DRV_IS_REG_CMD(id) ((uint32_t)(id) >= MC_DRV_REG_STORE_AUTH_TOKEN)
+
 typedef struct {
     mcDrvCmd_t  commandId;
 } mcDrvCommandHeader_t;
@@ -94,6 +108,17 @@ typedef struct {
 
 #define MC_DEVICE_ID_DEFAULT    0 /**< The default device ID */
 
+//--------------------------------------------------------------
+/** MC_DRV_REG_STORE_BATCH: command header, uint32_t item count, then for
+ * each item this header followed by size bytes of data. The response header
+ * is followed by one mcResult_t per item. */
+typedef struct {
+    uint32_t  type;
+    mcSpid_t  spid;
+    mcUuid_t  uuid;
+    uint32_t  size;
+} mcDrvRegBatchItem_t;
+
 //--------------------------------------------------------------
 struct MC_DRV_CMD_OPEN_DEVICE_struct {
     uint32_t  commandId;
@@ -232,6 +257,36 @@ typedef struct {
     mcDrvResponseHeader_t       header;
 } mcDrvRspNqConnect_t;
 
+//--------------------------------------------------------------
+/** MC_DRV_CMD_NQ_CONNECT_SHARED: same payload as MC_DRV_CMD_NQ_CONNECT, but
+ * the new connection carries the notifications of all sessions of the
+ * client's device connection, tagged with their session ID. */
+typedef MC_DRV_CMD_NQ_CONNECT_struct MC_DRV_CMD_NQ_CONNECT_SHARED_struct;
+
+//--------------------------------------------------------------
+/** MC_DRV_CMD_NQ_CONNECT_RING: like MC_DRV_CMD_NQ_CONNECT_SHARED, but the
+ * notifications go to a shared memory ring. If ringLen is not 0 the response
+ * passes the ring's memfd and eventfd doorbell along, in that order. Otherwise
+ * the daemon could not set up a ring and uses the connection itself. */
+typedef MC_DRV_CMD_NQ_CONNECT_struct MC_DRV_CMD_NQ_CONNECT_RING_struct;
+
+typedef struct {
+    mcDrvResponseHeader_t       header;
+    uint32_t                    ringLen; /**< Bytes to map */
+} mcDrvRspNqConnectRing_t;
+
+//--------------------------------------------------------------
+/** MC_DRV_CMD_NQ_ATTACH: sent on the device connection, forwards the
+ * notifications of a session to the shared notification connection. */
+struct MC_DRV_CMD_NQ_ATTACH_struct {
+    uint32_t  commandId;
+    uint32_t  sessionId;
+};
+
+typedef struct {
+    mcDrvResponseHeader_t       header;
+} mcDrvRspNqAttach_t;
+
 //--------------------------------------------------------------
 struct MC_DRV_CMD_GET_VERSION_struct {
     uint32_t commandId;
@@ -266,6 +321,7 @@ typedef union {
     MC_DRV_CMD_OPEN_TRUSTED_APP_struct  mcDrvCmdOpenTrustedApp;
     MC_DRV_CMD_CLOSE_SESSION_struct     mcDrvCmdCloseSession;
     MC_DRV_CMD_NQ_CONNECT_struct        mcDrvCmdNqConnect;
+    MC_DRV_CMD_NQ_ATTACH_struct         mcDrvCmdNqAttach;
     MC_DRV_CMD_NOTIFY_struct            mcDrvCmdNotify;
     MC_DRV_CMD_MAP_BULK_BUF_struct      mcDrvCmdMapBulkMem;
     MC_DRV_CMD_UNMAP_BULK_BUF_struct    mcDrvCmdUnmapBulkMem;
@@ -280,6 +336,8 @@ typedef union {
     mcDrvRspOpenSession_t        mcDrvRspOpenSession;
     mcDrvRspCloseSession_t       mcDrvRspCloseSession;
     mcDrvRspNqConnect_t          mcDrvRspNqConnect;
+    mcDrvRspNqAttach_t           mcDrvRspNqAttach;
+    mcDrvRspNqConnectRing_t      mcDrvRspNqConnectRing;
     mcDrvRspMapBulkMem_t         mcDrvRspMapBulkMem;
     mcDrvRspUnmapBulkMem_t       mcDrvRspUnmapBulkMem;
     mcDrvRspGetVersion_t         mcDrvRspGetVersion;
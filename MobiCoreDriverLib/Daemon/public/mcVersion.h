@@ -32,7 +32,7 @@
 #define DAEMON_VERSION_H_
 
 #define DAEMON_VERSION_MAJOR 0
-#define DAEMON_VERSION_MINOR 2
+#define DAEMON_VERSION_MINOR 6
 
 #endif /** DAEMON_VERSION_H_ */
 
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * Registry store benchmark.
+ *
+ * Starts a number of threads which each store a trustlet container over and
+ * over through libMcRegistry, and reports the achieved stores per second.
+ * Run it against a daemon started with and without -g to compare per-writer
+ * directory syncs with group commit.
+ *
+ * With -a it instead installs one TA blob and, given the daemon's PID with -p,
+ * reports the daemon's peak resident set size before and after the install.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "MobiCoreRegistry.h"
+
+#define BENCH_SPID      0xFFFFFFF0
+#define BENCH_UUID_BASE 0xB0
+
+static uint32_t benchStores = 100;
+static uint32_t benchSize = 4096;
+static uint32_t benchFailures = 0;
+static pthread_mutex_t benchMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//------------------------------------------------------------------------------
+static void benchUuid(uint32_t id, mcUuid_t *uuid)
+{
+    memset(uuid, 0, sizeof(*uuid));
+    uuid->value[0] = BENCH_UUID_BASE;
+    uuid->value[sizeof(uuid->value) - 1] = (uint8_t)id;
+}
+
+//------------------------------------------------------------------------------
+static void *benchWriter(void *arg)
+{
+    uint32_t id = (uint32_t)(uintptr_t)arg;
+    uint32_t failures = 0;
+    mcUuid_t uuid;
+    uint8_t *buf = (uint8_t *)malloc(benchSize);
+
+    if (buf == NULL) {
+        failures = benchStores;
+    } else {
+        memset(buf, (int)id, benchSize);
+        benchUuid(id, &uuid);
+        for (uint32_t i = 0; i < benchStores; i++) {
+            buf[0] = (uint8_t)i;
+            if (mcRegistryStoreTrustletCon(&uuid, BENCH_SPID, buf, benchSize) != MC_DRV_OK) {
+                failures++;
+            }
+        }
+        free(buf);
+    }
+
+    pthread_mutex_lock(&benchMutex);
+    benchFailures += failures;
+    pthread_mutex_unlock(&benchMutex);
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+/** Prints the peak and current resident set size of a process. */
+static void printRss(const char *when, const char *pid)
+{
+    char path[64];
+    char line[128];
+
+    if (pid == NULL) {
+        return;
+    }
+    snprintf(path, sizeof(path), "/proc/%s/status", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "VmHWM:", 6) == 0 || strncmp(line, "VmRSS:", 6) == 0) {
+            printf("daemon %s %s", when, line);
+        }
+    }
+    fclose(f);
+}
+
+//------------------------------------------------------------------------------
+static int installTA(const char *file, mcSpid_t spid, const char *pid)
+{
+    struct stat sb;
+
+    int fd = open(file, O_RDONLY);
+    if (fd == -1 || fstat(fd, &sb) != 0 || sb.st_size == 0) {
+        fprintf(stderr, "cannot read %s\n", file);
+        if (fd != -1) {
+            close(fd);
+        }
+        return 1;
+    }
+    void *blob = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (blob == MAP_FAILED) {
+        fprintf(stderr, "cannot map %s\n", file);
+        return 1;
+    }
+
+    printRss("before", pid);
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    mcResult_t ret = mcRegistryStoreTABlob(spid, blob, sb.st_size);
+    gettimeofday(&end, NULL);
+    printRss("after", pid);
+    munmap(blob, sb.st_size);
+
+    double secs = (end.tv_sec - start.tv_sec) +
+                  (end.tv_usec - start.tv_usec) / 1000000.0;
+    printf("TA blob of %lu bytes installed in %.3f s: result %u\n",
+           (unsigned long)sb.st_size, secs, ret);
+    return ret == MC_DRV_OK ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+static void printUsage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-t THREADS] [-n STORES] [-s SIZE]\n", name);
+    fprintf(stderr, "       %s -a TABLOB [-i SPID] [-p DAEMONPID]\n", name);
+    fprintf(stderr, "-t THREADS\tconcurrent writers (default 4)\n");
+    fprintf(stderr, "-n STORES\tstores per writer (default 100)\n");
+    fprintf(stderr, "-s SIZE\t\tcontainer size in bytes (default 4096)\n");
+    fprintf(stderr, "-a TABLOB\tinstall a TA blob instead\n");
+    fprintf(stderr, "-i SPID\t\tSPID of the TA blob (default system)\n");
+    fprintf(stderr, "-p DAEMONPID\treport the daemon's resident set size\n");
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    uint32_t threads = 4;
+    const char *taFile = NULL;
+    const char *daemonPid = NULL;
+    mcSpid_t taSpid = MC_SPID_SYSTEM;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:n:s:a:i:p:h")) != -1) {
+        switch (c) {
+        case 't':
+            threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            benchStores = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            benchSize = strtoul(optarg, NULL, 0);
+            break;
+        case 'a':
+            taFile = optarg;
+            break;
+        case 'i':
+            taSpid = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            daemonPid = optarg;
+            break;
+        default:
+            printUsage(argv[0]);
+            return 2;
+        }
+    }
+    if (taFile != NULL) {
+        return installTA(taFile, taSpid, daemonPid);
+    }
+    if (threads == 0 || threads > 256 || benchSize == 0) {
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    pthread_t *tids = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    if (tids == NULL) {
+        return 1;
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    uint32_t started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, benchWriter,
+                           (void *)(uintptr_t)started) != 0) {
+            fprintf(stderr, "cannot start writer %u\n", started);
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    gettimeofday(&end, NULL);
+
+    double secs = (end.tv_sec - start.tv_sec) +
+                  (end.tv_usec - start.tv_usec) / 1000000.0;
+    uint32_t total = started * benchStores;
+    printf("%u writers, %u stores of %u bytes in %.3f s: %.1f stores/s, %u failed\n",
+           started, total, benchSize, secs,
+           secs > 0 ? (total - benchFailures) / secs : 0.0, benchFailures);
+
+    for (uint32_t i = 0; i < started; i++) {
+        mcUuid_t uuid;
+        benchUuid(i, &uuid);
+        mcRegistryCleanupTrustlet(&uuid, BENCH_SPID);
+    }
+    free(tids);
+    return benchFailures == 0 ? 0 : 1;
+}
@@ -45,9 +45,18 @@
 #include <cstring>
 #include <cstddef>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <map>
+#include <set>
+#include <vector>
+#include <zlib.h>
 
 #include "mcLoadFormat.h"
 #include "mcSpid.h"
@@ -78,9 +87,49 @@
 #define TL_BIN_FILE_EXT ".tlbin"
 #define GP_TA_BIN_FILE_EXT ".tabin"
 #define GP_TA_SPID_FILE_EXT ".spid"
+#define GP_TA_IMG_FILE_EXT ".taimg"
+#define STAGED_FILE_EXT ".tmp"
+#define TOMBSTONE_PATH MC_REGISTRY_DATA_PATH "/tombstones"
+#define TOMBSTONE_NICE 19   /**< CPU priority of the reaper, the lowest */
+#define TOMBSTONE_IOPRIO ((2 << 13) | 7) /**< I/O priority of the reaper, lowest best-effort */
+#define OBJECTS_PATH MC_REGISTRY_DATA_PATH "/objects"
+
+/** Magic of precomposed TA image files ("TIM2"). */
+#define REG_IMAGE_MAGIC 0x324D4954
+/** Magic of compressed TA binaries ("TAZ1"). */
+#define REG_ZBIN_MAGIC 0x315A4154
+/** Buffer size for streaming (de)compression. */
+#define REG_ZBIN_CHUNK (16 * 1024)
+/** Largest uncompressed size accepted from the header of a compressed TA. */
+#define REG_ZBIN_MAX_SIZE (64 * 1024 * 1024)
 
 using namespace std;
 
+/** Location of a service file as resolved against both registries.
+ * Entries with present == false cache a miss, so that repeated lookups of
+ * an absent service do not hit the file system while the registry
+ * directories are unchanged. */
+typedef struct {
+    bool present;   /**< File exists at path. */
+    string path;    /**< Resolved path (RO registry takes precedence). */
+    off_t size;     /**< File size at the time it was indexed. */
+    time_t mtime;   /**< Modification time at the time it was indexed. */
+    mcSpid_t spid;  /**< Cached content of .spid files, 0 otherwise. */
+} regIndexEntry_t;
+
+/** Registry index: file name (UUID + extension) -> resolved location.
+ * Filled lazily on lookup and kept up to date by the store and cleanup
+ * functions of this file. Cached misses are dropped when a registry
+ * directory changes, so that files copied into the registry behind the
+ * daemon's back are found. */
+static map<string, regIndexEntry_t> regIndex;
+static pthread_mutex_t regIndexMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Seconds a cached miss is trusted before the directories are checked. */
+#define REG_INDEX_MISS_CHECK 1
+static time_t regIndexDirsMtime[2]; /**< Directory mtimes at the last check */
+static time_t regIndexDirsChecked;  /**< Time of the last check */
+
 //------------------------------------------------------------------------------
 static string byteArrayToString(const void *bytes, size_t elems)
 {
@@ -111,6 +160,228 @@ static bool doesDirExist(const char *path)
     return false;
 }
 
+//------------------------------------------------------------------------------
+static void regIndexFill(regIndexEntry_t &entry, const string &path)
+{
+    struct stat ss;
+
+    entry.present = false;
+    entry.path = path;
+    entry.size = 0;
+    entry.mtime = 0;
+    entry.spid = 0;
+    if (stat(path.c_str(), &ss) != 0) {
+        return;
+    }
+    entry.present = true;
+    entry.size = ss.st_size;
+    entry.mtime = ss.st_mtime;
+    if (path.compare(path.size() - strlen(GP_TA_SPID_FILE_EXT), string::npos, GP_TA_SPID_FILE_EXT) == 0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd != -1) {
+            if (read(fd, &entry.spid, sizeof(mcSpid_t)) != sizeof(mcSpid_t)) {
+                entry.spid = 0;
+            }
+            close(fd);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+static void regIndexResolve(const string &name, regIndexEntry_t &entry)
+{
+    regIndexFill(entry, MC_REGISTRY_SYSTEM_PATH "/" + name);
+    if (!entry.present) {
+        regIndexFill(entry, MC_REGISTRY_DATA_PATH "/" + name);
+    }
+    regIndex[name] = entry;
+}
+
+//------------------------------------------------------------------------------
+/** Drops the cached misses if a file may have been added to one of the
+ * registry directories since the last check. Call with regIndexMutex held. */
+static void regIndexCheckMisses(void)
+{
+    const char *dirs[2] = { MC_REGISTRY_SYSTEM_PATH, MC_REGISTRY_DATA_PATH };
+    time_t now = time(NULL);
+    bool changed = false;
+    struct stat ss;
+
+    if (now >= regIndexDirsChecked && now - regIndexDirsChecked < REG_INDEX_MISS_CHECK) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        time_t mtime = (stat(dirs[i], &ss) == 0) ? ss.st_mtime : 0;
+        // A change within the second of the last check keeps the mtime
+        if (mtime != regIndexDirsMtime[i] || mtime >= regIndexDirsChecked) {
+            changed = true;
+        }
+        regIndexDirsMtime[i] = mtime;
+    }
+    regIndexDirsChecked = now;
+    if (!changed) {
+        return;
+    }
+    for (map<string, regIndexEntry_t>::iterator it = regIndex.begin(); it != regIndex.end();) {
+        if (!it->second.present) {
+            regIndex.erase(it++);
+        } else {
+            it++;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Looks up a service file in the index, resolving and caching it on a miss.
+ * @param name File name (UUID + extension).
+ * @param[out] entry Copy of the index entry.
+ */
+static void regIndexLookup(const string &name, regIndexEntry_t &entry)
+{
+    pthread_mutex_lock(&regIndexMutex);
+    map<string, regIndexEntry_t>::iterator it = regIndex.find(name);
+    if (it != regIndex.end() && !it->second.present) {
+        regIndexCheckMisses();
+        it = regIndex.find(name);
+    }
+    if (it != regIndex.end()) {
+        entry = it->second;
+        pthread_mutex_unlock(&regIndexMutex);
+        return;
+    }
+    regIndexResolve(name, entry);
+    pthread_mutex_unlock(&regIndexMutex);
+}
+
+//------------------------------------------------------------------------------
+/** Re-indexes a file of the writable registry after it has been stored. */
+static void regIndexUpdate(const string &name)
+{
+    regIndexEntry_t entry;
+
+    pthread_mutex_lock(&regIndexMutex);
+    regIndexResolve(name, entry);
+    pthread_mutex_unlock(&regIndexMutex);
+}
+
+//------------------------------------------------------------------------------
+/** Drops all index entries of a UUID, they are resolved again on next lookup. */
+static void regIndexForget(const string &uuid)
+{
+    pthread_mutex_lock(&regIndexMutex);
+    map<string, regIndexEntry_t>::iterator it = regIndex.lower_bound(uuid);
+    while (it != regIndex.end() && it->first.compare(0, uuid.size(), uuid) == 0) {
+        regIndex.erase(it++);
+    }
+    pthread_mutex_unlock(&regIndexMutex);
+}
+
+/** Ownership index: SPID -> GP TAs stored for it in the writable registry,
+ * by the UUID their .tabin and .spid files are named after. Built with one
+ * scan of the .spid files on first use, then kept up to date by the store
+ * and cleanup functions, so that cleanups only touch the files concerned. */
+static map<mcSpid_t, set<string> > regOwners;
+static map<string, mcSpid_t> regOwnerOf;
+static bool regOwnersLoaded = false;
+static pthread_mutex_t regOwnersMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//------------------------------------------------------------------------------
+static mcSpid_t readSpidFile(const string &path)
+{
+    mcSpid_t spid = 0;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd != -1) {
+        if (read(fd, &spid, sizeof(mcSpid_t)) != sizeof(mcSpid_t)) {
+            spid = 0;
+        }
+        close(fd);
+    }
+    return spid;
+}
+
+//------------------------------------------------------------------------------
+static void regOwnersSet(const string &uuid, mcSpid_t spid)
+{
+    map<string, mcSpid_t>::iterator it = regOwnerOf.find(uuid);
+    if (it != regOwnerOf.end()) {
+        regOwners[it->second].erase(uuid);
+        if (regOwners[it->second].empty()) {
+            regOwners.erase(it->second);
+        }
+        regOwnerOf.erase(it);
+    }
+    if (spid != 0) {
+        regOwners[spid].insert(uuid);
+        regOwnerOf[uuid] = spid;
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Builds the ownership index. Call with regOwnersMutex held. */
+static void regOwnersLoad(void)
+{
+    const string ext = GP_TA_SPID_FILE_EXT;
+    struct dirent *de;
+
+    if (regOwnersLoaded) {
+        return;
+    }
+    DIR *dp = opendir(MC_REGISTRY_DATA_PATH);
+    if (dp == NULL) {
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        string name = de->d_name;
+        if (name.size() <= ext.size() ||
+                name.compare(name.size() - ext.size(), string::npos, ext) != 0) {
+            continue;
+        }
+        regOwnersSet(name.substr(0, name.size() - ext.size()),
+                     readSpidFile(MC_REGISTRY_DATA_PATH "/" + name));
+    }
+    closedir(dp);
+    regOwnersLoaded = true;
+}
+
+//------------------------------------------------------------------------------
+/** Records the current owner of a GP TA after its files changed.
+ * @return SPID the TA was owned by before, 0 if none. */
+static mcSpid_t regOwnersUpdate(const string &uuid)
+{
+    mcSpid_t old = 0;
+
+    pthread_mutex_lock(&regOwnersMutex);
+    if (regOwnersLoaded) {
+        map<string, mcSpid_t>::iterator it = regOwnerOf.find(uuid);
+        if (it != regOwnerOf.end()) {
+            old = it->second;
+        }
+        regOwnersSet(uuid, readSpidFile(MC_REGISTRY_DATA_PATH "/" + uuid + GP_TA_SPID_FILE_EXT));
+    }
+    pthread_mutex_unlock(&regOwnersMutex);
+    return old;
+}
+
+//------------------------------------------------------------------------------
+/** Lists the GP TAs owned by an SP, or all owned GP TAs if spid is 0. */
+static void regOwnersList(mcSpid_t spid, vector<string> &uuids)
+{
+    pthread_mutex_lock(&regOwnersMutex);
+    regOwnersLoad();
+    if (spid != 0) {
+        map<mcSpid_t, set<string> >::iterator it = regOwners.find(spid);
+        if (it != regOwners.end()) {
+            uuids.assign(it->second.begin(), it->second.end());
+        }
+    } else {
+        for (map<string, mcSpid_t>::iterator it = regOwnerOf.begin(); it != regOwnerOf.end(); it++) {
+            uuids.push_back(it->first);
+        }
+    }
+    pthread_mutex_unlock(&regOwnersMutex);
+}
+
 //------------------------------------------------------------------------------
 string getTbStoragePath()
 {
@@ -182,52 +453,711 @@ static string getTlDataFilePath(const mcUuid_t *uuid, mcPid_t pid)
 //------------------------------------------------------------------------------
 static string getTlBinFilePath(const mcUuid_t *uuid, int registry)
 {
-    string path_ro_registry = MC_REGISTRY_SYSTEM_PATH"/" + byteArrayToString(uuid, sizeof(*uuid)) + TL_BIN_FILE_EXT;
-    string path_rw_registry = MC_REGISTRY_DATA_PATH"/" + byteArrayToString(uuid, sizeof(*uuid)) + TL_BIN_FILE_EXT;
+    string name = byteArrayToString(uuid, sizeof(*uuid)) + TL_BIN_FILE_EXT;
 
     if (registry == MC_REGISTRY_ALL) {
-        struct stat tmp;
-        if (stat(path_ro_registry.c_str(), &tmp) == 0) {
-            return path_ro_registry;
+        regIndexEntry_t entry;
+        regIndexLookup(name, entry);
+        if (entry.present) {
+            return entry.path;
         }
     }
-    return path_rw_registry;
+    return MC_REGISTRY_DATA_PATH "/" + name;
 }
 
 //------------------------------------------------------------------------------
 static string getTABinFilePath(const mcUuid_t *uuid, int registry)
 {
-    string path_ro_registry = MC_REGISTRY_SYSTEM_PATH"/" + byteArrayToString(uuid, sizeof(*uuid)) + GP_TA_BIN_FILE_EXT;
-    string path_rw_registry = MC_REGISTRY_DATA_PATH"/" + byteArrayToString(uuid, sizeof(*uuid)) + GP_TA_BIN_FILE_EXT;
+    string name = byteArrayToString(uuid, sizeof(*uuid)) + GP_TA_BIN_FILE_EXT;
 
     if (registry == MC_REGISTRY_ALL) {
-        struct stat tmp;
-        if (stat(path_ro_registry.c_str(), &tmp) == 0) {
-            return path_ro_registry;
+        regIndexEntry_t entry;
+        regIndexLookup(name, entry);
+        if (entry.present) {
+            return entry.path;
         }
     }
-    return path_rw_registry;
+    return MC_REGISTRY_DATA_PATH "/" + name;
 }
 
 //------------------------------------------------------------------------------
 static string getTASpidFilePath(const mcUuid_t *uuid, int registry)
 {
-    string path_ro_registry = MC_REGISTRY_SYSTEM_PATH"/" + byteArrayToString(uuid, sizeof(*uuid)) + GP_TA_SPID_FILE_EXT;
-    string path_rw_registry = MC_REGISTRY_DATA_PATH"/" + byteArrayToString(uuid, sizeof(*uuid)) + GP_TA_SPID_FILE_EXT;
+    string name = byteArrayToString(uuid, sizeof(*uuid)) + GP_TA_SPID_FILE_EXT;
 
     if (registry == MC_REGISTRY_ALL) {
-        struct stat tmp;
-        if (stat(path_ro_registry.c_str(), &tmp) == 0) {
-            return path_ro_registry;
+        regIndexEntry_t entry;
+        regIndexLookup(name, entry);
+        if (entry.present) {
+            return entry.path;
+        }
+    }
+    return MC_REGISTRY_DATA_PATH "/" + name;
+}
+
+//------------------------------------------------------------------------------
+static string getTAImgFilePath(const string &uuidStr, mcSpid_t spid)
+{
+    return MC_REGISTRY_DATA_PATH "/" + uuidStr + "." + uint32ToString(spid) + GP_TA_IMG_FILE_EXT;
+}
+
+/** Header of a compressed TA binary, followed by a zlib stream. Raw binaries
+ * start with the MCLF magic instead. */
+typedef struct {
+    uint32_t magic;
+    uint32_t size;          /**< Uncompressed size. */
+    uint32_t serviceType;   /**< Service type of the MCLF header. */
+} regZHeader_t;
+
+/** Reads a TA binary, inflating it on the fly if it is stored compressed. */
+typedef struct {
+    int fd;
+    bool compressed;
+    z_stream zs;
+    uint8_t in[REG_ZBIN_CHUNK];
+} regBinReader_t;
+
+/** Compression: TA binaries are stored compressed where that saves space. */
+static bool regCompress = false;
+
+//------------------------------------------------------------------------------
+void mcRegistrySetCompression(bool enable)
+{
+    regCompress = enable;
+}
+
+//------------------------------------------------------------------------------
+static bool writeAll(int fd, const void *data, uint32_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t done = 0;
+
+    while (done < size) {
+        ssize_t ret = write(fd, p + done, size - done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        done += ret;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/** Writes a TA binary compressed, in a single streaming pass.
+ * @return false if that failed or would not save space. */
+static bool writeCompressed(int fd, const void *data, uint32_t size)
+{
+    uint8_t out[REG_ZBIN_CHUNK];
+    regZHeader_t header;
+    z_stream zs;
+    int ret;
+
+    if (size < sizeof(mclfHeaderV2_t)) {
+        return false;
+    }
+    header.magic = REG_ZBIN_MAGIC;
+    header.size = size;
+    header.serviceType = ((const mclfHeaderV2_t *)data)->serviceType;
+    if (!writeAll(fd, &header, sizeof(header))) {
+        return false;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, Z_BEST_COMPRESSION) != Z_OK) {
+        return false;
+    }
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = size;
+    do {
+        zs.next_out = out;
+        zs.avail_out = sizeof(out);
+        ret = deflate(&zs, Z_FINISH);
+        if ((ret != Z_OK && ret != Z_STREAM_END) ||
+                !writeAll(fd, out, sizeof(out) - zs.avail_out) ||
+                zs.total_out + sizeof(header) >= size) {
+            // Encrypted TAs do not compress, store them as they are
+            deflateEnd(&zs);
+            return false;
+        }
+    } while (ret != Z_STREAM_END);
+    LOG_I("TA binary compressed from %u to %lu bytes (%lu%%)", size,
+          (unsigned long)(zs.total_out + sizeof(header)),
+          (unsigned long)((zs.total_out + sizeof(header)) * 100 / size));
+    deflateEnd(&zs);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/** Opens a TA binary. header->size is its uncompressed size, and
+ * header->serviceType is only set for compressed binaries. */
+static bool openBinary(regBinReader_t *r, const char *path, regZHeader_t *header)
+{
+    struct stat ss;
+
+    r->compressed = false;
+    r->fd = open(path, O_RDONLY);
+    if (r->fd == -1) {
+        return false;
+    }
+    if (read(r->fd, header, sizeof(*header)) == sizeof(*header) && header->magic == REG_ZBIN_MAGIC) {
+        memset(&r->zs, 0, sizeof(r->zs));
+        if (inflateInit(&r->zs) != Z_OK) {
+            close(r->fd);
+            return false;
+        }
+        r->compressed = true;
+        return true;
+    }
+    if (fstat(r->fd, &ss) != 0 || lseek(r->fd, 0, SEEK_SET) != 0) {
+        close(r->fd);
+        return false;
+    }
+    header->magic = 0;
+    header->size = ss.st_size;
+    header->serviceType = SERVICE_TYPE_ILLEGAL;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/** Reads the next len bytes of a TA binary.
+ * @return Number of bytes read, less than len at the end or on error. */
+static uint32_t readBinary(regBinReader_t *r, void *buf, uint32_t len)
+{
+    if (!r->compressed) {
+        uint8_t *p = (uint8_t *)buf;
+        uint32_t done = 0;
+        while (done < len) {
+            ssize_t ret = read(r->fd, p + done, len - done);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                break;
+            }
+            done += ret;
+        }
+        return done;
+    }
+
+    r->zs.next_out = (Bytef *)buf;
+    r->zs.avail_out = len;
+    while (r->zs.avail_out > 0) {
+        if (r->zs.avail_in == 0) {
+            ssize_t ret = read(r->fd, r->in, sizeof(r->in));
+            if (ret <= 0) {
+                break;
+            }
+            r->zs.next_in = r->in;
+            r->zs.avail_in = ret;
+        }
+        int ret = inflate(&r->zs, Z_NO_FLUSH);
+        if (ret != Z_OK) {
+            if (ret != Z_STREAM_END) {
+                LOG_E("inflate failed: %d", ret);
+            }
+            break;
+        }
+    }
+    return len - r->zs.avail_out;
+}
+
+//------------------------------------------------------------------------------
+static void closeBinary(regBinReader_t *r)
+{
+    if (r->compressed) {
+        inflateEnd(&r->zs);
+    }
+    close(r->fd);
+}
+
+//------------------------------------------------------------------------------
+/** A file written and synced next to its final location, not yet visible. */
+typedef struct {
+    string path;
+    string stagedPath;
+} regStagedFile_t;
+
+/** Group commit: writers that renamed files in the same window share one
+ * fsync per directory instead of syncing it each. Data of the staged files
+ * is always synced by each writer before its rename. */
+static bool regGroupCommit = false;
+static pthread_mutex_t regSyncMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t regSyncCond = PTHREAD_COND_INITIALIZER;
+static bool regSyncRunning = false;
+static set<string> regSyncDirs;      /**< Directories with unsynced renames. */
+static uint32_t regSyncQueued = 0;   /**< Last rename generation queued. */
+static uint32_t regSyncDone = 0;     /**< Last rename generation synced. */
+static uint32_t regSyncFailFrom = 0; /**< Generations of the last failed sync: */
+static uint32_t regSyncFailTo = 0;   /**< (regSyncFailFrom, regSyncFailTo]. */
+static uint32_t regStageCount = 0;
+
+//------------------------------------------------------------------------------
+void mcRegistrySetGroupCommit(bool enable)
+{
+    regGroupCommit = enable;
+}
+
+//------------------------------------------------------------------------------
+static bool fsyncDirs(const set<string> &dirs)
+{
+    bool ok = true;
+
+    for (set<string>::const_iterator it = dirs.begin(); it != dirs.end(); it++) {
+        int fd = open(it->c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd == -1 || fsync(fd) != 0) {
+            LOG_ERRNO("fsync");
+            ok = false;
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+/** Makes renames in dirs durable, in group commit mode together with those
+ * of concurrent writers. */
+static bool syncDirs(const set<string> &dirs)
+{
+    if (!regGroupCommit) {
+        return fsyncDirs(dirs);
+    }
+
+    pthread_mutex_lock(&regSyncMutex);
+    regSyncDirs.insert(dirs.begin(), dirs.end());
+    uint32_t mine = ++regSyncQueued;
+    while ((int32_t)(regSyncDone - mine) < 0) {
+        if (regSyncRunning) {
+            pthread_cond_wait(&regSyncCond, &regSyncMutex);
+            continue;
+        }
+        // Lead the next group
+        set<string> todo;
+        uint32_t from = regSyncDone;
+        uint32_t upto = regSyncQueued;
+        todo.swap(regSyncDirs);
+        regSyncRunning = true;
+        pthread_mutex_unlock(&regSyncMutex);
+        bool ok = fsyncDirs(todo);
+        pthread_mutex_lock(&regSyncMutex);
+        if (!ok) {
+            regSyncFailFrom = from;
+            regSyncFailTo = upto;
+        }
+        regSyncDone = upto;
+        regSyncRunning = false;
+        pthread_cond_broadcast(&regSyncCond);
+    }
+    bool failed = (int32_t)(mine - regSyncFailFrom) > 0 && (int32_t)(mine - regSyncFailTo) <= 0;
+    pthread_mutex_unlock(&regSyncMutex);
+    return !failed;
+}
+
+//------------------------------------------------------------------------------
+static mcResult_t stageFile(vector<regStagedFile_t> &staged, const string &path,
+                            const void *data, uint32_t size, bool compress = false)
+{
+    regStagedFile_t file;
+    char suffix[16];
+
+    // Unique per writer, concurrent stores of the same file must not collide
+    snprintf(suffix, sizeof(suffix), "%u", __sync_fetch_and_add(&regStageCount, 1));
+    file.path = path;
+    file.stagedPath = path + STAGED_FILE_EXT + suffix;
+
+    int fd = open(file.stagedPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        LOG_E("mcRegistry stage %s failed: %d", file.stagedPath.c_str(), MC_DRV_ERR_INVALID_DEVICE_FILE);
+        return MC_DRV_ERR_INVALID_DEVICE_FILE;
+    }
+    bool written = false;
+    if (compress) {
+        written = writeCompressed(fd, data, size);
+        if (!written && (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0)) {
+            LOG_ERRNO("ftruncate");
+            close(fd);
+            remove(file.stagedPath.c_str());
+            return MC_DRV_ERR_OUT_OF_RESOURCES;
         }
     }
-    return path_rw_registry;
+    if (!written) {
+        written = writeAll(fd, data, size);
+    }
+    if (!written || fsync(fd) != 0) {
+        LOG_ERRNO("write");
+        LOG_E("mcRegistry stage %s failed: %d", file.stagedPath.c_str(), MC_DRV_ERR_OUT_OF_RESOURCES);
+        close(fd);
+        remove(file.stagedPath.c_str());
+        return MC_DRV_ERR_OUT_OF_RESOURCES;
+    }
+    close(fd);
+    // Same target twice in one batch: the later data has replaced the file
+    for (size_t i = 0; i < staged.size(); i++) {
+        if (staged[i].path == path) {
+            remove(staged[i].stagedPath.c_str());
+            staged.erase(staged.begin() + i);
+            break;
+        }
+    }
+    staged.push_back(file);
+    return MC_DRV_OK;
+}
+
+//------------------------------------------------------------------------------
+static void discardStaged(vector<regStagedFile_t> &staged)
+{
+    for (size_t i = 0; i < staged.size(); i++) {
+        remove(staged[i].stagedPath.c_str());
+    }
+    staged.clear();
+}
+
+//------------------------------------------------------------------------------
+/** Moves all staged files in place and makes the renames durable. */
+static mcResult_t commitStaged(vector<regStagedFile_t> &staged)
+{
+    set<string> dirs;
+    mcResult_t ret = MC_DRV_OK;
+
+    for (size_t i = 0; i < staged.size(); i++) {
+        if (rename(staged[i].stagedPath.c_str(), staged[i].path.c_str()) != 0) {
+            LOG_ERRNO("rename");
+            remove(staged[i].stagedPath.c_str());
+            ret = MC_DRV_ERR_OUT_OF_RESOURCES;
+            continue;
+        }
+        dirs.insert(staged[i].path.substr(0, staged[i].path.find_last_of('/')));
+    }
+    if (!syncDirs(dirs)) {
+        ret = MC_DRV_ERR_OUT_OF_RESOURCES;
+    }
+    staged.clear();
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+/** Replaces a registry file atomically: a power loss leaves either the old
+ * or the new content, never a truncated file. */
+static mcResult_t storeFile(const string &path, const void *data, uint32_t size,
+                            bool compress = false)
+{
+    vector<regStagedFile_t> staged;
+
+    mcResult_t ret = stageFile(staged, path, data, size, compress);
+    if (ret != MC_DRV_OK) {
+        return ret;
+    }
+    return commitStaged(staged);
+}
+
+//------------------------------------------------------------------------------
+/** Identity of a file an image was composed from. */
+typedef struct {
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+} regImageStamp_t;
+
+/** Files an image depends on: TA blob, root, SP and TL container. */
+enum {
+    REG_IMAGE_BLOB,
+    REG_IMAGE_ROOT_CONT,
+    REG_IMAGE_SP_CONT,
+    REG_IMAGE_TL_CONT,
+    REG_IMAGE_DEPS
+};
+
+/** Header of a precomposed TA image. It is followed by the registry object
+ * value of an SP TA: blob length info, TA blob, root, SP and TL container.
+ * The image is only used while all files it was composed from are unchanged,
+ * so that files replaced behind the daemon's back are never served stale. */
+typedef struct {
+    uint32_t magic;
+    uint32_t tlStartOffset;
+    regImageStamp_t deps[REG_IMAGE_DEPS];
+} regImageHeader_t;
+
+/** Serialises image updates. Every writer rebuilds images after updating
+ * the files they depend on, so the last image written is never stale. */
+static pthread_mutex_t regImageMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//------------------------------------------------------------------------------
+/** Records the identity of the files the image of an SP TA depends on. A
+ * missing file is recorded as all zero. */
+static void stampImageDeps(const string &uuidStr, const string &blobPath, mcSpid_t spid,
+                           regImageStamp_t *deps)
+{
+    const string paths[REG_IMAGE_DEPS] = {
+        blobPath,
+        getRootContFilePath(),
+        getSpContFilePath(spid),
+        MC_REGISTRY_DATA_PATH "/" + uuidStr + "." + uint32ToString(spid) + TL_CONT_FILE_EXT,
+    };
+    struct stat sb;
+
+    memset(deps, 0, REG_IMAGE_DEPS * sizeof(regImageStamp_t));
+    for (int i = 0; i < REG_IMAGE_DEPS; i++) {
+        if (stat(paths[i].c_str(), &sb) == 0) {
+            deps[i].ino = sb.st_ino;
+            deps[i].size = sb.st_size;
+            deps[i].mtime = sb.st_mtime;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Loads the precomposed image of an SP TA with a single read.
+ * @return Registry object, NULL if there is no up to date image. */
+static regObject_t *readServiceImage(const string &uuidStr, const regIndexEntry_t &blob, mcSpid_t spid)
+{
+    const string imgPath = getTAImgFilePath(uuidStr, spid);
+    regImageHeader_t header;
+    regImageStamp_t deps[REG_IMAGE_DEPS];
+    regObject_t *regobj = NULL;
+    struct stat sb;
+
+    int fd = open(imgPath.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &sb) == 0 && sb.st_size > (off_t)sizeof(header)) {
+        uint32_t len = sb.st_size - sizeof(header);
+        regobj = (regObject_t *)malloc(sizeof(regObject_t) + len);
+        if (regobj != NULL) {
+            struct iovec iov[2];
+            iov[0].iov_base = &header;
+            iov[0].iov_len = sizeof(header);
+            iov[1].iov_base = regobj->value;
+            iov[1].iov_len = len;
+            stampImageDeps(uuidStr, blob.path, spid, deps);
+            if (readv(fd, iov, 2) != sb.st_size || header.magic != REG_IMAGE_MAGIC ||
+                    memcmp(header.deps, deps, sizeof(deps)) != 0) {
+                free(regobj);
+                regobj = NULL;
+            } else {
+                regobj->len = len;
+                regobj->tlStartOffset = header.tlStartOffset;
+            }
+        }
+    }
+    close(fd);
+    return regobj;
+}
+
+//------------------------------------------------------------------------------
+/** Composes the registry object of a TA and keeps it as its image, or
+ * removes the image if there is nothing to precompose. Call with
+ * regImageMutex held.
+ * @return Registry object, to be freed by the caller. */
+static regObject_t *composeServiceImage(const string &uuidStr, const regIndexEntry_t &blob, mcSpid_t spid)
+{
+    const string imgPath = getTAImgFilePath(uuidStr, spid);
+    regImageStamp_t deps[REG_IMAGE_DEPS];
+
+    // Stamp first: a file changing while the image is composed then makes
+    // the image look stale rather than up to date
+    stampImageDeps(uuidStr, blob.path, spid, deps);
+    regObject_t *regobj = mcRegistryFileGetServiceBlob(blob.path.c_str(), spid);
+    if (regobj == NULL || regobj->tlStartOffset == 0) {
+        // Not an SP TA, or a container is missing
+        remove(imgPath.c_str());
+        return regobj;
+    }
+
+    uint32_t size = sizeof(regImageHeader_t) + regobj->len;
+    regImageHeader_t *header = (regImageHeader_t *)malloc(size);
+    if (header == NULL) {
+        remove(imgPath.c_str());
+        return regobj;
+    }
+    header->magic = REG_IMAGE_MAGIC;
+    header->tlStartOffset = regobj->tlStartOffset;
+    memcpy(header->deps, deps, sizeof(deps));
+    memcpy(header + 1, regobj->value, regobj->len);
+    LOG_I("store TA image: %s", imgPath.c_str());
+    if (storeFile(imgPath, header, size) != MC_DRV_OK) {
+        remove(imgPath.c_str());
+    }
+    free(header);
+    return regobj;
+}
+
+//------------------------------------------------------------------------------
+/** Tells from its header alone whether the image of an SP TA is up to date. */
+static bool serviceImageCurrent(const string &uuidStr, const regIndexEntry_t &blob, mcSpid_t spid)
+{
+    regImageHeader_t header;
+    regImageStamp_t deps[REG_IMAGE_DEPS];
+
+    int fd = open(getTAImgFilePath(uuidStr, spid).c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool current = (read(fd, &header, sizeof(header)) == sizeof(header) &&
+                    header.magic == REG_IMAGE_MAGIC);
+    close(fd);
+    if (!current) {
+        return false;
+    }
+    stampImageDeps(uuidStr, blob.path, spid, deps);
+    return memcmp(header.deps, deps, sizeof(deps)) == 0;
+}
+
+//------------------------------------------------------------------------------
+/** Rebuilds the image of a GP TA from its current blob and containers.
+ * Call with regImageMutex held. */
+static void refreshServiceImage(const string &uuidStr)
+{
+    regIndexEntry_t blob;
+    regIndexEntry_t spidEntry;
+
+    regIndexLookup(uuidStr + GP_TA_BIN_FILE_EXT, blob);
+    regIndexLookup(uuidStr + GP_TA_SPID_FILE_EXT, spidEntry);
+    if (!spidEntry.present || spidEntry.spid == 0) {
+        return;
+    }
+    if (!blob.present) {
+        remove(getTAImgFilePath(uuidStr, spidEntry.spid).c_str());
+        return;
+    }
+    free(composeServiceImage(uuidStr, blob, spidEntry.spid));
+}
+
+//------------------------------------------------------------------------------
+/** Records the new owner of a GP TA after it was stored and rebuilds its
+ * image. An image kept for a previous owner is dropped. */
+static void updateTAOwner(const string &uuidStr)
+{
+    regIndexEntry_t spidEntry;
+
+    mcSpid_t old = regOwnersUpdate(uuidStr);
+    regIndexLookup(uuidStr + GP_TA_SPID_FILE_EXT, spidEntry);
+    pthread_mutex_lock(&regImageMutex);
+    if (old != 0 && old != spidEntry.spid) {
+        remove(getTAImgFilePath(uuidStr, old).c_str());
+    }
+    refreshServiceImage(uuidStr);
+    pthread_mutex_unlock(&regImageMutex);
+}
+
+//------------------------------------------------------------------------------
+/** Lists the images kept in the writable registry for an SP, or for all SPs
+ * if spid is 0. These include images of TAs from the read-only registry,
+ * which the ownership index does not know about. */
+static void regImagesList(mcSpid_t spid, vector<pair<string, mcSpid_t> > &images)
+{
+    const string ext = GP_TA_IMG_FILE_EXT;
+    struct dirent *de;
+
+    DIR *dp = opendir(MC_REGISTRY_DATA_PATH);
+    if (dp == NULL) {
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        // <uuid>.<spid><ext>
+        string name = de->d_name;
+        size_t dot = name.find('.');
+        if (dot == string::npos || name.size() != dot + 1 + 8 + ext.size() ||
+                name.compare(name.size() - ext.size(), string::npos, ext) != 0) {
+            continue;
+        }
+        string spidStr = name.substr(dot + 1, 8);
+        uint32_t imgSpid = strtoul(string(spidStr.rbegin(), spidStr.rend()).c_str(), NULL, 16);
+        if (spid == 0 || imgSpid == spid) {
+            images.push_back(make_pair(name.substr(0, dot), imgSpid));
+        }
+    }
+    closedir(dp);
+}
+
+//------------------------------------------------------------------------------
+/** Rebuilds the images of all TAs of an SP after one of their containers
+ * changed, or of all TAs if spid is 0. Images which can no longer be
+ * composed, or were kept for a previous owner, are removed. */
+static void updateServiceImages(mcSpid_t spid)
+{
+    vector<string> uuids;
+    vector<pair<string, mcSpid_t> > images;
+
+    regOwnersList(spid, uuids);
+    regImagesList(spid, images);
+    pthread_mutex_lock(&regImageMutex);
+    set<string> done;
+    for (size_t i = 0; i < uuids.size(); i++) {
+        refreshServiceImage(uuids[i]);
+        done.insert(uuids[i]);
+    }
+    for (size_t i = 0; i < images.size(); i++) {
+        const string &uuidStr = images[i].first;
+        regIndexEntry_t spidEntry;
+        regIndexLookup(uuidStr + GP_TA_SPID_FILE_EXT, spidEntry);
+        if (!spidEntry.present || spidEntry.spid != images[i].second) {
+            remove(getTAImgFilePath(uuidStr, images[i].second).c_str());
+        } else if (done.insert(uuidStr).second) {
+            refreshServiceImage(uuidStr);
+        }
+    }
+    pthread_mutex_unlock(&regImageMutex);
+}
+
+//------------------------------------------------------------------------------
+/** Lists the GP TAs with an SPID file in either registry. Unlike the
+ * ownership index, this includes the SP TAs of the read-only registry. */
+static void regSpTAsList(set<string> &uuids)
+{
+    const char *dirs[2] = { MC_REGISTRY_SYSTEM_PATH, MC_REGISTRY_DATA_PATH };
+    const string ext = GP_TA_SPID_FILE_EXT;
+    struct dirent *de;
+
+    for (int i = 0; i < 2; i++) {
+        DIR *dp = opendir(dirs[i]);
+        if (dp == NULL) {
+            continue;
+        }
+        while ((de = readdir(dp)) != NULL) {
+            string name = de->d_name;
+            if (name.size() <= ext.size() ||
+                    name.compare(name.size() - ext.size(), string::npos, ext) != 0) {
+                continue;
+            }
+            uuids.insert(name.substr(0, name.size() - ext.size()));
+        }
+        closedir(dp);
+    }
+}
+
+//------------------------------------------------------------------------------
+void mcRegistryComposeImages(void)
+{
+    set<string> uuids;
+    uint32_t composed = 0;
+
+    regSpTAsList(uuids);
+    pthread_mutex_lock(&regImageMutex);
+    for (set<string>::iterator it = uuids.begin(); it != uuids.end(); it++) {
+        regIndexEntry_t blob;
+        regIndexEntry_t spidEntry;
+
+        regIndexLookup(*it + GP_TA_BIN_FILE_EXT, blob);
+        regIndexLookup(*it + GP_TA_SPID_FILE_EXT, spidEntry);
+        if (!blob.present || !spidEntry.present || spidEntry.spid == 0 ||
+                serviceImageCurrent(*it, blob, spidEntry.spid)) {
+            continue;
+        }
+        free(composeServiceImage(*it, blob, spidEntry.spid));
+        composed++;
+    }
+    pthread_mutex_unlock(&regImageMutex);
+    LOG_I("Composed %u of %zu TA images", composed, uuids.size());
 }
 
 //------------------------------------------------------------------------------
 mcResult_t mcRegistryStoreAuthToken(void *so, uint32_t size)
 {
-    int res = 0;
     if (so == NULL || size > 3 * MAX_SO_CONT_SIZE) {
         LOG_E("mcRegistry store So.Soc failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
         return MC_DRV_ERR_INVALID_PARAMETER;
@@ -235,25 +1165,11 @@ mcResult_t mcRegistryStoreAuthToken(void *so, uint32_t size)
     const string &authTokenFilePath = getAuthTokenFilePath();
     LOG_I("store AuthToken: %s", authTokenFilePath.c_str());
 
-    FILE *fs = fopen(authTokenFilePath.c_str(), "wb");
-    if (fs==NULL) {
-        LOG_E("mcRegistry store So.Soc failed: %d", MC_DRV_ERR_INVALID_DEVICE_FILE);
-        return MC_DRV_ERR_INVALID_DEVICE_FILE;
-    }
-    res = fseek(fs, 0, SEEK_SET);
-    if (res!=0) {
-        LOG_E("mcRegistry store So.Soc failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
-        fclose(fs);
-        return MC_DRV_ERR_INVALID_PARAMETER;
-    }
-    fwrite((char *)so, 1, size, fs);
-    if (ferror(fs)) {
-        LOG_E("mcRegistry store So.Soc failed %d", MC_DRV_ERR_OUT_OF_RESOURCES);
-        fclose(fs);
-        return MC_DRV_ERR_OUT_OF_RESOURCES;
+    mcResult_t ret = storeFile(authTokenFilePath, (char *)so, size);
+    if (ret != MC_DRV_OK) {
+        LOG_E("mcRegistry store So.Soc failed: %d", ret);
+        return ret;
     }
-    fflush(fs);
-    fclose(fs);
 
     return MC_DRV_OK;
 }
@@ -385,7 +1301,6 @@ mcResult_t mcRegistryDeleteAuthToken(void)
 //------------------------------------------------------------------------------
 mcResult_t mcRegistryStoreRoot(void *so, uint32_t size)
 {
-    int res = 0;
     if (so == NULL || size > 3 * MAX_SO_CONT_SIZE) {
         LOG_E("mcRegistry store So.Root failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
         return MC_DRV_ERR_INVALID_PARAMETER;
@@ -394,25 +1309,12 @@ mcResult_t mcRegistryStoreRoot(void *so, uint32_t size)
     const string &rootContFilePath = getRootContFilePath();
     LOG_I("store Root: %s", rootContFilePath.c_str());
 
-    FILE *fs = fopen(rootContFilePath.c_str(), "wb");
-    if (fs==NULL) {
-        LOG_E("mcRegistry store So.Root failed: %d", MC_DRV_ERR_INVALID_DEVICE_FILE);
-        return MC_DRV_ERR_INVALID_DEVICE_FILE;
-    }
-    res = fseek(fs, 0, SEEK_SET);
-    if (res!=0) {
-        LOG_E("mcRegistry store So.Root failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
-        fclose(fs);
-        return MC_DRV_ERR_INVALID_PARAMETER;
-    }
-    fwrite((char *)so, 1, size, fs);
-    if (ferror(fs)) {
-        LOG_E("mcRegistry store So.Root failed: %d", MC_DRV_ERR_OUT_OF_RESOURCES);
-        fclose(fs);
-        return MC_DRV_ERR_OUT_OF_RESOURCES;
+    mcResult_t ret = storeFile(rootContFilePath, (char *)so, size);
+    if (ret != MC_DRV_OK) {
+        LOG_E("mcRegistry store So.Root failed: %d", ret);
+        return ret;
     }
-    fflush(fs);
-    fclose(fs);
+    updateServiceImages(0);
 
     return MC_DRV_OK;
 }
@@ -456,7 +1358,6 @@ mcResult_t mcRegistryReadRoot(void *so, uint32_t *size)
 //------------------------------------------------------------------------------
 mcResult_t mcRegistryStoreSp(mcSpid_t spid, void *so, uint32_t size)
 {
-    int res = 0;
     if ((spid == 0) || (so == NULL) || size > 3 * MAX_SO_CONT_SIZE) {
         LOG_E("mcRegistry store So.Sp(SpId) failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
         return MC_DRV_ERR_INVALID_PARAMETER;
@@ -465,25 +1366,12 @@ mcResult_t mcRegistryStoreSp(mcSpid_t spid, void *so, uint32_t size)
     const string &spContFilePath = getSpContFilePath(spid);
     LOG_I("store SP: %s", spContFilePath.c_str());
 
-    FILE *fs = fopen(spContFilePath.c_str(), "wb");
-    if (fs==NULL) {
-        LOG_E("mcRegistry store So.Sp(SpId) failed: %d", MC_DRV_ERR_INVALID_DEVICE_FILE);
-        return MC_DRV_ERR_INVALID_DEVICE_FILE;
-    }
-    res = fseek(fs, 0, SEEK_SET);
-    if (res!=0) {
-        LOG_E("mcRegistry store So.Sp(SpId) failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
-        fclose(fs);
-        return MC_DRV_ERR_INVALID_PARAMETER;
-    }
-    fwrite((char *)so, 1, size, fs);
-    if (ferror(fs)) {
-        LOG_E("mcRegistry store So.Sp(SpId) failed: %d", MC_DRV_ERR_OUT_OF_RESOURCES);
-        fclose(fs);
-        return MC_DRV_ERR_OUT_OF_RESOURCES;
+    mcResult_t ret = storeFile(spContFilePath, (char *)so, size);
+    if (ret != MC_DRV_OK) {
+        LOG_E("mcRegistry store So.Sp(SpId) failed: %d", ret);
+        return ret;
     }
-    fflush(fs);
-    fclose(fs);
+    updateServiceImages(spid);
 
     return MC_DRV_OK;
 }
@@ -526,34 +1414,20 @@ mcResult_t mcRegistryReadSp(mcSpid_t spid, void *so, uint32_t *size)
 //------------------------------------------------------------------------------
 mcResult_t mcRegistryStoreTrustletCon(const mcUuid_t *uuid, const mcSpid_t spid, void *so, uint32_t size)
 {
-    int res = 0;
     if ((uuid == NULL) || (so == NULL) || size > 3 * MAX_SO_CONT_SIZE) {
         LOG_E("mcRegistry store So.TrustletCont(uuid) failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
-        return MC_DRV_ERR_INVALID_PARAMETER;
-    }
-
-    const string &tlContFilePath = getTlContFilePath(uuid, spid);
-    LOG_I("store TLc: %s", tlContFilePath.c_str());
-
-    FILE *fs = fopen(tlContFilePath.c_str(), "wb");
-    if (fs==NULL) {
-        LOG_E("mcRegistry store So.TrustletCont(uuid) failed: %d", MC_DRV_ERR_INVALID_DEVICE_FILE);
-        return MC_DRV_ERR_INVALID_DEVICE_FILE;
-    }
-    res = fseek(fs, 0, SEEK_SET);
-    if (res!=0) {
-        LOG_E("mcRegistry store So.TrustletCont(uuid) failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
-        fclose(fs);
-        return MC_DRV_ERR_INVALID_PARAMETER;
-    }
-    fwrite((char *)so, 1, size, fs);
-    if (ferror(fs)) {
-        LOG_E("mcRegistry store So.TrustletCont(uuid) failed: %d", MC_DRV_ERR_OUT_OF_RESOURCES);
-        fclose(fs);
-        return MC_DRV_ERR_OUT_OF_RESOURCES;
+        return MC_DRV_ERR_INVALID_PARAMETER;
     }
-    fflush(fs);
-    fclose(fs);
+
+    const string &tlContFilePath = getTlContFilePath(uuid, spid);
+    LOG_I("store TLc: %s", tlContFilePath.c_str());
+
+    mcResult_t ret = storeFile(tlContFilePath, (char *)so, size);
+    if (ret != MC_DRV_OK) {
+        LOG_E("mcRegistry store So.TrustletCont(uuid) failed: %d", ret);
+        return ret;
+    }
+    updateServiceImages(spid);
 
     return MC_DRV_OK;
 }
@@ -567,11 +1441,10 @@ static uint32_t getAsUint32BE(
     return val;
 }
 
-mcResult_t mcRegistryStoreTABlob(mcSpid_t spid, void *blob, uint32_t size)
+//------------------------------------------------------------------------------
+/** Validates a TA blob and extracts the UUID it is stored under. */
+static mcResult_t checkTABlob(mcSpid_t spid, void *blob, uint32_t size, mcUuid_t *pUuid)
 {
-    int res = 0;
-    LOG_I("mcRegistryStoreTABlob started");
-
     // Check blob size
     if (size < sizeof(mclfHeaderV24_t)) {
         LOG_E("RegistryStoreTABlob failed - TA blob length is less then header size");
@@ -611,9 +1484,11 @@ mcResult_t mcRegistryStoreTABlob(mcSpid_t spid, void *blob, uint32_t size)
             return MC_DRV_ERR_INVALID_PARAMETER;
         }
 
-        uuid_attestation *pUa = (uuid_attestation *) & ((uint8_t *)blob)[header24->attestationOffset];
-        // Check attestation size
-        if ((header24->attestationOffset > size) && (header24->attestationOffset + getAsUint32BE(&pUa->size) > size)) {
+        uint32_t attestationOffset = header24->attestationOffset;
+        uuid_attestation *pUa = (uuid_attestation *) & ((uint8_t *)blob)[attestationOffset];
+        // Check attestation size, without reading beyond the blob
+        if ((attestationOffset > size) || (size - attestationOffset < sizeof(uuid_attestation)) ||
+                (getAsUint32BE(&pUa->size) > size - attestationOffset)) {
             LOG_E("RegistryStoreTABlob failed - Attestation size is not correct");
             return MC_DRV_ERR_TA_HEADER_ERROR;
         }
@@ -643,57 +1518,584 @@ mcResult_t mcRegistryStoreTABlob(mcSpid_t spid, void *blob, uint32_t size)
         return MC_DRV_ERR_INVALID_PARAMETER;
     }
     }
+    memcpy(pUuid, &uuid, sizeof(mcUuid_t));
+    return MC_DRV_OK;
+}
+
+/** Content store: TA blobs are kept once in OBJECTS_PATH under a name derived
+ * from their content, and <uuid>.tabin files are hard links to them. The
+ * lookup paths are unchanged, identical blobs share storage and storing a
+ * blob which is already present writes no data. */
+static bool regContentStore = false;
+
+/** Content store objects by inode, so that the object a TA blob file refers to
+ * is found without scanning OBJECTS_PATH. Filled by the start-up sweep and
+ * whenever an object is stored. */
+static map<ino_t, string> regObjects;
+
+//------------------------------------------------------------------------------
+void mcRegistrySetContentStore(bool enable)
+{
+    regContentStore = enable;
+}
+
+//------------------------------------------------------------------------------
+/** FNV-1a, only names objects: contents are compared before sharing. */
+static uint64_t hashBlob(const void *data, uint32_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (uint32_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+//------------------------------------------------------------------------------
+static bool fileEquals(const string &path, const void *data, uint32_t size)
+{
+    regBinReader_t r;
+    regZHeader_t header;
+    uint8_t buf[REG_ZBIN_CHUNK];
+    const uint8_t *p = (const uint8_t *)data;
+    bool equal = true;
+
+    if (!openBinary(&r, path.c_str(), &header)) {
+        return false;
+    }
+    if (header.size != size) {
+        closeBinary(&r);
+        return false;
+    }
+    for (uint32_t done = 0; equal && done < size;) {
+        uint32_t len = size - done < sizeof(buf) ? size - done : sizeof(buf);
+        equal = (readBinary(&r, buf, len) == len && memcmp(buf, p + done, len) == 0);
+        done += len;
+    }
+    closeBinary(&r);
+    return equal;
+}
+
+//------------------------------------------------------------------------------
+/** Stages path as a reference to the content store object holding blob,
+ * storing the object first if it is not present yet. If received is given
+ * it holds the blob and is removed once the object holds the data.
+ * @param[out] unchanged path already refers to the object, nothing staged.
+ * @return MC_DRV_OK, otherwise the plain layout has to be used. */
+static mcResult_t stageObjectRef(vector<regStagedFile_t> &staged, const string &path,
+                                 void *blob, uint32_t size, const char *received,
+                                 bool *unchanged)
+{
+    struct stat objStat, refStat;
+    char name[32];
+
+    *unchanged = false;
+    snprintf(name, sizeof(name), "/%016llx-%08x",
+             (unsigned long long)hashBlob(blob, size), size);
+    const string objPath = OBJECTS_PATH + string(name) + GP_TA_BIN_FILE_EXT;
+
+    if (fileEquals(objPath, blob, size)) {
+        LOG_I("TA blob already stored as %s", objPath.c_str());
+    } else if (access(objPath.c_str(), F_OK) == 0) {
+        LOG_W("TA blob name clash on %s", objPath.c_str());
+        return MC_DRV_ERR_UNKNOWN;
+    } else {
+        if (mkdir(OBJECTS_PATH, 0700) != 0 && errno != EEXIST) {
+            LOG_ERRNO("mkdir");
+            return MC_DRV_ERR_UNKNOWN;
+        }
+        mcResult_t ret;
+        if (received != NULL && !regCompress) {
+            set<string> dirs;
+            dirs.insert(OBJECTS_PATH);
+            if (link(received, objPath.c_str()) != 0) {
+                LOG_ERRNO("link");
+                return MC_DRV_ERR_UNKNOWN;
+            }
+            ret = syncDirs(dirs) ? MC_DRV_OK : MC_DRV_ERR_OUT_OF_RESOURCES;
+        } else {
+            ret = storeFile(objPath, blob, size, regCompress);
+        }
+        if (ret != MC_DRV_OK) {
+            remove(objPath.c_str());
+            return ret;
+        }
+    }
+
+    if (stat(objPath.c_str(), &objStat) != 0) {
+        LOG_ERRNO("stat");
+        return MC_DRV_ERR_UNKNOWN;
+    }
+    regObjects[objStat.st_ino] = objPath;
+    if (stat(path.c_str(), &refStat) == 0 &&
+            objStat.st_dev == refStat.st_dev && objStat.st_ino == refStat.st_ino) {
+        *unchanged = true;
+    } else {
+        regStagedFile_t file;
+        char suffix[16];
+
+        snprintf(suffix, sizeof(suffix), "%u", __sync_fetch_and_add(&regStageCount, 1));
+        file.path = path;
+        file.stagedPath = path + STAGED_FILE_EXT + suffix;
+        if (link(objPath.c_str(), file.stagedPath.c_str()) != 0) {
+            LOG_ERRNO("link");
+            return MC_DRV_ERR_UNKNOWN;
+        }
+        staged.push_back(file);
+    }
+    if (received != NULL) {
+        remove(received);
+    }
+    return MC_DRV_OK;
+}
+
+//------------------------------------------------------------------------------
+/** Notes the content store object path refers to, if any, so that it can be
+ * released once path no longer does. */
+static void holdObject(set<ino_t> &objects, const string &path)
+{
+    struct stat ss;
+
+    if (stat(path.c_str(), &ss) == 0 && regObjects.count(ss.st_ino) != 0) {
+        objects.insert(ss.st_ino);
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Notes the objects referred to by staged files and the files they replace. */
+static void holdStagedObjects(set<ino_t> &objects, const vector<regStagedFile_t> &staged)
+{
+    for (size_t i = 0; i < staged.size(); i++) {
+        holdObject(objects, staged[i].path);
+        holdObject(objects, staged[i].stagedPath);
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Removes the objects noted which are no longer referenced by any TA, that
+ * is which have no hard link left but their own name. */
+static void releaseObjects(const set<ino_t> &objects)
+{
+    struct stat ss;
+
+    for (set<ino_t>::const_iterator it = objects.begin(); it != objects.end(); it++) {
+        map<ino_t, string>::iterator obj = regObjects.find(*it);
+        if (obj == regObjects.end()) {
+            continue;
+        }
+        if (stat(obj->second.c_str(), &ss) == 0 && ss.st_ino == *it) {
+            if (ss.st_nlink > 1) {
+                continue;
+            }
+            LOG_I("Remove unused TA blob %s", obj->second.c_str());
+            unlink(obj->second.c_str());
+        }
+        regObjects.erase(obj);
+    }
+}
+
+//------------------------------------------------------------------------------
+void mcRegistryCollectObjects(void)
+{
+    vector<string> names;
+    struct dirent *de;
+    struct stat ss;
+
+    DIR *dp = opendir(OBJECTS_PATH);
+    if (dp == NULL) {
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        if (de->d_name[0] != '.') {
+            names.push_back(OBJECTS_PATH "/" + string(de->d_name));
+        }
+    }
+    closedir(dp);
+    regObjects.clear();
+    for (size_t i = 0; i < names.size(); i++) {
+        if (stat(names[i].c_str(), &ss) != 0) {
+            continue;
+        }
+        if (ss.st_nlink == 1) {
+            LOG_I("Remove unused TA blob %s", names[i].c_str());
+            unlink(names[i].c_str());
+        } else {
+            regObjects[ss.st_ino] = names[i];
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Tells whether a file name is that of a staged file, <name>.tmp<N>. */
+static bool isStagedName(const string &name)
+{
+    size_t ext = name.rfind(STAGED_FILE_EXT);
+
+    if (ext == string::npos) {
+        return false;
+    }
+    ext += strlen(STAGED_FILE_EXT);
+    return ext < name.size() && name.find_first_not_of("0123456789", ext) == string::npos;
+}
+
+//------------------------------------------------------------------------------
+/** Removes the staged files in dir and, if subdirs, in its TA data
+ * directories. */
+static void removeStagedFiles(const string &dir, bool subdirs)
+{
+    vector<string> names;
+    vector<string> dirs;
+    struct dirent *de;
+    struct stat ss;
+
+    DIR *dp = opendir(dir.c_str());
+    if (dp == NULL) {
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        string name = de->d_name;
+        if (isStagedName(name)) {
+            names.push_back(dir + "/" + name);
+        } else if (subdirs && name.size() == 2 * sizeof(mcUuid_t) &&
+                   lstat((dir + "/" + name).c_str(), &ss) == 0 && S_ISDIR(ss.st_mode)) {
+            dirs.push_back(dir + "/" + name);
+        }
+    }
+    closedir(dp);
+    for (size_t i = 0; i < names.size(); i++) {
+        LOG_I("Remove staged file %s", names[i].c_str());
+        remove(names[i].c_str());
+    }
+    for (size_t i = 0; i < dirs.size(); i++) {
+        removeStagedFiles(dirs[i], false);
+    }
+}
+
+//------------------------------------------------------------------------------
+void mcRegistryRemoveStagedFiles(void)
+{
+    const string authTokenFilePath = getAuthTokenFilePath();
+    const string authTokenDir = authTokenFilePath.substr(0, authTokenFilePath.rfind('/'));
+
+    removeStagedFiles(MC_REGISTRY_DATA_PATH, true);
+    removeStagedFiles(OBJECTS_PATH, false);
+    if (authTokenDir != MC_REGISTRY_DATA_PATH) {
+        removeStagedFiles(authTokenDir, false);
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Stores a TA blob. If received is given, it is the synced temporary file
+ * holding the blob, which is moved in place instead of writing blob again.
+ * The temporary file is consumed in any case. */
+static mcResult_t storeTABlob(mcSpid_t spid, void *blob, uint32_t size, const char *received)
+{
+    mcUuid_t uuid;
+
+    mcResult_t ret = checkTABlob(spid, blob, size, &uuid);
+    if (ret != MC_DRV_OK) {
+        if (received != NULL) {
+            remove(received);
+        }
+        return ret;
+    }
+    mclfHeaderV2_t *header20 = (mclfHeaderV2_t *)blob;
+
     const string taBinFilePath = getTABinFilePath((mcUuid_t *)&uuid, MC_REGISTRY_WRITABLE);
+    const string uuidStr = byteArrayToString(&uuid, sizeof(mcUuid_t));
 
     LOG_I("Store TA blob at: %s", taBinFilePath.c_str());
 
-    FILE *fs = fopen(taBinFilePath.c_str(), "wb");
-    if (fs==NULL) {
-        LOG_E("RegistryStoreTABlob failed - TA blob file open error: %d", MC_DRV_ERR_INVALID_DEVICE_FILE);
+    // TA blob and spid file become visible together
+    vector<regStagedFile_t> staged;
+    bool unchanged = false;
+    if (regContentStore &&
+            stageObjectRef(staged, taBinFilePath, blob, size, received, &unchanged) == MC_DRV_OK) {
+        received = NULL;
+        if (unchanged && (header20->serviceType != SERVICE_TYPE_SP_TRUSTLET ||
+                          readSpidFile(getTASpidFilePath(&uuid, MC_REGISTRY_WRITABLE)) == spid)) {
+            LOG_I("TA blob unchanged");
+            return MC_DRV_OK;
+        }
+    } else if (received != NULL && !regCompress) {
+        regStagedFile_t file;
+        file.path = taBinFilePath;
+        file.stagedPath = received;
+        staged.push_back(file);
+    } else {
+        ret = stageFile(staged, taBinFilePath, blob, size, regCompress);
+        if (received != NULL) {
+            remove(received);
+        }
+    }
+    if (ret == MC_DRV_OK && header20->serviceType == SERVICE_TYPE_SP_TRUSTLET) {
+        const string taspidFilePath = getTASpidFilePath((mcUuid_t *)&uuid, MC_REGISTRY_WRITABLE);
+
+        LOG_I("Store spid file at: %s", taspidFilePath.c_str());
+        ret = stageFile(staged, taspidFilePath, &spid, sizeof(mcSpid_t));
+    }
+    // The blob replaced may have been the last reference to an object
+    set<ino_t> objects;
+    holdStagedObjects(objects, staged);
+    if (ret != MC_DRV_OK) {
+        LOG_E("RegistryStoreTABlob failed: %d", ret);
+        discardStaged(staged);
+        releaseObjects(objects);
+        return ret;
+    }
+    regIndexForget(uuidStr);
+    ret = commitStaged(staged);
+    regIndexUpdate(uuidStr + GP_TA_BIN_FILE_EXT);
+    regIndexUpdate(uuidStr + GP_TA_SPID_FILE_EXT);
+    releaseObjects(objects);
+    if (ret != MC_DRV_OK) {
+        LOG_E("RegistryStoreTABlob failed: %d", ret);
+        return ret;
+    }
+    // Precompose now, so that opening a session needs a single read
+    updateTAOwner(uuidStr);
+    return MC_DRV_OK;
+}
+
+//------------------------------------------------------------------------------
+mcResult_t mcRegistryStoreTABlob(mcSpid_t spid, void *blob, uint32_t size)
+{
+    LOG_I("mcRegistryStoreTABlob started");
+    return storeTABlob(spid, blob, size, NULL);
+}
+
+//------------------------------------------------------------------------------
+mcResult_t mcRegistryOpenTABlobFile(regBlobFile_t *file, uint32_t size)
+{
+    file->fd = -1;
+    file->size = size;
+    file->written = 0;
+    file->data = NULL;
+    file->object = NULL;
+    file->objectLen = 0;
+    file->path[0] = '\0';
+
+    if (size < sizeof(mclfHeaderV24_t)) {
+        LOG_E("RegistryStoreTABlob failed - TA blob length is less then header size");
+        return MC_DRV_ERR_INVALID_PARAMETER;
+    }
+    // Received next to its final location, so that storing is a rename
+    snprintf(file->path, sizeof(file->path), "%s/incoming%s%u", MC_REGISTRY_DATA_PATH,
+             STAGED_FILE_EXT, __sync_fetch_and_add(&regStageCount, 1));
+    file->fd = open(file->path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (file->fd == -1) {
+        LOG_ERRNO("open");
+        file->path[0] = '\0';
         return MC_DRV_ERR_INVALID_DEVICE_FILE;
     }
-    res = fseek(fs, 0, SEEK_SET);
-    if (res!=0) {
-        LOG_E("RegistryStoreTABlob failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
-        fclose(fs);
+    return MC_DRV_OK;
+}
+
+//------------------------------------------------------------------------------
+mcResult_t mcRegistryWriteTABlobFile(regBlobFile_t *file, const void *data, uint32_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    if (file->fd == -1 || len > file->size - file->written) {
         return MC_DRV_ERR_INVALID_PARAMETER;
     }
-    fwrite(blob, 1, size, fs);
-    if (ferror(fs)) {
-        LOG_E("RegistryStoreTABlob failed: %d", MC_DRV_ERR_OUT_OF_RESOURCES);
-        fclose(fs);
+    while (len > 0) {
+        ssize_t ret = write(file->fd, p, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            LOG_ERRNO("write");
+            return MC_DRV_ERR_OUT_OF_RESOURCES;
+        }
+        p += ret;
+        len -= ret;
+        file->written += ret;
+    }
+    return MC_DRV_OK;
+}
+
+//------------------------------------------------------------------------------
+mcResult_t mcRegistryMapTABlobFile(regBlobFile_t *file)
+{
+    if (file->fd == -1 || file->written != file->size) {
+        LOG_E("TA blob incomplete: %u of %u bytes", file->written, file->size);
+        return MC_DRV_ERR_INVALID_PARAMETER;
+    }
+    if (fsync(file->fd) != 0) {
+        LOG_ERRNO("fsync");
         return MC_DRV_ERR_OUT_OF_RESOURCES;
     }
-    fflush(fs);
-    fclose(fs);
+    void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+    if (data == MAP_FAILED) {
+        LOG_ERRNO("mmap");
+        return MC_DRV_ERR_NO_FREE_MEMORY;
+    }
+    file->data = data;
+    return MC_DRV_OK;
+}
 
-    if (header20->serviceType == SERVICE_TYPE_SP_TRUSTLET) {
-        const string taspidFilePath = getTASpidFilePath((mcUuid_t *)&uuid, MC_REGISTRY_WRITABLE);
+//------------------------------------------------------------------------------
+mcResult_t mcRegistryStoreTABlobFile(mcSpid_t spid, regBlobFile_t *file)
+{
+    LOG_I("mcRegistryStoreTABlobFile started");
+    if (file->data == NULL) {
+        return MC_DRV_ERR_INVALID_PARAMETER;
+    }
+    mcResult_t ret = storeTABlob(spid, file->data, file->size, file->path);
+    file->path[0] = '\0';
+    return ret;
+}
 
-        LOG_I("Store spid file at: %s", taspidFilePath.c_str());
+//------------------------------------------------------------------------------
+void mcRegistryCloseTABlobFile(regBlobFile_t *file)
+{
+    if (file->object != NULL) {
+        munmap(file->object, file->objectLen);
+        file->object = NULL;
+    }
+    if (file->data != NULL) {
+        munmap(file->data, file->size);
+        file->data = NULL;
+    }
+    if (file->fd != -1) {
+        close(file->fd);
+        file->fd = -1;
+    }
+    if (file->path[0] != '\0') {
+        remove(file->path);
+        file->path[0] = '\0';
+    }
+}
 
-        FILE *fs = fopen(taspidFilePath.c_str(), "wb");
-        if (fs==NULL) {
-            //TODO: shouldn't we delete TA blob file ?
-            LOG_E("RegistryStoreTABlob failed - TA blob file open error: %d", MC_DRV_ERR_INVALID_DEVICE_FILE);
-            return MC_DRV_ERR_INVALID_DEVICE_FILE;
-        }
-        res = fseek(fs, 0, SEEK_SET);
-        if (res!=0) {
-            LOG_E("RegistryStoreTABlob failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
-            fclose(fs);
+//------------------------------------------------------------------------------
+static mcResult_t stageBatchItem(vector<regStagedFile_t> &staged, vector<string> &touched,
+                                 mcRegistryBatchItem_t *item)
+{
+    if (item->so == NULL) {
+        return MC_DRV_ERR_INVALID_PARAMETER;
+    }
+    if (item->type != MC_REG_ITEM_TA_BLOB && item->size > 3 * MAX_SO_CONT_SIZE) {
+        return MC_DRV_ERR_INVALID_PARAMETER;
+    }
+
+    switch (item->type) {
+    case MC_REG_ITEM_AUTH_TOKEN:
+        return stageFile(staged, getAuthTokenFilePath(), item->so, item->size);
+    case MC_REG_ITEM_ROOT_CONT:
+        return stageFile(staged, getRootContFilePath(), item->so, item->size);
+    case MC_REG_ITEM_SP_CONT:
+        if (item->spid == 0) {
             return MC_DRV_ERR_INVALID_PARAMETER;
         }
-        fwrite(&spid, 1, sizeof(mcSpid_t), fs);
-        if (ferror(fs)) {
-            LOG_E("RegistryStoreTABlob failed: %d", MC_DRV_ERR_OUT_OF_RESOURCES);
-            fclose(fs);
-            return MC_DRV_ERR_OUT_OF_RESOURCES;
+        return stageFile(staged, getSpContFilePath(item->spid), item->so, item->size);
+    case MC_REG_ITEM_TL_CONT:
+        return stageFile(staged, getTlContFilePath(&item->uuid, item->spid), item->so, item->size);
+    case MC_REG_ITEM_TA_BLOB: {
+        mcUuid_t uuid;
+        mcResult_t ret = checkTABlob(item->spid, item->so, item->size, &uuid);
+        if (ret != MC_DRV_OK) {
+            return ret;
         }
-        fflush(fs);
-        fclose(fs);
+        touched.push_back(byteArrayToString(&uuid, sizeof(mcUuid_t)));
+        const string taBinFilePath = getTABinFilePath(&uuid, MC_REGISTRY_WRITABLE);
+        bool unchanged;
+        if (!regContentStore ||
+                stageObjectRef(staged, taBinFilePath, item->so, item->size, NULL, &unchanged) != MC_DRV_OK) {
+            ret = stageFile(staged, taBinFilePath, item->so, item->size, regCompress);
+        }
+        if (ret != MC_DRV_OK) {
+            return ret;
+        }
+        if (((mclfHeaderV2_t *)item->so)->serviceType != SERVICE_TYPE_SP_TRUSTLET) {
+            return MC_DRV_OK;
+        }
+        return stageFile(staged, getTASpidFilePath(&uuid, MC_REGISTRY_WRITABLE),
+                         &item->spid, sizeof(mcSpid_t));
     }
-    return MC_DRV_OK;
+    default:
+        return MC_DRV_ERR_INVALID_PARAMETER;
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Updates TA owners and rebuilds the TA images depending on the items of a
+ * committed batch. */
+static void updateBatchImages(const mcRegistryBatchItem_t *items, uint32_t count,
+                              const vector<string> &touched)
+{
+    set<mcSpid_t> spids;
+
+    for (size_t i = 0; i < touched.size(); i++) {
+        updateTAOwner(touched[i]);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (items[i].type == MC_REG_ITEM_ROOT_CONT) {
+            updateServiceImages(0);
+            return;
+        }
+        if (items[i].type == MC_REG_ITEM_SP_CONT || items[i].type == MC_REG_ITEM_TL_CONT) {
+            spids.insert(items[i].spid);
+        }
+    }
+    for (set<mcSpid_t>::iterator it = spids.begin(); it != spids.end(); it++) {
+        updateServiceImages(*it);
+    }
+}
+
+//------------------------------------------------------------------------------
+mcResult_t mcRegistryStoreBatch(mcRegistryBatchItem_t *items, uint32_t count)
+{
+    vector<regStagedFile_t> staged;
+    vector<string> touched;
+    mcResult_t ret = MC_DRV_OK;
+    uint32_t i;
+
+    if (items == NULL || count == 0 || count > MC_REG_BATCH_MAX) {
+        LOG_E("mcRegistry store batch failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
+        return MC_DRV_ERR_INVALID_PARAMETER;
+    }
+    LOG_I("store batch of %u items", count);
+
+    // Write every item to a staged file, nothing is visible yet
+    for (i = 0; i < count; i++) {
+        ret = items[i].result = stageBatchItem(staged, touched, &items[i]);
+        if (ret != MC_DRV_OK) {
+            LOG_E("mcRegistry store batch item %u failed: %d", i, ret);
+            break;
+        }
+    }
+
+    set<ino_t> objects;
+    holdStagedObjects(objects, staged);
+    if (ret != MC_DRV_OK) {
+        // Roll back: items not at fault are reported as not applied
+        discardStaged(staged);
+        releaseObjects(objects);
+        for (uint32_t j = 0; j < count; j++) {
+            if (j != i) {
+                items[j].result = MC_DRV_ERR_INVALID_OPERATION;
+            }
+        }
+        return ret;
+    }
+
+    // Group commit: all data is on disk, publish it
+    ret = commitStaged(staged);
+    for (i = 0; i < touched.size(); i++) {
+        regIndexForget(touched[i]);
+    }
+    updateBatchImages(items, count, touched);
+    releaseObjects(objects);
+    if (ret != MC_DRV_OK) {
+        LOG_E("mcRegistry store batch commit failed: %d", ret);
+        for (i = 0; i < count; i++) {
+            items[i].result = ret;
+        }
+    }
+    return ret;
 }
 
 //------------------------------------------------------------------------------
@@ -741,7 +2143,6 @@ mcResult_t mcRegistryReadTrustletCon(const mcUuid_t *uuid, const mcSpid_t spid,
 mcResult_t mcRegistryStoreData(void *so, uint32_t size)
 {
     mcSoDataCont_t *dataCont = (mcSoDataCont_t *)so;
-    int res = 0;
 
     if (dataCont == NULL || size != sizeof(mcSoDataCont_t)) {
         LOG_E("mcRegistry store So.Data failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
@@ -769,26 +2170,12 @@ mcResult_t mcRegistryStoreData(void *so, uint32_t size)
     }
 
     LOG_I("store DT: %s", filename.c_str());
-
-    FILE *fs = fopen(filename.c_str(), "wb");
-    if (fs==NULL) {
-        LOG_E("mcRegistry store So.Data(cid/pid) failed: %d", MC_DRV_ERR_INVALID_DEVICE_FILE);
-        return MC_DRV_ERR_INVALID_DEVICE_FILE;
-    }
-    res = fseek(fs, 0, SEEK_SET);
-    if (res!=0) {
-        LOG_E("mcRegistry store So.Data(cid/pid) failed: %d", MC_DRV_ERR_INVALID_PARAMETER);
-        fclose(fs);
-        return MC_DRV_ERR_INVALID_PARAMETER;
-    }
-    fwrite((char *)dataCont, 1, MC_SO_SIZE(dataCont->soHeader.plainLen, dataCont->soHeader.encryptedLen), fs);
-    if (ferror(fs)) {
-        LOG_E("mcRegistry store So.Data(cid/pid) failed: %d", MC_DRV_ERR_OUT_OF_RESOURCES);
-        fclose(fs);
-        return MC_DRV_ERR_OUT_OF_RESOURCES;
+
+    mcResult_t ret = storeFile(filename, (char *)dataCont, MC_SO_SIZE(dataCont->soHeader.plainLen, dataCont->soHeader.encryptedLen));
+    if (ret != MC_DRV_OK) {
+        LOG_E("mcRegistry store So.Data(cid/pid) failed: %d", ret);
+        return ret;
     }
-    fflush(fs);
-    fclose(fs);
 
     return MC_DRV_OK;
 }
@@ -882,151 +2269,204 @@ mcResult_t mcRegistryReadData(uint32_t context, const mcCid_t *cid, mcPid_t pid,
 
 
 //------------------------------------------------------------------------------
-static size_t getFileContent(
-    const char *pPath,
-    uint8_t **ppContent)
+static bool mcCheckUuid(const mcUuid_t *uuid, const char *filename)
 {
-    FILE   *pStream;
-    long    filesize;
-    uint8_t *content = NULL;
-    int res = 0;
+    mclfHeaderV24_t header;
+    regZHeader_t zHeader;
+    regBinReader_t r;
 
-    /* Open the file */
-    pStream = fopen(pPath, "rb");
-    if (pStream == NULL) {
-        LOG_E("Error: Cannot open file: %s.", pPath);
-        return 0;
+    // The header is all we need, not the whole TA
+    if (!openBinary(&r, filename, &zHeader)) {
+        LOG_E("err: Trusted Application not found.");
+        return false;
     }
+    uint32_t len = readBinary(&r, &header, sizeof(header));
+    closeBinary(&r);
 
-    if (fseek(pStream, 0L, SEEK_END) != 0) {
-        LOG_E("Error: Cannot read file: %s.", pPath);
-        goto error;
+    // Check blob size
+    if (len != sizeof(header)) {
+        LOG_E("RegistryStoreTABlob failed - TA blob length is less then header size");
+        return false;
     }
 
-    filesize = ftell(pStream);
-    if (filesize < 0) {
-        LOG_E("Error: Cannot get the file size: %s.", pPath);
-        goto error;
-    }
+    mclfHeaderV2_t *header20 = (mclfHeaderV2_t *)&header;
 
-    if (filesize == 0) {
-        LOG_E("Error: Empty file: %s.", pPath);
-        goto error;
+    // Check header version
+    if (header20->intro.version < MC_MAKE_VERSION(2, 4)) {
+        LOG_E("RegistryStoreTABlob failed - TA blob header version is less than 2.4");
+        return false;
     }
 
-    /* Set the file pointer at the beginning of the file */
-    if (fseek(pStream, 0L, SEEK_SET) != 0) {
-        LOG_E("Error: Cannot read file: %s.", pPath);
-        goto error;
-    }
+    return memcmp(uuid, &header20->uuid, sizeof(mcUuid_t)) == 0;
+}
 
-    /* Allocate a buffer for the content */
-    content = (uint8_t *)malloc(filesize);
-    if (content == NULL) {
-        LOG_E("Error: Cannot read file: Out of memory.");
-        goto error;
-    }
+//------------------------------------------------------------------------------
+/** Removes a directory tree. */
+static bool removeTree(const string &path)
+{
+    struct dirent *de;
+    struct stat ss;
 
-    /* Read data from the file into the buffer */
-    res = fread(content, (size_t)filesize, 1, pStream);
-    if (ferror(pStream)) {
-        LOG_E("Error: Cannot read file: %s.", pPath);
-        goto error;
-    }
-    if ((unsigned)res<1) {
-        //File is shorter than expected
-        if (feof(pStream)) {
-            LOG_E("Error: EOF reached: %s.", pPath);
+    DIR *dp = opendir(path.c_str());
+    if (dp != NULL) {
+        while ((de = readdir(dp)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+            string name = path + "/" + de->d_name;
+            if (lstat(name.c_str(), &ss) == 0 && S_ISDIR(ss.st_mode)) {
+                removeTree(name);
+            } else if (unlink(name.c_str()) != 0) {
+                LOG_ERRNO("unlink");
+            }
         }
-        goto error;
+        closedir(dp);
+    }
+    if (rmdir(path.c_str()) != 0) {
+        LOG_ERRNO("rmdir");
+        return false;
     }
+    return true;
+}
 
-    /* Close the file */
-    fclose(pStream);
-    *ppContent = content;
+/** Tombstones: deleted directories are renamed below TOMBSTONE_PATH, which
+ * removes them from the registry at once, and a reaper thread removes their
+ * contents in the background, at the lowest CPU and I/O priority so that it
+ * does not hold up FSD and registry requests. Tombstones left behind by a
+ * previous run are reaped the next time the reaper is woken. */
+static pthread_mutex_t regReaperMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t regReaperCond = PTHREAD_COND_INITIALIZER;
+static bool regReaperStarted = false;
+static bool regReaperPending = false;
+static uint32_t regTombstoneCount = 0;
+/** Bumped by every deletion of GP TA storage, see mcRegistryStorageGeneration(). */
+static uint32_t regStorageGeneration = 0;
 
-    /* Return number of bytes read */
-    return (size_t)filesize;
+//------------------------------------------------------------------------------
+static void reapTombstones(void)
+{
+    vector<string> names;
+    struct dirent *de;
 
-error:
-    if (content  != NULL) {
-        free(content);
+    DIR *dp = opendir(TOMBSTONE_PATH);
+    if (dp == NULL) {
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+            names.push_back(de->d_name);
+        }
+    }
+    closedir(dp);
+    for (size_t i = 0; i < names.size(); i++) {
+        LOG_I("reap tombstone %s", names[i].c_str());
+        removeTree(TOMBSTONE_PATH "/" + names[i]);
     }
-    fclose(pStream);
-    return 0;
 }
 
 //------------------------------------------------------------------------------
-static bool mcCheckUuid(const mcUuid_t *uuid, const char *filename)
+static void *reaperThread(void *)
 {
-    uint8_t    *pTAData = NULL;
-    uint32_t    nTASize;
-    bool        res;
-
-    nTASize = getFileContent(filename, &pTAData);
-    if (nTASize == 0) {
-        LOG_E("err: Trusted Application not found.");
-        return false;
+    // Both priorities apply to the calling thread only
+    pid_t tid = syscall(__NR_gettid);
+    if (setpriority(PRIO_PROCESS, tid, TOMBSTONE_NICE) != 0) {
+        LOG_ERRNO("setpriority");
     }
-
-    // Check blob size
-    if (nTASize < sizeof(mclfHeaderV24_t)) {
-        free(pTAData);
-        LOG_E("RegistryStoreTABlob failed - TA blob length is less then header size");
-        return false;
+#ifdef __NR_ioprio_set
+    if (syscall(__NR_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, tid, TOMBSTONE_IOPRIO) != 0) {
+        LOG_ERRNO("ioprio_set");
     }
+#endif
 
-    mclfHeaderV2_t *header20 = (mclfHeaderV2_t *)pTAData;
+    pthread_mutex_lock(&regReaperMutex);
+    for (;;) {
+        while (!regReaperPending) {
+            pthread_cond_wait(&regReaperCond, &regReaperMutex);
+        }
+        regReaperPending = false;
+        pthread_mutex_unlock(&regReaperMutex);
+        reapTombstones();
+        pthread_mutex_lock(&regReaperMutex);
+    }
+    return NULL;
+}
 
-    // Check header version
-    if (header20->intro.version < MC_MAKE_VERSION(2, 4)) {
-        free(pTAData);
-        LOG_E("RegistryStoreTABlob failed - TA blob header version is less than 2.4");
-        return false;
+//------------------------------------------------------------------------------
+void mcRegistryReapTombstones(void)
+{
+    bool started;
+
+    pthread_mutex_lock(&regReaperMutex);
+    if (!regReaperStarted) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, reaperThread, NULL) == 0) {
+            pthread_detach(thread);
+            regReaperStarted = true;
+        } else {
+            LOG_ERRNO("pthread_create");
+        }
     }
+    regReaperPending = true;
+    started = regReaperStarted;
+    pthread_cond_signal(&regReaperCond);
+    pthread_mutex_unlock(&regReaperMutex);
 
-    // Check blob size
-    if (memcmp(uuid, &header20->uuid, sizeof(mcUuid_t)) == 0) {
-        res = true;
-    } else {
-        res = false;
+    if (!started) {
+        reapTombstones();
     }
+}
 
-    free(pTAData);
+//------------------------------------------------------------------------------
+/** Deletes a directory tree, leaving the actual removal to the reaper.
+ * @return true if the directory is gone or did not exist. */
+static bool buryDir(const string &path)
+{
+    char name[32];
 
-    return res;
+    if (!doesDirExist(path.c_str())) {
+        return true;
+    }
+    if (mkdir(TOMBSTONE_PATH, 0700) != 0 && errno != EEXIST) {
+        LOG_ERRNO("mkdir");
+        return removeTree(path);
+    }
+    // Names restart with the daemon, skip those of tombstones not reaped yet
+    for (;;) {
+        snprintf(name, sizeof(name), "/%lx.%u", (unsigned long)time(NULL),
+                 __sync_fetch_and_add(&regTombstoneCount, 1));
+        if (rename(path.c_str(), (TOMBSTONE_PATH + string(name)).c_str()) == 0) {
+            break;
+        }
+        if (errno != EEXIST && errno != ENOTEMPTY) {
+            LOG_ERRNO("rename");
+            return removeTree(path);
+        }
+    }
+    LOG_I("delete dir: %s", path.c_str());
+    mcRegistryReapTombstones();
+    return true;
 }
 
 //this function deletes all the files owned by a GP TA and stored in the tbase secure storage dir.
 //then it deletes GP TA folder.
 static int CleanupGPTAStorage(const char *uuid)
 {
-	DIR            *dp;
-	struct dirent  *de;
-	int             e;
 	string TAPath = getTbStoragePath() + "/" + uuid;
-	if (NULL != (dp = opendir(TAPath.c_str()))) {
-		while (NULL != (de = readdir(dp))) {
-			if (de->d_name[0] != '.') {
-				string dname = TAPath + "/" + string (de->d_name);
-				LOG_I("delete DT: %s", dname.c_str());
-				if (0 != (e = remove(dname.c_str()))) {
-					LOG_E("remove UUID-files %s failed! error: %d", dname.c_str(), e);
-				}
-			}
-		}
-		if (dp) {
-			closedir(dp);
-		}
-		LOG_I("delete dir: %s", TAPath.c_str());
-		if (0 != (e = rmdir(TAPath.c_str()))) {
-			LOG_E("remove UUID-dir failed! errno: %d", e);
-			return e;
-		}
+	bool buried = buryDir(TAPath);
+	__sync_fetch_and_add(&regStorageGeneration, 1);
+	if (!buried) {
+		LOG_E("remove UUID-dir %s failed!", TAPath.c_str());
+		return -1;
 	}
 	return MC_DRV_OK;
 }
 
+//------------------------------------------------------------------------------
+uint32_t mcRegistryStorageGeneration(void)
+{
+    return regStorageGeneration;
+}
+
 
 mcResult_t mcRegistryCleanupGPTAStorage(mcUuid_t *uuid)
 {
@@ -1035,68 +2475,55 @@ mcResult_t mcRegistryCleanupGPTAStorage(mcUuid_t *uuid)
 
 static void deleteSPTA(const mcUuid_t *uuid, const mcSpid_t spid)
 {
-    DIR            *dp;
-    struct dirent  *de;
+    vector<string> owned;
     int             e;
 
-    // Delete TABIN and SPID files - we loop searching required spid file
-    if (NULL != (dp = opendir(MC_REGISTRY_DATA_PATH))) {
-        while (NULL != (de = readdir(dp))) {
-            string spidFile;
-            string tabinFile;
-            string tabinUuid;
-            size_t pch_dot, pch_slash;
-            spidFile = MC_REGISTRY_DATA_PATH "/" + string(de->d_name);
-            pch_dot = spidFile.find_last_of('.');
-            if (pch_dot == string::npos) continue;
-            pch_slash = spidFile.find_last_of('/');
-            if ((pch_slash != string::npos) && (pch_slash > pch_dot))  continue;
-            if (spidFile.substr(pch_dot).compare(GP_TA_SPID_FILE_EXT) != 0) continue;
-
-            mcSpid_t curSpid = 0;
-
-            int fd = open(spidFile.c_str(), O_RDONLY);
-            if (fd != -1) {
-                if (read(fd, &curSpid, sizeof(mcSpid_t))!=sizeof(mcSpid_t)) {
-                    curSpid = 0;
-                }
-                close(fd);
-            }
-            if (spid == curSpid) {
-                tabinFile =  spidFile.substr(0, pch_dot) + GP_TA_BIN_FILE_EXT;
-                if (mcCheckUuid(uuid, tabinFile.c_str())) {
-                	tabinUuid = spidFile.substr(0, pch_dot);
-                	tabinUuid = tabinUuid.substr(tabinUuid.find_last_of('/')+1);
-                	LOG_I("Remove TA storage %s", tabinUuid.c_str());
-                	if (0 != (e = CleanupGPTAStorage(tabinUuid.c_str()))){
-                		LOG_E("Remove TA storage failed! errno: %d", e);
-                		/* Discard error */
-                	}
-                	LOG_I("Remove TA file %s", tabinFile.c_str());
-                    if (0 != (e = remove(tabinFile.c_str()))) {
-                        LOG_E("Remove TA file failed! errno: %d", e);
-                        /* Discard error */
-                    }
-                    LOG_I("Remove spid file %s", spidFile.c_str());
-                    if (0 != (e = remove(spidFile.c_str()))) {
-                        LOG_E("Remove spid file failed! errno: %d", e);
-                        /* Discard error */
-                    }
-                    break;
-                }
-            }
+    // Only look at the TAs of this SP, the one named after uuid first
+    const string uuidStr = byteArrayToString(uuid, sizeof(*uuid));
+    regOwnersList(spid, owned);
+    for (size_t i = 1; i < owned.size(); i++) {
+        if (owned[i] == uuidStr) {
+            owned[i] = owned[0];
+            owned[0] = uuidStr;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < owned.size(); i++) {
+        string tabinUuid = owned[i];
+        string tabinFile = MC_REGISTRY_DATA_PATH "/" + tabinUuid + GP_TA_BIN_FILE_EXT;
+        string spidFile = MC_REGISTRY_DATA_PATH "/" + tabinUuid + GP_TA_SPID_FILE_EXT;
+        if (!mcCheckUuid(uuid, tabinFile.c_str())) {
+            continue;
+        }
+        LOG_I("Remove TA storage %s", tabinUuid.c_str());
+        if (0 != (e = CleanupGPTAStorage(tabinUuid.c_str()))){
+            LOG_E("Remove TA storage failed! errno: %d", e);
+            /* Discard error */
+        }
+        set<ino_t> objects;
+        holdObject(objects, tabinFile);
+        LOG_I("Remove TA file %s", tabinFile.c_str());
+        if (0 != (e = remove(tabinFile.c_str()))) {
+            LOG_E("Remove TA file failed! errno: %d", e);
+            /* Discard error */
         }
-        if (dp) {
-            closedir(dp);
+        LOG_I("Remove spid file %s", spidFile.c_str());
+        if (0 != (e = remove(spidFile.c_str()))) {
+            LOG_E("Remove spid file failed! errno: %d", e);
+            /* Discard error */
         }
+        remove(getTAImgFilePath(tabinUuid, spid).c_str());
+        regIndexForget(tabinUuid);
+        regOwnersUpdate(tabinUuid);
+        releaseObjects(objects);
+        break;
     }
 }
 
 //------------------------------------------------------------------------------
 mcResult_t mcRegistryCleanupTrustlet(const mcUuid_t *uuid, const mcSpid_t spid)
 {
-    DIR            *dp;
-    struct dirent  *de;
     int             e;
 
     if (NULL == uuid) {
@@ -1106,24 +2533,9 @@ mcResult_t mcRegistryCleanupTrustlet(const mcUuid_t *uuid, const mcSpid_t spid)
 
     // Delete all TA related data
     string pathname = getTlDataPath(uuid);
-    if (NULL != (dp = opendir(pathname.c_str()))) {
-        while (NULL != (de = readdir(dp))) {
-            if (de->d_name[0] != '.') {
-                string dname = pathname + "/" + string (de->d_name);
-                LOG_I("delete DT: %s", dname.c_str());
-                if (0 != (e = remove(dname.c_str()))) {
-                    LOG_E("remove UUID-data %s failed! error: %d", dname.c_str(), e);
-                }
-            }
-        }
-        if (dp) {
-            closedir(dp);
-        }
-        LOG_I("delete dir: %s", pathname.c_str());
-        if (0 != (e = rmdir(pathname.c_str()))) {
-            LOG_E("remove UUID-dir failed! errno: %d", e);
-            return MC_DRV_ERR_UNKNOWN;
-        }
+    if (!buryDir(pathname)) {
+        LOG_E("remove UUID-dir failed!");
+        return MC_DRV_ERR_UNKNOWN;
     }
 
     string tlBinFilePath = getTlBinFilePath(uuid, MC_REGISTRY_WRITABLE);
@@ -1136,13 +2548,16 @@ mcResult_t mcRegistryCleanupTrustlet(const mcUuid_t *uuid, const mcSpid_t spid)
         if (0 != (e = remove(tlBinFilePath.c_str()))) {
             LOG_E("Remove TA file failed! errno: %d", e);
         }
+        regIndexForget(byteArrayToString(uuid, sizeof(*uuid)));
     } else {
         /* GP TA */
         deleteSPTA(uuid, spid);
     }
 
     LOG_I("Remove TA container %s", tlContFilePath.c_str());
-    if (0 != (e = remove(tlContFilePath.c_str()))) {
+    e = remove(tlContFilePath.c_str());
+    updateServiceImages(spid);
+    if (0 != e) {
         LOG_E("Remove TA container failed! errno: %d", e);
         return MC_DRV_ERR_UNKNOWN;
     }
@@ -1154,8 +2569,6 @@ mcResult_t mcRegistryCleanupTrustlet(const mcUuid_t *uuid, const mcSpid_t spid)
 //------------------------------------------------------------------------------
 mcResult_t mcRegistryCleanupSp(mcSpid_t spid)
 {
-    DIR *dp;
-    struct dirent  *de;
     mcResult_t ret;
     mcSoSpCont_t data;
     uint32_t i, len;
@@ -1182,29 +2595,15 @@ mcResult_t mcRegistryCleanupSp(mcSpid_t spid)
     }
 
     string pathname = getSpDataPath(spid);
-
-    if (NULL != (dp = opendir(pathname.c_str()))) {
-        while (NULL != (de = readdir(dp))) {
-            if (de->d_name[0] != '.') {
-                string dname = pathname + "/" + string (de->d_name);
-                LOG_I("delete DT: %s", dname.c_str());
-                if (0 != (e = remove(dname.c_str()))) {
-                    LOG_E("remove SPID-data %s failed! error: %d", dname.c_str(), e);
-                }
-            }
-        }
-        if (dp) {
-            closedir(dp);
-        }
-        LOG_I("delete dir: %s", pathname.c_str());
-        if (0 != (e = rmdir(pathname.c_str()))) {
-            LOG_E("remove SPID-dir failed! error: %d", e);
-            return MC_DRV_ERR_UNKNOWN;
-        }
+    if (!buryDir(pathname)) {
+        LOG_E("remove SPID-dir failed!");
+        return MC_DRV_ERR_UNKNOWN;
     }
     string spContFilePath = getSpContFilePath(spid);
     LOG_I("delete Sp: %s", spContFilePath.c_str());
-    if (0 != (e = remove(spContFilePath.c_str()))) {
+    e = remove(spContFilePath.c_str());
+    updateServiceImages(spid);
+    if (0 != e) {
         LOG_E("remove SP failed! error: %d", e);
         return MC_DRV_ERR_UNKNOWN;
     }
@@ -1238,7 +2637,9 @@ mcResult_t mcRegistryCleanupRoot(void)
 
     string rootContFilePath = getRootContFilePath();
     LOG_I("Delete root: %s", rootContFilePath.c_str());
-    if (0 != (e = remove(rootContFilePath.c_str()))) {
+    e = remove(rootContFilePath.c_str());
+    updateServiceImages(0);
+    if (0 != e) {
         LOG_E("Delete root failed! error: %d", e);
         return MC_DRV_ERR_UNKNOWN;
     }
@@ -1246,40 +2647,42 @@ mcResult_t mcRegistryCleanupRoot(void)
 }
 
 //------------------------------------------------------------------------------
-regObject_t *mcRegistryMemGetServiceBlob(mcSpid_t spid, void *trustlet, uint32_t tlSize)
+/** Checks the MCLF header of a TA blob before a registry object is built for it. */
+static bool checkServiceHeader(const void *trustlet, uint32_t tlSize)
 {
-    regObject_t *regobj = NULL;
-
-    // Ensure that a UUID is provided.
-    if (NULL == trustlet) {
-        LOG_E("No trustlet buffer given");
-        return NULL;
+    if (tlSize < sizeof(mclfHeaderV2_t)) {
+        LOG_E("TA blob of %u bytes is shorter than its header", tlSize);
+        return false;
     }
-
-    mclfIntro_t *pIntro = (mclfIntro_t *)trustlet;
+    const mclfIntro_t *pIntro = (const mclfIntro_t *)trustlet;
     // Check TL magic value.
     if (pIntro->magic != MC_SERVICE_HEADER_MAGIC_BE) {
-        LOG_E("mcRegistryMemGetServiceBlob() failed: wrong header magic value: %d", pIntro->magic);
-        return NULL;
+        LOG_E("TA blob has wrong header magic value: %d", pIntro->magic);
+        return false;
     }
-
-    // Get service type.
-    mclfHeaderV2_t *pHeader = (mclfHeaderV2_t *)trustlet;
-#ifndef NDEBUG
-    {
-        const char *service_types[] = {
-            "illegal", "Driver", "Trustlet", "System Trustlet", "Middleware"
-        };
-        int serviceType_safe = pHeader->serviceType > SERVICE_TYPE_MIDDLEWARE ? SERVICE_TYPE_ILLEGAL : pHeader->serviceType;
-        LOG_I(" Service is a %s (service type %d)", service_types[serviceType_safe], pHeader->serviceType);
+    if (MC_GET_MAJOR_VERSION(pIntro->version) != MCLF_VERSION_MAJOR) {
+        LOG_E("TA blob has unsupported header version %08X", pIntro->version);
+        return false;
     }
-#endif
+    return true;
+}
 
-    LOG_I(" Trustlet text %u data %u ", pHeader->text.len, pHeader->data.len);
+//------------------------------------------------------------------------------
+/** Allocates a registry object for a TA of the given service type, with room
+ * for the containers of SP TAs. The TA goes at regobj->tlStartOffset. */
+static regObject_t *allocServiceBlob(uint32_t serviceType, uint32_t tlSize)
+{
+    regObject_t *regobj = NULL;
+
+    // regobj->len is 32 bits wide, and so may be size_t
+    if (tlSize > (uint32_t)-1 - sizeof(regObject_t) - sizeof(mcBlobLenInfo_t) - 3 * MAX_SO_CONT_SIZE) {
+        LOG_E("mcRegistryMemGetServiceBlob() failed: TA blob too large (%u bytes)", tlSize);
+        return NULL;
+    }
 
     // If loadable driver or system trustlet.
-    if (pHeader->serviceType == SERVICE_TYPE_DRIVER  || pHeader->serviceType == SERVICE_TYPE_MIDDLEWARE  ||
-	pHeader->serviceType == SERVICE_TYPE_SYSTEM_TRUSTLET) {
+    if (serviceType == SERVICE_TYPE_DRIVER  || serviceType == SERVICE_TYPE_MIDDLEWARE  ||
+	serviceType == SERVICE_TYPE_SYSTEM_TRUSTLET) {
         // Take trustlet blob 'as is'.
         if (NULL == (regobj = (regObject_t *) (malloc(sizeof(regObject_t) + tlSize)))) {
             LOG_E("mcRegistryMemGetServiceBlob() failed: Out of memory");
@@ -1287,9 +2690,8 @@ regObject_t *mcRegistryMemGetServiceBlob(mcSpid_t spid, void *trustlet, uint32_t
         }
         regobj->len = tlSize;
         regobj->tlStartOffset = 0;
-        memcpy((char *)regobj->value, trustlet, tlSize);
         // If user trustlet.
-    } else if (pHeader->serviceType == SERVICE_TYPE_SP_TRUSTLET) {
+    } else if (serviceType == SERVICE_TYPE_SP_TRUSTLET) {
         // Take trustlet blob and append root, sp, and tl container.
         size_t regObjValueSize = tlSize + sizeof(mcBlobLenInfo_t) + 3 * MAX_SO_CONT_SIZE;
 
@@ -1300,91 +2702,265 @@ regObject_t *mcRegistryMemGetServiceBlob(mcSpid_t spid, void *trustlet, uint32_t
         }
         regobj->len = regObjValueSize;
         regobj->tlStartOffset = sizeof(mcBlobLenInfo_t);
-        uint8_t *p = regobj->value;
 
         // Reserve space for the blob length structure
-        mcBlobLenInfo_ptr lenInfo = (mcBlobLenInfo_ptr)p;
+        mcBlobLenInfo_ptr lenInfo = (mcBlobLenInfo_ptr)regobj->value;
         lenInfo->magic = MC_TLBLOBLEN_MAGIC;
-        p += sizeof(mcBlobLenInfo_t);
-        // Fill in trustlet blob after the len info
-        memcpy(p, trustlet, tlSize);
-        p += tlSize;
-
-        // Final registry object value looks like this:
-        //
-        //    +---------------+---------------------------+-----------+---------+---------+
-        //    | Blob Len Info | TL-Header TL-Code TL-Data | Root Cont | SP Cont | TL Cont |
-        //    +---------------+---------------------------+-----------+-------------------+
-        //                    /------ Trustlet BLOB ------/
-        //
-        //    /------------------ regobj->header.len -------------------------------------/
-
-        // start at the end of the trustlet blob
-        mcResult_t ret;
-        do {
-            uint32_t soTltContSize = MAX_SO_CONT_SIZE;
-            uint32_t len;
+        // Any other service type.
+    } else {
+        LOG_E("mcRegistryMemGetServiceBlob() failed: Unsupported service type %u", serviceType);
+    }
+    return regobj;
+}
 
-            // Fill in root container.
-            len = sizeof(mcSoRootCont_t);
-            if (MC_DRV_OK != (ret = mcRegistryReadRoot(p, &len))) {
-                break;
-            }
-            lenInfo->rootContBlobSize = len;
-            p += len;
+//------------------------------------------------------------------------------
+/** Appends the containers to a registry object holding an SP TA, in the
+ * 3 * MAX_SO_CONT_SIZE bytes following the TA blob.
+ * @return false on failure. */
+static bool appendContainers(regObject_t *regobj, mcSpid_t spid, uint32_t tlSize)
+{
+    if (regobj->tlStartOffset == 0) {
+        return true;
+    }
 
-            // Fill in SP container.
-            len = sizeof(mcSoSpCont_t);
-            if (MC_DRV_OK != (ret = mcRegistryReadSp(spid, p, &len))) {
-                break;
-            }
-            lenInfo->spContBlobSize = len;
-            p += len;
-
-            // Fill in TLT Container
-            // We know exactly how much space is left in the buffer
-            soTltContSize = regObjValueSize - tlSize + sizeof(mcBlobLenInfo_t)
-                            - lenInfo->spContBlobSize - lenInfo->rootContBlobSize;
-            if (MC_DRV_OK != (ret = mcRegistryReadTrustletCon(&pHeader->uuid, spid, p, &soTltContSize))) {
-                break;
-            }
-            lenInfo->tlContBlobSize = soTltContSize;
-            LOG_I(" Trustlet container %u bytes loaded", soTltContSize);
-            // Depending on the trustlet container size we decide which structure to use
-            // Unfortunate design but it should have to do for now
-            if (soTltContSize == sizeof(mcSoTltCont_2_0_t)) {
-                LOG_I(" Using 2.0 trustlet container");
-            } else if (soTltContSize == sizeof(mcSoTltCont_2_1_t)) {
-                LOG_I(" Using 2.1 trustlet container");
-            } else {
-                LOG_E("Trustlet container has unknown size");
-                break;
-            }
-        } while (false);
+    size_t regObjValueSize = regobj->len;
+    mcBlobLenInfo_ptr lenInfo = (mcBlobLenInfo_ptr)regobj->value;
+    mclfHeaderV2_t *pHeader = (mclfHeaderV2_t *)(regobj->value + regobj->tlStartOffset);
+    uint8_t *p = regobj->value + regobj->tlStartOffset + tlSize;
 
-        if (MC_DRV_OK != ret) {
-            LOG_E("mcRegistryMemGetServiceBlob() failed: Error code: %d", ret);
-            free(regobj);
-            return NULL;
+    // Final registry object value looks like this:
+    //
+    //    +---------------+---------------------------+-----------+---------+---------+
+    //    | Blob Len Info | TL-Header TL-Code TL-Data | Root Cont | SP Cont | TL Cont |
+    //    +---------------+---------------------------+-----------+-------------------+
+    //                    /------ Trustlet BLOB ------/
+    //
+    //    /------------------ regobj->header.len -------------------------------------/
+
+    // start at the end of the trustlet blob
+    mcResult_t ret;
+    do {
+        uint32_t soTltContSize = MAX_SO_CONT_SIZE;
+        uint32_t len;
+
+        // Fill in root container.
+        len = sizeof(mcSoRootCont_t);
+        if (MC_DRV_OK != (ret = mcRegistryReadRoot(p, &len))) {
+            break;
         }
-        // Now we know the sizes for all containers so set the correct size
-        regobj->len = sizeof(mcBlobLenInfo_t) + tlSize +
-                      lenInfo->rootContBlobSize +
-                      lenInfo->spContBlobSize +
-                      lenInfo->tlContBlobSize;
-        // Any other service type.
+        lenInfo->rootContBlobSize = len;
+        p += len;
+
+        // Fill in SP container.
+        len = sizeof(mcSoSpCont_t);
+        if (MC_DRV_OK != (ret = mcRegistryReadSp(spid, p, &len))) {
+            break;
+        }
+        lenInfo->spContBlobSize = len;
+        p += len;
+
+        // Fill in TLT Container
+        // We know exactly how much space is left in the buffer
+        soTltContSize = regObjValueSize - tlSize + sizeof(mcBlobLenInfo_t)
+                        - lenInfo->spContBlobSize - lenInfo->rootContBlobSize;
+        if (MC_DRV_OK != (ret = mcRegistryReadTrustletCon(&pHeader->uuid, spid, p, &soTltContSize))) {
+            break;
+        }
+        lenInfo->tlContBlobSize = soTltContSize;
+        LOG_I(" Trustlet container %u bytes loaded", soTltContSize);
+        // Depending on the trustlet container size we decide which structure to use
+        // Unfortunate design but it should have to do for now
+        if (soTltContSize == sizeof(mcSoTltCont_2_0_t)) {
+            LOG_I(" Using 2.0 trustlet container");
+        } else if (soTltContSize == sizeof(mcSoTltCont_2_1_t)) {
+            LOG_I(" Using 2.1 trustlet container");
+        } else {
+            LOG_E("Trustlet container has unknown size");
+            break;
+        }
+    } while (false);
+
+    if (MC_DRV_OK != ret) {
+        LOG_E("mcRegistryMemGetServiceBlob() failed: Error code: %d", ret);
+        return false;
+    }
+    // Now we know the sizes for all containers so set the correct size
+    regobj->len = sizeof(mcBlobLenInfo_t) + tlSize +
+                  lenInfo->rootContBlobSize +
+                  lenInfo->spContBlobSize +
+                  lenInfo->tlContBlobSize;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/** Appends the containers to a registry object holding an SP TA.
+ * @return regobj, or NULL after freeing it on failure. */
+static regObject_t *completeServiceBlob(regObject_t *regobj, mcSpid_t spid, uint32_t tlSize)
+{
+    if (!appendContainers(regobj, spid, tlSize)) {
+        free(regobj);
+        return NULL;
+    }
+    return regobj;
+}
+
+//------------------------------------------------------------------------------
+regObject_t *mcRegistryMemGetServiceBlob(mcSpid_t spid, void *trustlet, uint32_t tlSize)
+{
+    regObject_t *regobj = NULL;
+
+    // Ensure that a UUID is provided.
+    if (NULL == trustlet) {
+        LOG_E("No trustlet buffer given");
+        return NULL;
+    }
+
+    if (!checkServiceHeader(trustlet, tlSize)) {
+        return NULL;
+    }
+
+    // Get service type.
+    mclfHeaderV2_t *pHeader = (mclfHeaderV2_t *)trustlet;
+#ifndef NDEBUG
+    {
+        const char *service_types[] = {
+            "illegal", "Driver", "Trustlet", "System Trustlet", "Middleware"
+        };
+        int serviceType_safe = pHeader->serviceType > SERVICE_TYPE_MIDDLEWARE ? SERVICE_TYPE_ILLEGAL : pHeader->serviceType;
+        LOG_I(" Service is a %s (service type %d)", service_types[serviceType_safe], pHeader->serviceType);
+    }
+#endif
+
+    LOG_I(" Trustlet text %u data %u ", pHeader->text.len, pHeader->data.len);
+
+    if (NULL == (regobj = allocServiceBlob(pHeader->serviceType, tlSize))) {
+        return NULL;
+    }
+    // Fill in trustlet blob after the len info
+    memcpy(regobj->value + regobj->tlStartOffset, trustlet, tlSize);
+    return completeServiceBlob(regobj, spid, tlSize);
+}
+
+//------------------------------------------------------------------------------
+regObject_t *mcRegistryMapTABlobFileObject(mcSpid_t spid, regBlobFile_t *file)
+{
+    const size_t page = sysconf(_SC_PAGESIZE);
+
+    if (file->data == NULL) {
+        return NULL;
+    }
+    if (!checkServiceHeader(file->data, file->size)) {
+        return NULL;
+    }
+    mclfHeaderV2_t *pHeader = (mclfHeaderV2_t *)file->data;
+    uint32_t head, tail;
+    if (pHeader->serviceType == SERVICE_TYPE_SP_TRUSTLET) {
+        head = sizeof(mcBlobLenInfo_t);
+        tail = 3 * MAX_SO_CONT_SIZE;
+    } else if (pHeader->serviceType == SERVICE_TYPE_DRIVER ||
+               pHeader->serviceType == SERVICE_TYPE_MIDDLEWARE ||
+               pHeader->serviceType == SERVICE_TYPE_SYSTEM_TRUSTLET) {
+        head = 0;
+        tail = 0;
     } else {
-        LOG_E("mcRegistryMemGetServiceBlob() failed: Unsupported service type %u", pHeader->serviceType);
+        LOG_E("TA blob has unsupported service type %u", pHeader->serviceType);
+        return NULL;
+    }
+
+    // One page for the object header and length info in front of the blob,
+    // the containers go behind it, partly into the last page of the file
+    size_t len = page + ((size_t)file->size + tail + page - 1) / page * page;
+    uint8_t *map = (uint8_t *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        LOG_ERRNO("mmap");
+        return NULL;
     }
+    // Private and from a read-only descriptor, so that the containers
+    // written behind the end of the file never reach it. Only the last page
+    // of the blob becomes a copy.
+    int fd = open(file->path, O_RDONLY);
+    if (fd == -1) {
+        LOG_ERRNO("open");
+        munmap(map, len);
+        return NULL;
+    }
+    void *blob = mmap(map + page, file->size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED, fd, 0);
+    close(fd);
+    if (blob == MAP_FAILED) {
+        LOG_ERRNO("mmap");
+        munmap(map, len);
+        return NULL;
+    }
+    regObject_t *regobj = (regObject_t *)(map + page - head - sizeof(regObject_t));
+    regobj->len = file->size;
+    regobj->tlStartOffset = head;
+    if (head != 0) {
+        regobj->len += head + tail;
+        ((mcBlobLenInfo_ptr)regobj->value)->magic = MC_TLBLOBLEN_MAGIC;
+    }
+    if (!appendContainers(regobj, spid, file->size)) {
+        munmap(map, len);
+        return NULL;
+    }
+    file->object = map;
+    file->objectLen = len;
     return regobj;
 }
 
+//------------------------------------------------------------------------------
+/** Loads a compressed TA binary, inflating it straight into the registry
+ * object in a single pass.
+ * @return NULL with *compressed false if the binary is not compressed. */
+static regObject_t *inflateServiceBlob(const char *trustlet, mcSpid_t spid, bool *compressed)
+{
+    regBinReader_t r;
+    regZHeader_t header;
+
+    *compressed = false;
+    if (!openBinary(&r, trustlet, &header)) {
+        return NULL;
+    }
+    if (!r.compressed) {
+        closeBinary(&r);
+        return NULL;
+    }
+    *compressed = true;
+
+    // Nothing of the file header is trusted until the MCLF header it
+    // describes has been read and checked
+    mclfHeaderV2_t mclf;
+    regObject_t *regobj = NULL;
+    if (header.size > REG_ZBIN_MAX_SIZE ||
+            readBinary(&r, &mclf, sizeof(mclf)) != sizeof(mclf) ||
+            !checkServiceHeader(&mclf, header.size) ||
+            mclf.serviceType != header.serviceType) {
+        LOG_E("Corrupt compressed TA binary %s", trustlet);
+    } else if (NULL != (regobj = allocServiceBlob(mclf.serviceType, header.size))) {
+        uint8_t *tl = regobj->value + regobj->tlStartOffset;
+        memcpy(tl, &mclf, sizeof(mclf));
+        uint32_t rest = header.size - sizeof(mclf);
+        if (readBinary(&r, tl + sizeof(mclf), rest) != rest) {
+            LOG_E("Corrupt compressed TA binary %s", trustlet);
+            free(regobj);
+            regobj = NULL;
+        }
+    }
+    closeBinary(&r);
+    if (regobj == NULL) {
+        return NULL;
+    }
+    return completeServiceBlob(regobj, spid, header.size);
+}
 
 //------------------------------------------------------------------------------
 regObject_t *mcRegistryFileGetServiceBlob(const char *trustlet, mcSpid_t spid)
 {
     struct stat sb;
+    struct timespec start, end;
     regObject_t *regobj = NULL;
+    bool compressed;
     void *buffer;
 
     // Ensure that a file name is provided.
@@ -1393,39 +2969,53 @@ regObject_t *mcRegistryFileGetServiceBlob(const char *trustlet, mcSpid_t spid)
         return NULL;
     }
 
-    int fd = open(trustlet, O_RDONLY);
-    if (fd == -1) {
-        LOG_W("Cannot open %s", trustlet);
-        return NULL;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    regobj = inflateServiceBlob(trustlet, spid, &compressed);
+    if (compressed) {
+        goto done;
     }
 
-    if (fstat(fd, &sb) == -1) {
-        LOG_E("mcRegistryFileGetServiceBlob() failed: Cound't get file size");
-        goto error;
-    }
+    {
+        int fd = open(trustlet, O_RDONLY);
+        if (fd == -1) {
+            LOG_W("Cannot open %s", trustlet);
+            return NULL;
+        }
 
-    buffer = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (buffer == MAP_FAILED) {
-        LOG_E("mcRegistryFileGetServiceBlob(): Failed to map file to memory");
-        goto error;
-    }
+        if (fstat(fd, &sb) == -1) {
+            LOG_E("mcRegistryFileGetServiceBlob() failed: Cound't get file size");
+            goto error;
+        }
+
+        buffer = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buffer == MAP_FAILED) {
+            LOG_E("mcRegistryFileGetServiceBlob(): Failed to map file to memory");
+            goto error;
+        }
 
-    regobj = mcRegistryMemGetServiceBlob(spid, buffer, sb.st_size);
+        regobj = mcRegistryMemGetServiceBlob(spid, buffer, sb.st_size);
 
-    // We don't actually care if either of them fails but should still print warnings
-    if (munmap(buffer, sb.st_size)) {
-        LOG_E("mcRegistryFileGetServiceBlob(): Failed to unmap memory");
-    }
+        // We don't actually care if either of them fails but should still print warnings
+        if (munmap(buffer, sb.st_size)) {
+            LOG_E("mcRegistryFileGetServiceBlob(): Failed to unmap memory");
+        }
 
 error:
-    if (close(fd)) {
-        LOG_E("mcRegistryFileGetServiceBlob(): Failed to close file %s", trustlet);
+        if (close(fd)) {
+            LOG_E("mcRegistryFileGetServiceBlob(): Failed to close file %s", trustlet);
+        }
     }
 
+done:
+    if (regobj != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        LOG_I("Loaded %s TA binary %s in %ld us (%u bytes)", compressed ? "compressed" : "raw",
+              trustlet, (long)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000),
+              regobj->len);
+    }
     return regobj;
 }
 
-
 //------------------------------------------------------------------------------
 regObject_t *mcRegistryGetServiceBlob(const mcUuid_t *uuid, bool isGpUuid)
 {
@@ -1435,34 +3025,41 @@ regObject_t *mcRegistryGetServiceBlob(const mcUuid_t *uuid, bool isGpUuid)
         return NULL;
     }
 
-    // Open service blob file.
-    string tlBinFilePath;
-    if (isGpUuid) {
-        tlBinFilePath = getTABinFilePath(uuid, MC_REGISTRY_ALL);
-    } else {
-        tlBinFilePath = getTlBinFilePath(uuid, MC_REGISTRY_ALL);
+    // Resolve service blob file through the registry index.
+    string uuidStr = byteArrayToString(uuid, sizeof(*uuid));
+    regIndexEntry_t entry;
+    regIndexLookup(uuidStr + (isGpUuid ? GP_TA_BIN_FILE_EXT : TL_BIN_FILE_EXT), entry);
+    if (!entry.present) {
+        LOG_W("Cannot find %s", entry.path.c_str());
+        return NULL;
     }
-    LOG_I("Loading %s", tlBinFilePath.c_str());
+    LOG_I("Loading %s (%ld bytes)", entry.path.c_str(), (long)entry.size);
 
     mcSpid_t spid = 0;
     if (isGpUuid) {
-        string taspidFilePath = getTASpidFilePath(uuid, MC_REGISTRY_ALL);
-        int fd = open(taspidFilePath.c_str(), O_RDONLY);
-        if (fd == -1) {
-            // This can be ok for System TAs
-            //LOG_ERRNO("open");
-            //LOG_E("Cannot open %s", taspidFilePath.c_str());
-            //return NULL;
-        } else {
-            if (read(fd, &spid, sizeof(mcSpid_t))!=sizeof(mcSpid_t)) {
-                close(fd);
+        // A missing spid file can be ok for System TAs
+        regIndexEntry_t spidEntry;
+        regIndexLookup(uuidStr + GP_TA_SPID_FILE_EXT, spidEntry);
+        if (spidEntry.present) {
+            if (spidEntry.size != sizeof(mcSpid_t)) {
                 return NULL;
             }
-            close(fd);
+            spid = spidEntry.spid;
         }
     }
 
-    return mcRegistryFileGetServiceBlob(tlBinFilePath.c_str(), spid);
+    if (spid != 0) {
+        regObject_t *regobj = readServiceImage(uuidStr, entry, spid);
+        if (regobj != NULL) {
+            LOG_I("Loaded precomposed image (%u bytes)", regobj->len);
+            return regobj;
+        }
+        // No image yet, e.g. for a TA installed by an older daemon. This
+        // runs under the daemon's registry read lock, so nothing is written
+        // here: images are composed by the store functions and by
+        // mcRegistryComposeImages() in the background.
+    }
+    return mcRegistryFileGetServiceBlob(entry.path.c_str(), spid);
 }
 
 //------------------------------------------------------------------------------
@@ -34,7 +34,10 @@
 #ifndef MOBICORE_REGISTRY_H_
 #define MOBICORE_REGISTRY_H_
 
+#include <limits.h>
+
 #include "MobiCoreDriverApi.h"
+#include "MobiCoreRegistryBatch.h"
 #include "mcContainer.h"
 
 #ifdef __cplusplus
@@ -50,6 +53,19 @@ extern "C" {
         uint8_t value[];
     } regObject_t;
 
+    /**
+     * TA blob being received into the registry.
+     */
+    typedef struct {
+        int fd;                 /**< Temporary file, -1 if none. */
+        uint32_t size;          /**< Expected blob size. */
+        uint32_t written;       /**< Bytes written so far. */
+        void *data;             /**< Read-only mapping of the complete blob. */
+        void *object;           /**< Mapping of the registry object built around the blob. */
+        size_t objectLen;       /**< Length of that mapping. */
+        char path[PATH_MAX];    /**< Temporary file path, empty once stored. */
+    } regBlobFile_t;
+
 //-----------------------------------------------------------------
 
     /** Stores an authentication token in registry.
@@ -148,6 +164,11 @@ extern "C" {
      */
     mcResult_t mcRegistryCleanupGPTAStorage(mcUuid_t *uuid);
 
+    /** Changes whenever the storage of a GP TA is deleted, so that caches of
+     * that storage know to drop what they hold.
+     */
+    uint32_t mcRegistryStorageGeneration(void);
+
     /** Stores a data container secure object in the registry.
      * @param so Data container secure object.
      * @param size Data container secure object size
@@ -186,6 +207,15 @@ extern "C" {
      */
     regObject_t *mcRegistryMemGetServiceBlob(mcSpid_t spid, void *trustlet, uint32_t tlSize);
 
+    /** Returns a registry object for a given service from a file
+     * @param trustlet path of the trustlet binary
+     * @param spid Service provider ID(ignored for System TLs)
+     * @return Registry object.
+     * @note It is the responsibility of the caller to free the registry object
+     * allocated by this function.
+     */
+    regObject_t *mcRegistryFileGetServiceBlob(const char *trustlet, mcSpid_t spid);
+
     /** Returns a registry object for a given service.
      * @param uuid service UUID
      * @return Registry object.
@@ -218,6 +248,108 @@ extern "C" {
      */
     mcResult_t mcRegistryStoreTABlob(mcSpid_t spid, void *blob, uint32_t size);
 
+    /** Creates a temporary file in the registry to receive a TA blob in
+     * pieces, so that large blobs need not be held in memory.
+     * @param file Blob file to initialise. Close it also on failure.
+     * @param size Size of the TA blob.
+     * @return MC_DRV_OK if successful, otherwise error code.
+     */
+    mcResult_t mcRegistryOpenTABlobFile(regBlobFile_t *file, uint32_t size);
+
+    /** Appends a piece of a TA blob.
+     * @param file Blob file.
+     * @param data Next piece of the blob.
+     * @param len Length of data.
+     * @return MC_DRV_OK if successful, otherwise error code.
+     */
+    mcResult_t mcRegistryWriteTABlobFile(regBlobFile_t *file, const void *data, uint32_t len);
+
+    /** Syncs a completely received TA blob and maps it to file->data.
+     * @param file Blob file.
+     * @return MC_DRV_OK if successful, otherwise error code.
+     */
+    mcResult_t mcRegistryMapTABlobFile(regBlobFile_t *file);
+
+    /** Builds the registry object of a received and mapped TA blob, mapping
+     * the blob in place rather than copying it. Only the containers of an
+     * SP TA are read into it.
+     * @param spid SPID of the trustlet container.
+     * @param file Blob file.
+     * @return Registry object, valid until the file is closed. NULL if the
+     * blob is invalid or a container is missing.
+     */
+    regObject_t *mcRegistryMapTABlobFileObject(mcSpid_t spid, regBlobFile_t *file);
+
+    /** Stores a received and mapped TA blob in the registry. The temporary
+     * file is moved in place, the data is not copied.
+     * @param spid SPID of the trustlet container.
+     * @param file Blob file.
+     * @return MC_DRV_OK if successful, otherwise error code.
+     */
+    mcResult_t mcRegistryStoreTABlobFile(mcSpid_t spid, regBlobFile_t *file);
+
+    /** Releases a blob file and removes its temporary file if not stored.
+     * @param file Blob file.
+     */
+    void mcRegistryCloseTABlobFile(regBlobFile_t *file);
+
+    /** Stores a set of containers and TA blobs as one transaction.
+     * All items are written and synced first, then moved in place together;
+     * if any item fails nothing is stored. The failing item reports its own
+     * error and the others MC_DRV_ERR_INVALID_OPERATION.
+     * @param items Items to store, result is set for each of them.
+     * @param count Number of items, at most MC_REG_BATCH_MAX.
+     * @return MC_DRV_OK if all items were stored, otherwise error code.
+     */
+    mcResult_t mcRegistryStoreBatch(mcRegistryBatchItem_t *items, uint32_t count);
+
+    /** Selects how stores are made durable. Every store writes a temporary
+     * file, syncs it and renames it over the old one. By default each store
+     * then syncs the directory; in group commit mode concurrent stores share
+     * one directory sync.
+     * @param enable true for group commit.
+     */
+    void mcRegistrySetGroupCommit(bool enable);
+
+    /** Selects the storage layout of TA blobs. In content store mode each
+     * distinct blob is stored once, named after its content, and the TA
+     * blob files of the registry are hard links to it.
+     * @param enable true for the content store.
+     */
+    void mcRegistrySetContentStore(bool enable);
+
+    /** Removes content store objects no longer referenced by any TA. Stores
+     * and cleanups remove the objects they stop referring to themselves, this
+     * full sweep collects those left behind by an interrupted run. To be
+     * called at start-up, before any store.
+     */
+    void mcRegistryCollectObjects(void);
+
+    /** Removes the temporary files of stores interrupted by a restart, such
+     * as staged files and received TA blobs. To be called at start-up, before
+     * mcRegistryCollectObjects() and any store.
+     */
+    void mcRegistryRemoveStagedFiles(void);
+
+    /** Composes the images of the SP TAs which have none or a stale one, e.g.
+     * TAs installed by an older daemon or shipped in the read-only registry.
+     * Opening a session only reads images, so this runs in the background
+     * after start-up, with the registry locked for reading.
+     */
+    void mcRegistryComposeImages(void);
+
+    /** Selects whether TA blobs are stored compressed. Blobs which do not
+     * compress, such as encrypted ones, are always stored as they are.
+     * @param enable true to compress.
+     */
+    void mcRegistrySetCompression(bool enable);
+
+    /** Removes deleted registry data in the background. Cleanups only move
+     * data directories aside as tombstones; this also collects the tombstones
+     * left behind by a previous run.
+     */
+    void mcRegistryReapTombstones(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -32,6 +32,7 @@
 #define MOBICORE_REGISTRY_H_
 
 #include "MobiCoreDriverApi.h"
+#include "MobiCoreRegistryBatch.h"
 #include "mcContainer.h"
 
 #ifdef __cplusplus
@@ -142,6 +143,16 @@ extern "C" {
      */
     mcResult_t mcRegistryStoreTABlob(mcSpid_t spid, void *blob, uint32_t size);
 
+    /** Stores a set of containers and TA blobs as one transaction.
+     * All items are written and synced first, then moved in place together;
+     * if any item fails nothing is stored. The failing item reports its own
+     * error and the others MC_DRV_ERR_INVALID_OPERATION.
+     * @param items Items to store, result is set for each of them.
+     * @param count Number of items, at most MC_REG_BATCH_MAX.
+     * @return MC_DRV_OK if all items were stored, otherwise error code.
+     */
+    mcResult_t mcRegistryStoreBatch(mcRegistryBatchItem_t *items, uint32_t count);
+
 #ifdef __cplusplus
 }
 #endif
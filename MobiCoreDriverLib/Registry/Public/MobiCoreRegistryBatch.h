@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2013-2014 TRUSTONIC LIMITED
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the TRUSTONIC LIMITED nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ * MobiCore Registry batch items, shared by the public and the private
+ * registry interface.
+ */
+#ifndef MOBICORE_REGISTRY_BATCH_H_
+#define MOBICORE_REGISTRY_BATCH_H_
+
+#include "MobiCoreDriverApi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /** Item types of a registry batch. */
+#define MC_REG_ITEM_AUTH_TOKEN  1
+#define MC_REG_ITEM_ROOT_CONT   2
+#define MC_REG_ITEM_SP_CONT     3
+#define MC_REG_ITEM_TL_CONT     4
+#define MC_REG_ITEM_TA_BLOB     5
+
+    /** Maximum number of items in a registry batch. */
+#define MC_REG_BATCH_MAX        64
+
+    /**
+     * Registry batch item.
+     */
+    typedef struct {
+        uint32_t type;      /**< One of MC_REG_ITEM_*. */
+        mcSpid_t spid;      /**< SPID of SP container, TL container and TA blob items. */
+        mcUuid_t uuid;      /**< UUID of TL container items. */
+        void *so;           /**< Secure object or TA blob. */
+        uint32_t size;      /**< Size of so. */
+        mcResult_t result;  /**< [out] Status of the item. */
+    } mcRegistryBatchItem_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MOBICORE_REGISTRY_BATCH_H_
+
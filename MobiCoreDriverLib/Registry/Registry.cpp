@@ -44,6 +44,7 @@
 #include <string>
 #include <cstring>
 #include <cstddef>
+#include <pthread.h>
 #include "mcLoadFormat.h"
 #include "mcSpid.h"
 #include "mcVersionHelper.h"
@@ -56,38 +57,182 @@
 #include "Connection.h"
 
 #define DAEMON_TIMEOUT 30000
+/** Number of idle daemon connections kept for reuse. */
+#define DAEMON_POOL_SIZE 4
 
 using namespace std;
 
+/** Idle daemon connections. Each one is used by a single command exchange at
+ * a time and only returned after a complete, well-framed response. */
+static Connection *daemonPool[DAEMON_POOL_SIZE];
+static uint32_t daemonPoolCount = 0;
+static pthread_mutex_t daemonPoolMutex = PTHREAD_MUTEX_INITIALIZER;
 
-static mcResult_t writeBlobData(void *buff, uint32_t len)
+//------------------------------------------------------------------------------
+static Connection *getConnection(bool *reused)
+{
+    Connection *con = NULL;
+
+    pthread_mutex_lock(&daemonPoolMutex);
+    if (daemonPoolCount > 0) {
+        con = daemonPool[--daemonPoolCount];
+    }
+    pthread_mutex_unlock(&daemonPoolMutex);
+
+    *reused = (con != NULL);
+    if (con == NULL) {
+        con = new Connection();
+        if (!con->connect(SOCK_PATH)) {
+            LOG_E("Failed to connect to daemon!");
+            delete con;
+            return NULL;
+        }
+    }
+    return con;
+}
+
+//------------------------------------------------------------------------------
+static void putConnection(Connection *con)
+{
+    pthread_mutex_lock(&daemonPoolMutex);
+    if (daemonPoolCount < DAEMON_POOL_SIZE) {
+        daemonPool[daemonPoolCount++] = con;
+        con = NULL;
+    }
+    pthread_mutex_unlock(&daemonPoolMutex);
+    delete con;
+}
+
+//------------------------------------------------------------------------------
+static ssize_t readFully(Connection *con, void *buff, uint32_t len)
+{
+    uint8_t *p = (uint8_t *)buff;
+    uint32_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = con->readData(p + done, len - done, DAEMON_TIMEOUT);
+        if (ret <= 0) {
+            return ret;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+//------------------------------------------------------------------------------
+/** Sends a command to the daemon and reads the response header.
+ * A pooled connection which the daemon has closed in the meantime is replaced
+ * by a fresh one once. Bulk data, if any, is sent straight from the caller's
+ * buffer after the command.
+ * @return Connection to read the rest of the response from, NULL on error.
+ */
+static Connection *sendCommand(void *buff, uint32_t len, mcDrvResponseHeader_t *rsp,
+                               void *data = NULL, uint32_t dataLen = 0)
+{
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused;
+        Connection *con = getConnection(&reused);
+        if (con == NULL) {
+            return NULL;
+        }
+
+        ssize_t ret = con->writeData(buff, len);
+        if (ret > 0 && dataLen > 0) {
+            ret = con->writeData(data, dataLen);
+        }
+        if (ret > 0) {
+            ret = readFully(con, rsp, sizeof(*rsp));
+            if (ret > 0) {
+                return con;
+            }
+        }
+        delete con;
+
+        if (!reused || ret < -1) {
+            break;
+        }
+        LOG_I("Daemon connection lost, reconnecting");
+    }
+    LOG_E("Failed to get answer from daemon!");
+    return NULL;
+}
+
+static mcResult_t writeBlobData(void *buff, uint32_t len, void *data = NULL, uint32_t dataLen = 0)
 {
-    Connection con;
 mcDrvResponseHeader_t rsp = { responseId :
                                   MC_DRV_ERR_INVALID_PARAMETER
                                 };
-    if (!con.connect(SOCK_PATH)) {
-        LOG_E("Failed to connect to daemon!");
+    Connection *con = sendCommand(buff, len, &rsp, data, dataLen);
+    if (con == NULL) {
         return MC_DRV_ERR_DAEMON_SOCKET;
     }
+    putConnection(con);
 
-    if (con.writeData(buff, len) <= 0) {
-        LOG_E("Failed to send daemon to data!");
-        return MC_DRV_ERR_DAEMON_SOCKET;
+    return rsp.responseId;
+}
+
+//------------------------------------------------------------------------------
+/** Daemons from 0.6 on answer the sized read commands, whose response tells
+ * the data size. Older ones only know the original read commands.
+ * @return true if the sized read commands can be used. */
+static bool daemonHasSizedReads(void)
+{
+    static uint32_t version = 0;
+mcDrvCommandHeader_t cmd = { commandId :
+                                 MC_DRV_CMD_GET_VERSION
+                               };
+mcDrvResponseHeader_t rsp = { responseId :
+                                  MC_DRV_ERR_INVALID_PARAMETER
+                                };
+    uint32_t v;
+
+    pthread_mutex_lock(&daemonPoolMutex);
+    v = version;
+    pthread_mutex_unlock(&daemonPoolMutex);
+    if (v != 0) {
+        return v >= MC_MAKE_VERSION(0, 6);
     }
 
-    if (con.readData(&rsp, sizeof(rsp), DAEMON_TIMEOUT) <= 0) {
-        LOG_E("Failed to get answer from daemon!");
-        return MC_DRV_ERR_DAEMON_SOCKET;
+    Connection *con = sendCommand(&cmd, sizeof(cmd), &rsp);
+    if (con == NULL) {
+        return false;
+    }
+    if (rsp.responseId != MC_DRV_OK || readFully(con, &v, sizeof(v)) <= 0) {
+        delete con;
+        return false;
     }
+    putConnection(con);
 
-    return rsp.responseId;
+    pthread_mutex_lock(&daemonPoolMutex);
+    version = v;
+    pthread_mutex_unlock(&daemonPoolMutex);
+    return v >= MC_MAKE_VERSION(0, 6);
 }
 
+//------------------------------------------------------------------------------
+static uint32_t sizedReadCommand(uint32_t commandId)
+{
+    switch (commandId) {
+    case MC_DRV_REG_READ_AUTH_TOKEN:
+        return MC_DRV_REG_READ_AUTH_TOKEN_SIZED;
+    case MC_DRV_REG_READ_ROOT_CONT:
+        return MC_DRV_REG_READ_ROOT_CONT_SIZED;
+    case MC_DRV_REG_READ_SP_CONT:
+        return MC_DRV_REG_READ_SP_CONT_SIZED;
+    case MC_DRV_REG_READ_TL_CONT:
+        return MC_DRV_REG_READ_TL_CONT_SIZED;
+    default:
+        return commandId;
+    }
+}
+
+//------------------------------------------------------------------------------
+/** Sends a read command, whose buffer starts with the command ID, and reads
+ * the returned data into rbuff. */
 static mcResult_t readBlobData(void *buff, uint32_t len, void *rbuff, uint32_t *rlen)
 {
-    Connection con;
-    int32_t size;
+    uint32_t size;
+    uint8_t discard[64];
 mcDrvResponseHeader_t rsp = { responseId :
                                   MC_DRV_ERR_INVALID_PARAMETER
                                 };
@@ -96,30 +241,59 @@ mcDrvResponseHeader_t rsp = { responseId :
         return MC_DRV_ERR_DAEMON_SOCKET;
     }
 
-    if (!con.connect(SOCK_PATH)) {
-        LOG_E("Failed to connect to daemon!");
-        return MC_DRV_ERR_DAEMON_SOCKET;
+    bool sized = daemonHasSizedReads();
+    if (sized) {
+        uint32_t *commandId = (uint32_t *)buff;
+        *commandId = sizedReadCommand(*commandId);
     }
 
-    if (con.writeData(buff, len) <= 0) {
-        LOG_E("Failed to send daemon to data!");
+    // First read the response
+    Connection *con = sendCommand(buff, len, &rsp);
+    if (con == NULL) {
         return MC_DRV_ERR_DAEMON_SOCKET;
     }
+    if (rsp.responseId == MC_DRV_ERR_INVALID_OPERATION) {
+        // Nothing follows
+        putConnection(con);
+        return rsp.responseId;
+    }
 
-    // First read the response
-    if (con.readData(&rsp, sizeof(rsp), DAEMON_TIMEOUT) <= 0) {
+    if (!sized) {
+        // Original layout: the data alone, so the connection cannot be reused
+        ssize_t ret = con->readData(rbuff, *rlen, DAEMON_TIMEOUT);
+        delete con;
+        if (ret <= 0) {
+            LOG_E("Failed to get answer from daemon!");
+            return MC_DRV_ERR_DAEMON_SOCKET;
+        }
+        *rlen = ret;
+        return rsp.responseId;
+    }
+
+    // Then the data size and the actual data
+    if (readFully(con, &size, sizeof(size)) <= 0) {
         LOG_E("Failed to get answer from daemon!");
+        delete con;
         return MC_DRV_ERR_DAEMON_SOCKET;
     }
-
-    //Then read the actual data
-    size = con.readData(rbuff, *rlen, DAEMON_TIMEOUT);
-    if (size <= 0) {
+    uint32_t keep = size < *rlen ? size : *rlen;
+    if (readFully(con, rbuff, keep) < 0) {
         LOG_E("Failed to get answer from daemon!");
+        delete con;
         return MC_DRV_ERR_DAEMON_SOCKET;
     }
+    // Drop what does not fit, the connection is reused
+    for (uint32_t left = size - keep; left > 0;) {
+        uint32_t chunk = left < sizeof(discard) ? left : sizeof(discard);
+        if (readFully(con, discard, chunk) <= 0) {
+            delete con;
+            return MC_DRV_ERR_DAEMON_SOCKET;
+        }
+        left -= chunk;
+    }
+    putConnection(con);
     // Return also the read buf size
-    *rlen = (uint32_t)size;
+    *rlen = keep;
 
     return rsp.responseId;
 }
@@ -320,24 +494,83 @@ mcResult_t mcRegistryStoreTABlob(mcSpid_t spid, void *blob, uint32_t size)
         uint32_t commandId;
         uint32_t blobSize;
         mcSpid_t spid;
-        uint8_t blob[];
     } storeCmd;
 
-    mcResult_t ret;
-    storeCmd *cmd = (storeCmd *)malloc(sizeof(storeCmd) + size);
+    // The blob can be megabytes, send it without copying
+    storeCmd cmd;
+    cmd.commandId = MC_DRV_REG_STORE_TA_BLOB;
+    cmd.blobSize = size;
+    cmd.spid = spid;
+
+    return writeBlobData(&cmd, sizeof(cmd), blob, size);
+}
+
+//------------------------------------------------------------------------------
+mcResult_t mcRegistryStoreBatch(mcRegistryBatchItem_t *items, uint32_t count)
+{
+    typedef struct {
+        uint32_t commandId;
+        uint32_t count;
+    } batchCmd;
+
+mcDrvResponseHeader_t rsp = { responseId :
+                                  MC_DRV_ERR_INVALID_PARAMETER
+                                };
+    uint32_t i, len = sizeof(batchCmd);
+
+    if (items == NULL || count == 0 || count > MC_REG_BATCH_MAX) {
+        return MC_DRV_ERR_INVALID_PARAMETER;
+    }
+    for (i = 0; i < count; i++) {
+        if (items[i].so == NULL) {
+            return MC_DRV_ERR_INVALID_PARAMETER;
+        }
+        items[i].result = MC_DRV_ERR_INVALID_OPERATION;
+        len += sizeof(mcDrvRegBatchItem_t) + items[i].size;
+    }
+
+    // Whole batch goes out in one message
+    uint8_t *cmd = (uint8_t *)malloc(len);
     if (cmd == NULL) {
         LOG_E("Allocation failure");
         return MC_DRV_ERR_NO_FREE_MEMORY;
     }
+    batchCmd *hdr = (batchCmd *)cmd;
+    hdr->commandId = MC_DRV_REG_STORE_BATCH;
+    hdr->count = count;
+    uint8_t *p = cmd + sizeof(batchCmd);
+    for (i = 0; i < count; i++) {
+        mcDrvRegBatchItem_t item;
+        item.type = items[i].type;
+        item.spid = items[i].spid;
+        memcpy(&item.uuid, &items[i].uuid, sizeof(mcUuid_t));
+        item.size = items[i].size;
+        memcpy(p, &item, sizeof(item));
+        p += sizeof(item);
+        memcpy(p, items[i].so, items[i].size);
+        p += items[i].size;
+    }
 
-    cmd->commandId = MC_DRV_REG_STORE_TA_BLOB;
-    cmd->blobSize = size;
-    cmd->spid = spid;
-    memcpy(&cmd->blob, blob, size);
-
-    ret = writeBlobData(cmd, sizeof(storeCmd) + size);
+    Connection *con = sendCommand(cmd, len, &rsp);
     free(cmd);
-    return ret;
+    if (con == NULL) {
+        return MC_DRV_ERR_DAEMON_SOCKET;
+    }
+    if (rsp.responseId == MC_DRV_ERR_INVALID_OPERATION) {
+        // Rejected as a whole, no item status follows
+        delete con;
+        return rsp.responseId;
+    }
+    for (i = 0; i < count; i++) {
+        if (readFully(con, &items[i].result, sizeof(items[i].result)) <= 0) {
+            LOG_E("Failed to get answer from daemon!");
+            delete con;
+            return MC_DRV_ERR_DAEMON_SOCKET;
+        }
+    }
+    putConnection(con);
+
+    return rsp.responseId;
 }
 
 //------------------------------------------------------------------------------